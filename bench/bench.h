@@ -0,0 +1,86 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- hooks into the ProFTPD stubs and the fake
+ *  db-lib that the bench programs link mod_sql_tds.c against.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include "conf.h"
+#include <sybfront.h>
+#include <sybdb.h>
+
+/*
+ * bench_pool_stats_struct: what every pool has been asked for.  peak is
+ *  the high-water mark of live, which bench_pool_mark() resets.
+ */
+struct bench_pool_stats_struct {
+  unsigned long allocs;     /* palloc/pcalloc calls, string copies too */
+  size_t live;              /* bytes held by pools not yet destroyed   */
+  size_t peak;
+};
+
+extern struct bench_pool_stats_struct bench_pool_stats;
+
+/* sets up permanent_pool, main_server and session */
+void bench_init(void);
+
+/* starts a new high-water mark from what is live now */
+void bench_pool_mark(void);
+
+/* runs a configuration directive handler with the NULL terminated
+ * arguments, as if it came from the root of proftpd.conf; exits if the
+ * handler refuses them
+ */
+void bench_directive(modret_t *(*)(cmd_rec *), const char *, ...);
+
+extern int bench_verbose;
+extern int bench_trace_level;
+
+/*
+ * fakedb_config_struct: the shape and cost of what the fake db-lib
+ *  serves.  Every SELECT gets rows rows of cols columns; types picks each
+ *  column's type in turn ('v' varchar, 'c' char, 'i' int, 'd' datetime,
+ *  'b' binary), and width is the length of the character and binary ones.
+ */
+struct fakedb_config_struct {
+  unsigned long rows;
+  int cols;
+  int width;
+  const char *types;
+
+  unsigned long latency_us;       /* each dbsqlok and dbuse             */
+  unsigned long login_latency_us; /* each dbopen                        */
+
+  unsigned long fail_every;       /* fail every Nth statement, 0 never  */
+  DBINT fail_msgno;               /* the server error reported for it   */
+  int refuse_logins;              /* dbopen fails                       */
+};
+
+extern struct fakedb_config_struct fakedb_config;
+
+/*
+ * fakedb_stats_struct: what the fake db-lib has been asked to do.
+ */
+struct fakedb_stats_struct {
+  unsigned long logins;
+  unsigned long batches;          /* dbsqlexec/dbsqlok and RPC calls    */
+  unsigned long statements;
+  unsigned long rows;             /* rows handed out by dbnextrow       */
+  unsigned long bcp_rows;
+};
+
+extern struct fakedb_stats_struct fakedb_stats;
+
+/* the text of the last batch sent on any connection */
+const char *fakedb_last_batch(void);
+
+/* makes a connection look like it died */
+void fakedb_kill(DBPROCESS *);
+
+#endif /* BENCH_BENCH_H */
@@ -0,0 +1,307 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- measures the module's hot paths against
+ *  the fake db-lib: reading result sets (_build_data), putting together
+ *  cmd_select's query, cmd_select from end to end, and
+ *  cmd_escapestring.  For each it reports the time per call and per row,
+ *  the pool allocations made per call and the most pool memory held at
+ *  once during a call.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "../mod_sql_tds.c"
+#include "bench.h"
+
+#define BENCH_CONN  "bench"
+
+/*
+ * bench_result_struct: the totals for one benchmark.
+ */
+struct bench_result_struct {
+  unsigned long calls;
+  unsigned long rows;
+  long long ns;
+  unsigned long allocs;
+  size_t peak;              /* most bytes held at once during one call */
+};
+
+static unsigned long bench_iterations = 10000;
+
+static long long _bench_ns(struct timespec *from, struct timespec *to){
+  return (to->tv_sec - from->tv_sec) * 1000000000LL +
+    (to->tv_nsec - from->tv_nsec);
+}
+
+static void _bench_report(const char *name, const char *shape,
+    struct bench_result_struct *res){
+  printf("%-18s %-22s %10.0f %10.1f %10.1f %12lu\n", name, shape,
+    (double) res->ns / res->calls,
+    res->rows ? (double) res->ns / res->rows : 0.0,
+    (double) res->allocs / res->calls, (unsigned long) res->peak);
+}
+
+/*
+ * BENCH_START, BENCH_END: put timing and pool accounting around one call
+ *  of a benchmark, and add them to its totals.
+ */
+#define BENCH_START(res, live, t0) do { \
+    bench_pool_mark(); \
+    (live) = bench_pool_stats.live; \
+    (res)->allocs -= bench_pool_stats.allocs; \
+    clock_gettime(CLOCK_MONOTONIC, &(t0)); \
+  } while (0)
+
+#define BENCH_END(res, live, t0) do { \
+    struct timespec t1; \
+    clock_gettime(CLOCK_MONOTONIC, &t1); \
+    (res)->ns += _bench_ns(&(t0), &t1); \
+    (res)->allocs += bench_pool_stats.allocs; \
+    if (bench_pool_stats.peak - (live) > (res)->peak) \
+      (res)->peak = bench_pool_stats.peak - (live); \
+    (res)->calls++; \
+  } while (0)
+
+static db_conn_t *_bench_conn(void){
+  conn_entry_t *entry = _sql_get_connection(BENCH_CONN);
+
+  return (db_conn_t *) entry->data;
+}
+
+/*
+ * _bench_build_data: reads result sets of nrows rows with _build_data,
+ *  the way cmd_select and cmd_procedure do once the statement has run.
+ */
+static void _bench_build_data(unsigned long nrows){
+  struct bench_result_struct res;
+  db_conn_t *conn = _bench_conn();
+  struct timespec t0;
+  modret_t *mr = NULL;
+  cmd_rec *cmd = NULL;
+  char shape[64];
+  size_t live;
+  unsigned long x, n;
+
+  memset(&res, 0, sizeof(res));
+  fakedb_config.rows = nrows;
+
+  /* keep the number of rows read about the same for every size */
+  n = bench_iterations / (nrows ? nrows : 1);
+  if (n < 10)
+    n = 10;
+
+  for (x = 0; x < n; x++) {
+    cmd = _sql_make_cmd(session.pool, 1, BENCH_CONN);
+
+    dbcmd(conn->dbproc, "SELECT * FROM bench");
+    if (dbsqlexec(conn->dbproc) != SUCCEED ||
+        dbresults(conn->dbproc) != SUCCEED) {
+      fprintf(stderr, "fake db-lib refused the query\n");
+      exit(1);
+    }
+
+    BENCH_START(&res, live, t0);
+    mr = _build_data(cmd, conn);
+    BENCH_END(&res, live, t0);
+
+    if (MODRET_ERROR(mr) || ((sql_data_t *) mr->data)->rnum != nrows) {
+      fprintf(stderr, "_build_data read the wrong number of rows\n");
+      exit(1);
+    }
+    res.rows += nrows;
+
+    while (dbresults(conn->dbproc) != NO_MORE_RESULTS)
+      ;
+    SQL_FREE_CMD(cmd);
+  }
+
+  snprintf(shape, sizeof(shape), "%lu rows x %d %s", nrows,
+    fakedb_config.cols, fakedb_config.types);
+  _bench_report("build_data", shape, &res);
+}
+
+/*
+ * _bench_build_select: puts together the query of a typical user lookup.
+ */
+static void _bench_build_select(void){
+  struct bench_result_struct res;
+  struct timespec t0;
+  cmd_rec *cmd = NULL;
+  char *query = NULL;
+  size_t live;
+  unsigned long x;
+
+  memset(&res, 0, sizeof(res));
+
+  for (x = 0; x < bench_iterations; x++) {
+    cmd = _sql_make_cmd(session.pool, 5, BENCH_CONN, "users",
+      "userid, passwd, uid, gid, homedir, shell", "userid = 'someone'", "1");
+
+    BENCH_START(&res, live, t0);
+    query = _sql_build_select(cmd);
+    BENCH_END(&res, live, t0);
+
+    if (x == 0 && strcmp(query, "SELECT TOP 1 userid, passwd, uid, gid, "
+        "homedir, shell FROM users WHERE userid = 'someone'") != 0) {
+      fprintf(stderr, "unexpected query \"%s\"\n", query);
+      exit(1);
+    }
+
+    SQL_FREE_CMD(cmd);
+  }
+
+  _bench_report("build_select", "6 fields, where, top", &res);
+}
+
+/*
+ * _bench_select: runs cmd_select from end to end on an open connection,
+ *  with whatever latency the fake db-lib was given.
+ */
+static void _bench_select(unsigned long nrows){
+  struct bench_result_struct res;
+  struct timespec t0;
+  modret_t *mr = NULL;
+  cmd_rec *cmd = NULL;
+  char shape[64];
+  size_t live;
+  unsigned long x, n;
+
+  memset(&res, 0, sizeof(res));
+  fakedb_config.rows = nrows;
+
+  n = fakedb_config.latency_us ? 1000 : bench_iterations;
+
+  for (x = 0; x < n; x++) {
+    cmd = _sql_make_cmd(session.pool, 4, BENCH_CONN, "users",
+      "userid, passwd, uid, gid, homedir, shell", "userid = 'someone'");
+
+    BENCH_START(&res, live, t0);
+    mr = cmd_select(cmd);
+    BENCH_END(&res, live, t0);
+
+    if (MODRET_ERROR(mr)) {
+      fprintf(stderr, "cmd_select failed: %s\n", mr->mr_message);
+      exit(1);
+    }
+    res.rows += nrows;
+
+    SQL_FREE_CMD(cmd);
+  }
+
+  snprintf(shape, sizeof(shape), "%lu rows, %luus latency", nrows,
+    fakedb_config.latency_us);
+  _bench_report("cmd_select", shape, &res);
+}
+
+/*
+ * _bench_escape: escapes str with cmd_escapestring.
+ */
+static void _bench_escape(const char *name, const char *str){
+  struct bench_result_struct res;
+  struct timespec t0;
+  modret_t *mr = NULL;
+  cmd_rec *cmd = NULL;
+  size_t live;
+  unsigned long x;
+
+  memset(&res, 0, sizeof(res));
+
+  for (x = 0; x < bench_iterations; x++) {
+    cmd = _sql_make_cmd(session.pool, 2, BENCH_CONN, str);
+
+    BENCH_START(&res, live, t0);
+    mr = cmd_escapestring(cmd);
+    BENCH_END(&res, live, t0);
+
+    if (MODRET_ERROR(mr)) {
+      fprintf(stderr, "cmd_escapestring failed\n");
+      exit(1);
+    }
+
+    SQL_FREE_CMD(cmd);
+  }
+
+  _bench_report("escapestring", name, &res);
+}
+
+static void _bench_usage(void){
+  fprintf(stderr,
+    "usage: bench_tds [-n iterations] [-r rows,...] [-c cols] [-w width]\n"
+    "                 [-t types] [-l latency-us] [-v]\n"
+    "  types is one letter per column, repeated to fill them:\n"
+    "  v varchar, c char, i int, d datetime, b binary\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]){
+  const char *rowlist = "1,10,100,1000";
+  unsigned long latency = 0, nrows;
+  char *list = NULL, *ptr = NULL;
+  char *longstr = NULL;
+  cmd_rec *cmd = NULL;
+  modret_t *mr = NULL;
+  int opt;
+
+  fakedb_config.cols = 6;
+  fakedb_config.width = 16;
+  fakedb_config.types = "vvviiv";
+
+  while ((opt = getopt(argc, argv, "n:r:c:w:t:l:v")) != -1) {
+    switch (opt) {
+      case 'n': bench_iterations = strtoul(optarg, NULL, 10); break;
+      case 'r': rowlist = optarg; break;
+      case 'c': fakedb_config.cols = atoi(optarg); break;
+      case 'w': fakedb_config.width = atoi(optarg); break;
+      case 't': fakedb_config.types = optarg; break;
+      case 'l': latency = strtoul(optarg, NULL, 10); break;
+      case 'v': bench_verbose = TRUE; break;
+      default: _bench_usage();
+    }
+  }
+
+  if (bench_iterations == 0 || fakedb_config.cols < 1 ||
+      fakedb_config.width < 1 || *fakedb_config.types == '\0')
+    _bench_usage();
+
+  bench_init();
+  sql_tds_sess_init();
+
+  cmd = _sql_make_cmd(session.pool, 4, BENCH_CONN, "user", "secret",
+    "bench@fakedb");
+  mr = cmd_defineconnection(cmd);
+  if (!MODRET_ERROR(mr))
+    mr = cmd_open(cmd);
+  if (MODRET_ERROR(mr)) {
+    fprintf(stderr, "unable to open the bench connection\n");
+    return 1;
+  }
+
+  printf("%-18s %-22s %10s %10s %10s %12s\n", "benchmark", "shape", "ns/call",
+    "ns/row", "allocs", "peak bytes");
+
+  list = strdup(rowlist);
+  for (ptr = strtok(list, ","); ptr; ptr = strtok(NULL, ","))
+    _bench_build_data(strtoul(ptr, NULL, 10));
+
+  _bench_build_select();
+
+  fakedb_config.latency_us = latency;
+  nrows = strtoul(rowlist, NULL, 10);
+  _bench_select(nrows ? nrows : 1);
+  fakedb_config.latency_us = 0;
+
+  longstr = malloc(4097);
+  memset(longstr, 'x', 4096);
+  longstr[4096] = '\0';
+  longstr[1000] = '\'';
+
+  _bench_escape("short, no quotes", "someone");
+  _bench_escape("short, quoted", "o'brien \"x\"");
+  _bench_escape("4k, one quote", longstr);
+
+  free(longstr);
+  free(list);
+  return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- broker_test, tests of the SQLTDSBroker
+ *  protocol and of a broker run against the fake db-lib: frame encoding
+ *  and decoding, requests arriving a byte at a time, and sessions whose
+ *  statements go through real broker workers, fail in them, or fall back
+ *  to a connection of their own when the broker is gone.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "../mod_sql_tds.c"
+#include "bench.h"
+
+#include <sys/wait.h>
+
+#define TEST_CONN       "test"
+#define TEST_INFO       "ftp@fakedb"
+#define TEST_USER       "proftpd"
+#define TEST_PASS       "secret"
+
+static unsigned long test_checks = 0;
+static unsigned long test_failed = 0;
+static char test_socket[108];
+
+#define CHECK(cond) do { \
+    test_checks++; \
+    if (!(cond)) { \
+      test_failed++; \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+        #cond); \
+    } \
+  } while (0)
+
+/*
+ * _test_request: builds a request frame the way _sql_broker_call does.
+ */
+static char *_test_request(pool *p, uint32_t magic, unsigned char op,
+    uint32_t login, const char *query, size_t *len){
+  char *buf = NULL, *ptr = NULL;
+  size_t plen = sizeof(uint32_t) + strlen(query) + 1;
+
+  magic = htonl(magic);
+  buf = palloc(p, TDS_BROKER_REQ_HDRLEN + plen);
+  memcpy(buf, &magic, sizeof(uint32_t));
+  buf[sizeof(uint32_t)] = (char) op;
+  ptr = _sql_broker_put_u32(buf + sizeof(uint32_t) + 1, login);
+  ptr = _sql_broker_put_u32(ptr, (uint32_t) plen);
+  ptr = _sql_broker_put_str(ptr, query, strlen(query));
+
+  *len = ptr - buf;
+  return buf;
+}
+
+static void _test_socketpair(int fds[2]){
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    perror("socketpair");
+    exit(2);
+  }
+}
+
+/* a fresh pair for a new case, the worker's end non-blocking */
+static void _test_reopen(int fds[2]){
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+
+  _test_socketpair(fds);
+  (void) fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * _test_frames: strings and integers survive a trip through a frame, and
+ *  truncated or unterminated strings are refused.
+ */
+static void _test_frames(void){
+  pool *p = make_sub_pool(permanent_pool);
+  char *buf = palloc(p, 256), *ptr = NULL, *end = NULL, *str = NULL;
+  uint32_t val = 0;
+
+  ptr = _sql_broker_put_u32(buf, 0x01020304);
+  CHECK(ptr == buf + 4);
+  CHECK(memcmp(buf, "\x01\x02\x03\x04", 4) == 0);
+
+  ptr = _sql_broker_put_str(ptr, "userid", 6);
+  ptr = _sql_broker_put_str(ptr, "", 0);
+  ptr = _sql_broker_put_str(ptr, "o'brien", 7);
+  CHECK(ptr == buf + 4 + (4 + 7) + (4 + 1) + (4 + 8));
+  end = ptr;
+
+  ptr = buf;
+  CHECK(_sql_broker_get_u32(&ptr, end, &val) == 0 && val == 0x01020304);
+  CHECK((str = _sql_broker_get_str(&ptr, end)) && !strcmp(str, "userid"));
+  CHECK((str = _sql_broker_get_str(&ptr, end)) && !strcmp(str, ""));
+  CHECK((str = _sql_broker_get_str(&ptr, end)) && !strcmp(str, "o'brien"));
+  CHECK(ptr == end);
+  CHECK(_sql_broker_get_u32(&ptr, end, &val) < 0);
+  CHECK(_sql_broker_get_str(&ptr, end) == NULL);
+
+  /* a string running past the end of the frame */
+  ptr = buf;
+  end = _sql_broker_put_str(buf, "userid", 6) - 1;
+  CHECK(_sql_broker_get_str(&ptr, end) == NULL);
+
+  /* a string without its terminator */
+  end = _sql_broker_put_str(buf, "userid", 6);
+  buf[4 + 6] = 'x';
+  ptr = buf;
+  CHECK(_sql_broker_get_str(&ptr, end) == NULL);
+
+  /* a length that would wrap around */
+  ptr = _sql_broker_put_u32(buf, 0xffffffff);
+  end = ptr + 8;
+  ptr = buf;
+  CHECK(_sql_broker_get_str(&ptr, end) == NULL);
+
+  destroy_pool(p);
+}
+
+/*
+ * _test_replies: each kind of reply reads back as it was sent.
+ */
+static void _test_replies(void){
+  pool *p = make_sub_pool(permanent_pool);
+  char *data[] = { "user1", "", "1001", "user2", "x y", "1002", NULL };
+  sql_data_t sd;
+  char hdr[1 + sizeof(uint32_t)], *payload = NULL, *ptr = NULL, *end = NULL;
+  char *str = NULL;
+  uint32_t len = 0, rnum = 0, fnum = 0;
+  int fds[2], x;
+
+  _test_socketpair(fds);
+
+  sd.rnum = 2;
+  sd.fnum = 3;
+  sd.data = data;
+  CHECK(_sql_broker_reply(p, fds[0], TDS_BROKER_DATA, &sd, NULL) == 0);
+  payload = _sql_broker_read_frame(p, fds[1], hdr, sizeof(hdr), &len);
+  CHECK(payload != NULL && hdr[0] == TDS_BROKER_DATA);
+  if (payload) {
+    ptr = payload;
+    end = payload + len;
+    CHECK(_sql_broker_get_u32(&ptr, end, &rnum) == 0 && rnum == 2);
+    CHECK(_sql_broker_get_u32(&ptr, end, &fnum) == 0 && fnum == 3);
+    for (x = 0; x < 6; x++)
+      CHECK((str = _sql_broker_get_str(&ptr, end)) && !strcmp(str, data[x]));
+    CHECK(ptr == end);
+  }
+
+  CHECK(_sql_broker_reply(p, fds[0], TDS_BROKER_ERROR, NULL,
+    "query timed out") == 0);
+  payload = _sql_broker_read_frame(p, fds[1], hdr, sizeof(hdr), &len);
+  CHECK(payload != NULL && hdr[0] == TDS_BROKER_ERROR);
+  if (payload) {
+    ptr = payload;
+    CHECK((str = _sql_broker_get_str(&ptr, payload + len)) &&
+      !strcmp(str, "query timed out"));
+  }
+
+  CHECK(_sql_broker_reply(p, fds[0], TDS_BROKER_OK, NULL, NULL) == 0);
+  payload = _sql_broker_read_frame(p, fds[1], hdr, sizeof(hdr), &len);
+  CHECK(payload != NULL && hdr[0] == TDS_BROKER_OK && len == 0);
+
+  /* a frame claiming more than the limit isn't read */
+  hdr[0] = TDS_BROKER_OK;
+  _sql_broker_put_u32(hdr + 1, TDS_BROKER_MAX_FRAME + 1);
+  CHECK(write(fds[0], hdr, sizeof(hdr)) == sizeof(hdr));
+  CHECK(_sql_broker_read_frame(p, fds[1], hdr, sizeof(hdr), &len) == NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  destroy_pool(p);
+}
+
+/*
+ * _test_recv: a worker reads a request that arrives a byte at a time,
+ *  and drops sessions that send garbage or go away half way through.
+ */
+static void _test_recv(void){
+  pool *p = make_sub_pool(permanent_pool);
+  broker_client_t client;
+  char *req = NULL, *ptr = NULL, *query = NULL;
+  size_t len = 0, x;
+  int fds[2] = { -1, -1 }, res = 0;
+
+  _test_reopen(fds);
+  memset(&client, 0, sizeof(client));
+
+  /* nothing there yet */
+  CHECK(_sql_broker_recv(&client, fds[1]) == 0);
+  CHECK(client.pool != NULL && client.have == 0);
+
+  req = _test_request(p, TDS_BROKER_MAGIC, TDS_BROKER_OP_SELECT, 0,
+    "SELECT userid FROM users", &len);
+  for (x = 0; x < len; x++) {
+    CHECK(write(fds[0], req + x, 1) == 1);
+    res = _sql_broker_recv(&client, fds[1]);
+    if (x + 1 < len && res != 0)
+      break;
+  }
+  CHECK(x == len && res == 1);
+  CHECK(client.hdr[sizeof(uint32_t)] == TDS_BROKER_OP_SELECT);
+
+  ptr = client.payload;
+  CHECK((query = _sql_broker_get_str(&ptr, client.payload + client.len)) &&
+    !strcmp(query, "SELECT userid FROM users"));
+  destroy_pool(client.pool);
+  client.pool = NULL;
+
+  /* the whole of a second request at once */
+  req = _test_request(p, TDS_BROKER_MAGIC, TDS_BROKER_OP_EXEC, 0,
+    "DELETE FROM log", &len);
+  CHECK(write(fds[0], req, len) == (ssize_t) len);
+  while ((res = _sql_broker_recv(&client, fds[1])) == 0)
+    ;
+  CHECK(res == 1 && client.hdr[sizeof(uint32_t)] == TDS_BROKER_OP_EXEC);
+  destroy_pool(client.pool);
+  client.pool = NULL;
+
+  /* the wrong magic */
+  _test_reopen(fds);
+  req = _test_request(p, 0x48545450, TDS_BROKER_OP_EXEC, 0, "x", &len);
+  CHECK(write(fds[0], req, len) == (ssize_t) len);
+  CHECK(_sql_broker_recv(&client, fds[1]) == -1);
+  destroy_pool(client.pool);
+  client.pool = NULL;
+
+  /* more than the limit */
+  _test_reopen(fds);
+  req = _test_request(p, TDS_BROKER_MAGIC, TDS_BROKER_OP_EXEC, 0, "x", &len);
+  _sql_broker_put_u32(req + 1 + 2 * sizeof(uint32_t),
+    TDS_BROKER_MAX_FRAME + 1);
+  CHECK(write(fds[0], req, TDS_BROKER_REQ_HDRLEN) ==
+    (ssize_t) TDS_BROKER_REQ_HDRLEN);
+  CHECK(_sql_broker_recv(&client, fds[1]) == -1);
+  destroy_pool(client.pool);
+  client.pool = NULL;
+
+  /* gone half way through */
+  _test_reopen(fds);
+  req = _test_request(p, TDS_BROKER_MAGIC, TDS_BROKER_OP_EXEC, 0,
+    "DELETE FROM log", &len);
+  CHECK(write(fds[0], req, len - 3) == (ssize_t) (len - 3));
+  close(fds[0]);
+  while ((res = _sql_broker_recv(&client, fds[1])) == 0)
+    ;
+  CHECK(res == -1);
+  destroy_pool(client.pool);
+
+  close(fds[1]);
+  destroy_pool(p);
+}
+
+/*
+ * _test_lost: a worker that dies after reading a request.  A statement
+ *  that may already have run is not sent again; a lookup is left to the
+ *  session's own connection, since the broker can't be reached again.
+ */
+static void _test_lost(void){
+  cmd_rec *cmd = NULL;
+  modret_t *mr = NULL;
+  conn_entry_t *entry = NULL;
+  broker_client_t client;
+  pid_t pid;
+  int fds[2], op;
+
+  sql_tds_sess_init();
+  cmd = _sql_make_cmd(session.pool, 4, TEST_CONN, TEST_USER, TEST_PASS,
+    TEST_INFO);
+  mr = cmd_defineconnection(cmd);
+  CHECK(!MODRET_ERROR(mr));
+  entry = _sql_get_connection(TEST_CONN);
+  CHECK(entry != NULL && _sql_broker_login((db_conn_t *) entry->data) == 0);
+  if (entry == NULL)
+    return;
+
+  for (op = TDS_BROKER_OP_SELECT; op <= TDS_BROKER_OP_EXEC; op++) {
+    _test_socketpair(fds);
+
+    pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      memset(&client, 0, sizeof(client));
+      while (_sql_broker_recv(&client, fds[1]) == 0)
+        ;
+      _exit(0);
+    }
+    close(fds[1]);
+
+    tds_broker_fd = fds[0];
+    mr = _sql_broker_call(cmd, (db_conn_t *) entry->data, op,
+      op == TDS_BROKER_OP_SELECT ? "SELECT 1" : "DELETE FROM log");
+    if (op == TDS_BROKER_OP_SELECT) {
+      CHECK(mr == NULL);
+    } else {
+      CHECK(mr != NULL && MODRET_ERROR(mr) &&
+        !strcmp(mr->mr_message, "lost connection to broker"));
+    }
+    CHECK(tds_broker_fd == -1);
+
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/*
+ * _test_session: in a process of its own, as a proftpd session would
+ *  be, opens the test connection and runs a lookup and an insert.
+ *  brokered says whether the broker should have been used, fail whether
+ *  the statements should have failed there.
+ */
+static void _test_session(int brokered, int fail){
+  struct fakedb_stats_struct stats;
+  cmd_rec *cmd = NULL;
+  modret_t *mr = NULL;
+  conn_entry_t *entry = NULL;
+  sql_data_t *sd = NULL;
+  pid_t pid;
+  int status = 0;
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(2);
+  }
+
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+    test_checks++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      test_failed++;
+      fprintf(stderr, "session (brokered %d, failing %d) failed\n", brokered,
+        fail);
+    }
+    return;
+  }
+
+  test_checks = test_failed = 0;
+  memset(&fakedb_stats, 0, sizeof(fakedb_stats));
+
+  sql_tds_sess_init();
+  CHECK((tds_broker_fd >= 0) == brokered);
+
+  cmd = _sql_make_cmd(session.pool, 4, TEST_CONN, TEST_USER, TEST_PASS,
+    TEST_INFO);
+  mr = cmd_defineconnection(cmd);
+  if (!MODRET_ERROR(mr))
+    mr = cmd_open(cmd);
+  CHECK(!MODRET_ERROR(mr));
+
+  entry = _sql_get_connection(TEST_CONN);
+  CHECK(entry != NULL);
+  if (entry == NULL)
+    _exit(1);
+
+  cmd = _sql_make_cmd(session.pool, 5, TEST_CONN, "users",
+    "userid, passwd, uid, gid, homedir, shell", "userid = 'user1'", "1");
+  mr = cmd_select(cmd);
+  if (fail) {
+    CHECK(MODRET_ERROR(mr));
+
+  } else {
+    CHECK(!MODRET_ERROR(mr) && mr->data != NULL);
+    if (!MODRET_ERROR(mr) && (sd = mr->data) != NULL) {
+      CHECK(sd->rnum == fakedb_config.rows &&
+        sd->fnum == (unsigned long) fakedb_config.cols);
+      CHECK(sd->data != NULL && sd->data[0] != NULL);
+    }
+  }
+
+  cmd = _sql_make_cmd(session.pool, 4, TEST_CONN, "xferlog",
+    "userid, command", "'user1', 'RETR'");
+  mr = cmd_insert(cmd);
+  CHECK(MODRET_ERROR(mr) == fail);
+
+  /* a brokered session never logs in itself */
+  stats = fakedb_stats;
+  CHECK(brokered ? stats.logins == 0 && stats.statements == 0 :
+    stats.logins == 1 && stats.statements > 0);
+  CHECK(((db_conn_t *) entry->data)->dbproc == NULL || !brokered);
+
+  cmd = _sql_make_cmd(session.pool, 1, TEST_CONN);
+  CHECK(!MODRET_ERROR(cmd_exit(cmd)));
+
+  fprintf(stderr, "session (brokered %d, failing %d): %lu checks, "
+    "%lu failed\n", brokered, fail, test_checks, test_failed);
+  _exit(test_failed ? 1 : 0);
+}
+
+int main(int argc, char *argv[]){
+  int opt;
+
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    switch (opt) {
+      case 'v': bench_verbose = TRUE; break;
+      default:
+        fprintf(stderr, "usage: broker_test [-v]\n");
+        return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  bench_init();
+  snprintf(test_socket, sizeof(test_socket), "/tmp/broker_test.%lu.sock",
+    (unsigned long) getpid());
+
+  fakedb_config.rows = 3;
+  fakedb_config.cols = 6;
+  fakedb_config.width = 16;
+  fakedb_config.types = "vvviiv";
+
+  /* what proftpd.conf would have said */
+  add_config_param("SQLConnectInfo", 3, TEST_INFO, TEST_USER, TEST_PASS);
+  bench_directive(set_sqltdsbroker, "SQLTDSBroker", test_socket, "2", NULL);
+
+  _test_frames();
+  _test_replies();
+  _test_recv();
+
+  _sql_broker_start();
+  CHECK(tds_broker_listenfd >= 0 && tds_broker_nworkers == 2);
+  CHECK(tds_broker_logins != NULL && tds_broker_logins->nelts == 1);
+
+  /* through the broker */
+  _test_session(TRUE, FALSE);
+
+  /* through the broker, failing in the workers */
+  _sql_broker_stop();
+  fakedb_config.fail_every = 1;
+  _sql_broker_start();
+  _test_session(TRUE, TRUE);
+  fakedb_config.fail_every = 0;
+
+  /* with the broker gone, but its logins still known, on the session's
+   * own connection
+   */
+  _sql_broker_stop();
+  (void) unlink(test_socket);
+  tds_broker_pool = make_sub_pool(permanent_pool);
+  _sql_broker_logins();
+  _test_session(FALSE, FALSE);
+
+  /* a worker lost during a request, in a session of our own */
+  _test_lost();
+
+  printf("broker_test: %lu checks, %lu failed\n", test_checks, test_failed);
+  return test_failed ? 1 : 0;
+}
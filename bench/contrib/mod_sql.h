@@ -0,0 +1,41 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- the parts of mod_sql.h that
+ *  mod_sql_tds.c uses, backed by the stubs in stubs.c.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_MOD_SQL_H
+#define BENCH_MOD_SQL_H
+
+#define MOD_SQL_API_V1  "mod_sql_api_v1"
+
+typedef struct sql_data_struct {
+  unsigned long rnum;     /* number of rows of data    */
+  unsigned long fnum;     /* number of fields per row  */
+  char **data;            /* data[rnum][fnum]          */
+} sql_data_t;
+
+#define SQL_CONN_POLICY_PERSESSION  1
+#define SQL_CONN_POLICY_TIMER       2
+#define SQL_CONN_POLICY_PERCALL     3
+#define SQL_CONN_POLICY_PERCONN     4
+
+extern int pr_sql_conn_policy;
+
+#define DEBUG_FUNC  5
+#define DEBUG_AUTH  4
+#define DEBUG_INFO  3
+#define DEBUG_WARN  2
+
+int sql_log(int, const char *, ...);
+cmd_rec *_sql_make_cmd(pool *, int, ...);
+int sql_register_backend(const char *, cmdtable *);
+int sql_unregister_backend(const char *);
+
+#define SQL_FREE_CMD(c)   destroy_pool((c)->pool)
+
+#endif /* BENCH_MOD_SQL_H */
@@ -0,0 +1,652 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- a fake db-lib.  No server is involved:
+ *  every SELECT gets a synthetic result set shaped by fakedb_config, and
+ *  every other statement affects one row.  A batch holds one statement
+ *  per line.  Latency and statement failures can be injected.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "bench.h"
+#include <syberror.h>
+#include <pthread.h>
+
+struct fakedb_config_struct fakedb_config = {
+  1, 1, 16, "v", 0, 0, 0, 2627, FALSE
+};
+
+struct fakedb_stats_struct fakedb_stats;
+
+struct loginrec {
+  char user[128];
+  char db[128];
+};
+
+/*
+ * fakedb_col_struct: one column of the current result set, and its value
+ *  in the current row.
+ */
+struct fakedb_col_struct {
+  int type;
+  DBINT len;
+  char name[16];
+  char *text;               /* character and binary values              */
+  DBINT i4;
+  DBDATETIME dt;
+};
+
+struct dbprocess {
+  int dead;
+  BYTE *userdata;
+
+  char *batch;              /* statements to be sent, one per line      */
+  size_t len, size;
+
+  char *next;               /* first statement without a result yet     */
+  int sent;
+  int pending;              /* dbsqlok has set up the first result      */
+
+  int ncols;                /* the current result                       */
+  struct fakedb_col_struct *cols;
+  unsigned long nrows, row;
+  DBINT count;
+
+  unsigned long bcp_rows, bcp_batched;
+};
+
+static EHANDLEFUNC fakedb_errhandler = NULL;
+static MHANDLEFUNC fakedb_msghandler = NULL;
+
+static pthread_mutex_t fakedb_lock = PTHREAD_MUTEX_INITIALIZER;
+static char fakedb_last[4096];
+
+static void _fakedb_sleep(unsigned long us){
+  struct timespec ts;
+
+  if (us == 0)
+    return;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+const char *fakedb_last_batch(void){
+  return fakedb_last;
+}
+
+void fakedb_kill(DBPROCESS *dbproc){
+  dbproc->dead = TRUE;
+  if (fakedb_errhandler)
+    fakedb_errhandler(dbproc, EXCOMM, 20019, 0,
+      "Read from the server failed", "Connection reset by peer");
+}
+
+static void _fakedb_server_error(DBPROCESS *dbproc){
+  char text[64];
+
+  snprintf(text, sizeof(text), "fake server error %ld",
+    (long) fakedb_config.fail_msgno);
+
+  if (fakedb_msghandler)
+    fakedb_msghandler(dbproc, fakedb_config.fail_msgno, 1, 14, text,
+      "fakedb", "", 1);
+  if (fakedb_errhandler)
+    fakedb_errhandler(dbproc, EXINFO, SYBESMSG, 0,
+      "General SQL Server error: Check messages from the SQL Server", "");
+}
+
+/*
+ * _fakedb_next_stmt: finds the next statement of the batch, returning its
+ *  length, or 0 if there are no more.
+ */
+static size_t _fakedb_next_stmt(DBPROCESS *dbproc, const char **stmt){
+  size_t len = 0;
+
+  while (dbproc->next && (*dbproc->next == '\n' || *dbproc->next == ' '))
+    dbproc->next++;
+
+  if (dbproc->next == NULL || *dbproc->next == '\0')
+    return 0;
+
+  *stmt = dbproc->next;
+  while (dbproc->next[len] && dbproc->next[len] != '\n')
+    len++;
+
+  dbproc->next += len;
+  return len;
+}
+
+static void _fakedb_free_cols(DBPROCESS *dbproc){
+  int x;
+
+  for (x = 0; x < dbproc->ncols; x++)
+    free(dbproc->cols[x].text);
+  free(dbproc->cols);
+  dbproc->cols = NULL;
+  dbproc->ncols = 0;
+  dbproc->nrows = dbproc->row = 0;
+}
+
+/*
+ * _fakedb_result: sets up the result of one statement.
+ *
+ * Returns: SUCCEED, or FAIL if the statement was made to fail.
+ */
+static RETCODE _fakedb_result(DBPROCESS *dbproc, const char *stmt,
+    size_t len){
+  unsigned long n;
+  const char *types = fakedb_config.types;
+  int x, width = fakedb_config.width;
+
+  _fakedb_free_cols(dbproc);
+  dbproc->count = -1;
+
+  n = __sync_add_and_fetch(&fakedb_stats.statements, 1);
+  if (fakedb_config.fail_every && n % fakedb_config.fail_every == 0) {
+    _fakedb_server_error(dbproc);
+    return FAIL;
+  }
+
+  while (len && isspace((int) *stmt)) {
+    stmt++;
+    len--;
+  }
+
+  if (len < 6 || strncasecmp(stmt, "SELECT", 6)) {
+    dbproc->count = 1;
+    return SUCCEED;
+  }
+
+  dbproc->ncols = fakedb_config.cols;
+  dbproc->nrows = fakedb_config.rows;
+  dbproc->cols = calloc(dbproc->ncols, sizeof(struct fakedb_col_struct));
+
+  for (x = 0; x < dbproc->ncols; x++) {
+    struct fakedb_col_struct *col = &dbproc->cols[x];
+
+    snprintf(col->name, sizeof(col->name), "c%d", x + 1);
+    switch (types[x % strlen(types)]) {
+      case 'i':
+        col->type = SYBINT4;
+        col->len = sizeof(DBINT);
+        break;
+
+      case 'd':
+        col->type = SYBDATETIME;
+        col->len = sizeof(DBDATETIME);
+        break;
+
+      case 'b':
+        col->type = SYBBINARY;
+        col->len = width;
+        break;
+
+      case 'c':
+        col->type = SYBCHAR;
+        col->len = width;
+        break;
+
+      default:
+        col->type = SYBVARCHAR;
+        col->len = width;
+        break;
+    }
+
+    col->text = malloc(width + 1);
+    memset(col->text, 'a' + x % 26, width);
+    col->text[width] = '\0';
+  }
+
+  return SUCCEED;
+}
+
+RETCODE dbinit(void){
+  return SUCCEED;
+}
+
+void dbexit(void){
+}
+
+EHANDLEFUNC dberrhandle(EHANDLEFUNC handler){
+  EHANDLEFUNC old = fakedb_errhandler;
+
+  fakedb_errhandler = handler;
+  return old;
+}
+
+MHANDLEFUNC dbmsghandle(MHANDLEFUNC handler){
+  MHANDLEFUNC old = fakedb_msghandler;
+
+  fakedb_msghandler = handler;
+  return old;
+}
+
+LOGINREC *dblogin(void){
+  return calloc(1, sizeof(LOGINREC));
+}
+
+void dbloginfree(LOGINREC *login){
+  free(login);
+}
+
+RETCODE dbsetlname(LOGINREC *login, const char *value, int which){
+  if (which == DBSETUSER)
+    snprintf(login->user, sizeof(login->user), "%s", value);
+  else if (which == DBSETDBNAME)
+    snprintf(login->db, sizeof(login->db), "%s", value);
+  return SUCCEED;
+}
+
+RETCODE dbsetlbool(LOGINREC *login, int value, int which){
+  return SUCCEED;
+}
+
+RETCODE dbsetlogintime(int secs){
+  return SUCCEED;
+}
+
+DBPROCESS *dbopen(LOGINREC *login, const char *server){
+  _fakedb_sleep(fakedb_config.login_latency_us);
+
+  if (fakedb_config.refuse_logins) {
+    if (fakedb_errhandler)
+      fakedb_errhandler(NULL, EXCOMM, 20009, 111,
+        "Unable to connect: Adaptive Server is unavailable or does not exist",
+        "Connection refused");
+    return NULL;
+  }
+
+  __sync_fetch_and_add(&fakedb_stats.logins, 1);
+  return calloc(1, sizeof(DBPROCESS));
+}
+
+void dbclose(DBPROCESS *dbproc){
+  if (dbproc == NULL)
+    return;
+
+  _fakedb_free_cols(dbproc);
+  free(dbproc->batch);
+  free(dbproc);
+}
+
+RETCODE dbuse(DBPROCESS *dbproc, const char *db){
+  _fakedb_sleep(fakedb_config.latency_us);
+  return dbproc->dead ? FAIL : SUCCEED;
+}
+
+DBBOOL dbdead(DBPROCESS *dbproc){
+  return dbproc == NULL || dbproc->dead;
+}
+
+RETCODE dbsetopt(DBPROCESS *dbproc, int option, const char *value, int n){
+  return SUCCEED;
+}
+
+void dbsetuserdata(DBPROCESS *dbproc, BYTE *data){
+  dbproc->userdata = data;
+}
+
+BYTE *dbgetuserdata(DBPROCESS *dbproc){
+  return dbproc ? dbproc->userdata : NULL;
+}
+
+RETCODE dbcmd(DBPROCESS *dbproc, const char *cmd){
+  size_t len = strlen(cmd);
+
+  /* a new batch once the last one has been sent */
+  if (dbproc->sent) {
+    dbproc->len = 0;
+    dbproc->sent = FALSE;
+  }
+
+  if (dbproc->len + len + 1 > dbproc->size) {
+    dbproc->size = (dbproc->len + len + 1) * 2;
+    dbproc->batch = realloc(dbproc->batch, dbproc->size);
+  }
+
+  memcpy(dbproc->batch + dbproc->len, cmd, len + 1);
+  dbproc->len += len;
+  return SUCCEED;
+}
+
+RETCODE dbsqlsend(DBPROCESS *dbproc){
+  if (dbproc->dead)
+    return FAIL;
+
+  dbproc->sent = TRUE;
+  dbproc->pending = FALSE;
+  dbproc->next = dbproc->batch;
+  _fakedb_free_cols(dbproc);
+  __sync_fetch_and_add(&fakedb_stats.batches, 1);
+
+  pthread_mutex_lock(&fakedb_lock);
+  snprintf(fakedb_last, sizeof(fakedb_last), "%s",
+    dbproc->batch ? dbproc->batch : "");
+  pthread_mutex_unlock(&fakedb_lock);
+
+  return SUCCEED;
+}
+
+/*
+ * dbsqlok: waits for the server's answer.  Like db-lib, a first
+ *  statement that fails fails the whole call, and its result is consumed.
+ */
+RETCODE dbsqlok(DBPROCESS *dbproc){
+  const char *stmt = NULL;
+  size_t len;
+
+  _fakedb_sleep(fakedb_config.latency_us);
+  if (dbproc->dead)
+    return FAIL;
+
+  len = _fakedb_next_stmt(dbproc, &stmt);
+  if (len == 0)
+    return SUCCEED;
+
+  if (_fakedb_result(dbproc, stmt, len) == FAIL)
+    return FAIL;
+
+  /* the first dbresults() hands this result out */
+  dbproc->pending = TRUE;
+  return SUCCEED;
+}
+
+RETCODE dbsqlexec(DBPROCESS *dbproc){
+  if (dbsqlsend(dbproc) == FAIL)
+    return FAIL;
+
+  return dbsqlok(dbproc);
+}
+
+RETCODE dbresults(DBPROCESS *dbproc){
+  const char *stmt = NULL;
+  size_t len;
+
+  if (dbproc->dead)
+    return FAIL;
+
+  if (dbproc->pending) {
+    dbproc->pending = FALSE;
+    return SUCCEED;
+  }
+
+  len = _fakedb_next_stmt(dbproc, &stmt);
+  if (len == 0) {
+    _fakedb_free_cols(dbproc);
+    return NO_MORE_RESULTS;
+  }
+
+  return _fakedb_result(dbproc, stmt, len);
+}
+
+RETCODE dbcancel(DBPROCESS *dbproc){
+  _fakedb_free_cols(dbproc);
+  dbproc->next = NULL;
+  dbproc->pending = FALSE;
+  return SUCCEED;
+}
+
+RETCODE dbcanquery(DBPROCESS *dbproc){
+  dbproc->row = dbproc->nrows;
+  return SUCCEED;
+}
+
+DBINT dbcount(DBPROCESS *dbproc){
+  if (dbproc->ncols > 0)
+    return dbproc->row == dbproc->nrows ? (DBINT) dbproc->nrows : -1;
+
+  return dbproc->count;
+}
+
+int dbnumcols(DBPROCESS *dbproc){
+  return dbproc->ncols;
+}
+
+char *dbcolname(DBPROCESS *dbproc, int col){
+  if (col < 1 || col > dbproc->ncols)
+    return NULL;
+
+  return dbproc->cols[col - 1].name;
+}
+
+int dbcoltype(DBPROCESS *dbproc, int col){
+  if (col < 1 || col > dbproc->ncols)
+    return -1;
+
+  return dbproc->cols[col - 1].type;
+}
+
+DBINT dbcollen(DBPROCESS *dbproc, int col){
+  if (col < 1 || col > dbproc->ncols)
+    return -1;
+
+  return dbproc->cols[col - 1].len;
+}
+
+/*
+ * dbnextrow: makes up the next row.  Character values carry the row
+ *  number at their start, so no two rows are the same.
+ */
+STATUS dbnextrow(DBPROCESS *dbproc){
+  char num[24];
+  size_t len;
+  int x;
+
+  if (dbproc->dead)
+    return FAIL;
+
+  if (dbproc->row >= dbproc->nrows)
+    return NO_MORE_ROWS;
+
+  len = (size_t) snprintf(num, sizeof(num), "%lu", dbproc->row);
+
+  for (x = 0; x < dbproc->ncols; x++) {
+    struct fakedb_col_struct *col = &dbproc->cols[x];
+
+    switch (col->type) {
+      case SYBINT4:
+        col->i4 = (DBINT) (dbproc->row * dbproc->ncols + x);
+        break;
+
+      case SYBDATETIME:
+        col->dt.dtdays = 40000 + (DBINT) dbproc->row;
+        col->dt.dttime = 300 * x;
+        break;
+
+      default:
+        memcpy(col->text, num, len < (size_t) col->len ? len : col->len);
+        break;
+    }
+  }
+
+  dbproc->row++;
+  __sync_fetch_and_add(&fakedb_stats.rows, 1);
+  return REG_ROW;
+}
+
+BYTE *dbdata(DBPROCESS *dbproc, int col){
+  struct fakedb_col_struct *c = NULL;
+
+  if (col < 1 || col > dbproc->ncols)
+    return NULL;
+
+  c = &dbproc->cols[col - 1];
+  switch (c->type) {
+    case SYBINT4:
+      return (BYTE *) &c->i4;
+
+    case SYBDATETIME:
+      return (BYTE *) &c->dt;
+
+    default:
+      return (BYTE *) c->text;
+  }
+}
+
+DBINT dbdatlen(DBPROCESS *dbproc, int col){
+  return dbcollen(dbproc, col);
+}
+
+/*
+ * dbconvert: only converts to character data, which is all the module
+ *  asks for.  A destination length of -1 means null terminated.
+ */
+DBINT dbconvert(DBPROCESS *dbproc, int srctype, const BYTE *src,
+    DBINT srclen, int desttype, BYTE *dest, DBINT destlen){
+  char buf[64];
+  const char *text = NULL;
+  DBINT len = 0, x;
+  char *ptr = NULL;
+
+  if (desttype != SYBCHAR)
+    return -1;
+
+  switch (srctype) {
+    case SYBBINARY:
+    case SYBVARBINARY:
+    case SYBIMAGE:
+      if (destlen >= 0 && destlen < srclen * 2)
+        return -1;
+      ptr = (char *) dest;
+      for (x = 0; x < srclen; x++)
+        ptr += sprintf(ptr, "%02x", src[x]);
+      return srclen * 2;
+
+    case SYBINT4:
+      len = snprintf(buf, sizeof(buf), "%d", *((DBINT *) src));
+      text = buf;
+      break;
+
+    case SYBFLT8:
+      len = snprintf(buf, sizeof(buf), "%g", *((DBFLT8 *) src));
+      text = buf;
+      break;
+
+    default:
+      len = srclen;
+      text = (const char *) src;
+      break;
+  }
+
+  if (destlen < 0) {
+    memcpy(dest, text, len);
+    dest[len] = '\0';
+    return len;
+  }
+
+  if (len > destlen)
+    return -1;
+
+  memcpy(dest, text, len);
+  return len;
+}
+
+/*
+ * dbrpcinit: an RPC is run like a batch holding the statement it
+ *  executes, which for sp_executesql is its first parameter.
+ */
+RETCODE dbrpcinit(DBPROCESS *dbproc, const char *name, DBSMALLINT options){
+  if (dbproc->dead)
+    return FAIL;
+
+  dbproc->len = 0;
+  dbproc->sent = FALSE;
+  dbcmd(dbproc, "EXEC ");
+  dbcmd(dbproc, name);
+  return SUCCEED;
+}
+
+RETCODE dbrpcparam(DBPROCESS *dbproc, const char *name, BYTE status,
+    int type, DBINT maxlen, DBINT datalen, BYTE *value){
+  char *stmt = NULL;
+
+  if (strncmp(dbproc->batch, "EXEC sp_executesql", 18) == 0 && name == NULL &&
+      dbproc->len == 18) {
+    stmt = strndup((const char *) value, datalen);
+    dbproc->len = 0;
+    dbcmd(dbproc, stmt);
+    free(stmt);
+  }
+
+  return SUCCEED;
+}
+
+RETCODE dbrpcsend(DBPROCESS *dbproc){
+  return dbsqlsend(dbproc);
+}
+
+DBBOOL dbhasretstat(DBPROCESS *dbproc){
+  return FALSE;
+}
+
+DBINT dbretstatus(DBPROCESS *dbproc){
+  return 0;
+}
+
+int dbnumrets(DBPROCESS *dbproc){
+  return 0;
+}
+
+char *dbretname(DBPROCESS *dbproc, int n){
+  return NULL;
+}
+
+int dbrettype(DBPROCESS *dbproc, int n){
+  return -1;
+}
+
+DBINT dbretlen(DBPROCESS *dbproc, int n){
+  return -1;
+}
+
+BYTE *dbretdata(DBPROCESS *dbproc, int n){
+  return NULL;
+}
+
+RETCODE bcp_init(DBPROCESS *dbproc, const char *table, const char *hfile,
+    const char *errfile, int direction){
+  dbproc->bcp_rows = dbproc->bcp_batched = 0;
+  return dbproc->dead ? FAIL : SUCCEED;
+}
+
+RETCODE bcp_bind(DBPROCESS *dbproc, BYTE *varaddr, int prefixlen,
+    DBINT varlen, BYTE *terminator, int termlen, int type, int col){
+  return SUCCEED;
+}
+
+RETCODE bcp_colptr(DBPROCESS *dbproc, BYTE *colptr, int col){
+  return SUCCEED;
+}
+
+RETCODE bcp_collen(DBPROCESS *dbproc, DBINT varlen, int col){
+  return SUCCEED;
+}
+
+RETCODE bcp_sendrow(DBPROCESS *dbproc){
+  if (dbproc->dead)
+    return FAIL;
+
+  dbproc->bcp_rows++;
+  return SUCCEED;
+}
+
+DBINT bcp_batch(DBPROCESS *dbproc){
+  DBINT n = (DBINT) (dbproc->bcp_rows - dbproc->bcp_batched);
+
+  if (dbproc->dead)
+    return -1;
+
+  _fakedb_sleep(fakedb_config.latency_us);
+  dbproc->bcp_batched = dbproc->bcp_rows;
+  __sync_fetch_and_add(&fakedb_stats.bcp_rows, n);
+  return n;
+}
+
+DBINT bcp_done(DBPROCESS *dbproc){
+  return bcp_batch(dbproc);
+}
@@ -0,0 +1,117 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- sybdb.h for the fake db-lib in fakedb.c,
+ *  declaring the calls mod_sql_tds.c makes.  Values follow FreeTDS where
+ *  the module depends on them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_SYBDB_H
+#define BENCH_SYBDB_H
+
+typedef struct dbprocess DBPROCESS;
+typedef struct loginrec LOGINREC;
+
+enum {
+  SYBIMAGE = 34, SYBTEXT = 35, SYBUNIQUE = 36, SYBVARBINARY = 37,
+  SYBINTN = 38, SYBVARCHAR = 39, SYBBINARY = 45, SYBCHAR = 47,
+  SYBINT1 = 48, SYBBIT = 50, SYBINT2 = 52, SYBINT4 = 56,
+  SYBDATETIME4 = 58, SYBREAL = 59, SYBMONEY = 60, SYBDATETIME = 61,
+  SYBFLT8 = 62, SYBNTEXT = 99, SYBNVARCHAR = 103, SYBDECIMAL = 106,
+  SYBNUMERIC = 108, SYBDATETIMN = 111, SYBINT8 = 127
+};
+
+/* FreeTDS defines these as macros too, which the module tests for */
+#define SYBNVARCHAR SYBNVARCHAR
+#define SYBINT8     SYBINT8
+
+#define SYBETIME    20003
+#define SYBESMSG    20018
+
+#define DBSETHOST       1
+#define DBSETUSER       2
+#define DBSETPWD        3
+#define DBSETAPP        5
+#define DBSETBCP        6
+#define DBSETCHARSET    10
+#define DBSETDBNAME     14
+#define DBSETREADONLY   15
+
+#define DBSETLHOST(x,y)     dbsetlname((x), (y), DBSETHOST)
+#define DBSETLUSER(x,y)     dbsetlname((x), (y), DBSETUSER)
+#define DBSETLPWD(x,y)      dbsetlname((x), (y), DBSETPWD)
+#define DBSETLAPP(x,y)      dbsetlname((x), (y), DBSETAPP)
+#define DBSETLCHARSET(x,y)  dbsetlname((x), (y), DBSETCHARSET)
+#define DBSETLDBNAME(x,y)   dbsetlname((x), (y), DBSETDBNAME)
+#define DBSETLREADONLY(x,y) dbsetlbool((x), (y), DBSETREADONLY)
+#define BCP_SETL(x,y)       dbsetlbool((x), (y), DBSETBCP)
+
+#define DBSETTIME       34
+#define DBRPCRETURN     1
+#define DB_IN           1
+
+typedef int (*EHANDLEFUNC)(DBPROCESS *, int, int, int, char *, char *);
+typedef int (*MHANDLEFUNC)(DBPROCESS *, DBINT, int, int, char *, char *,
+  char *, int);
+
+RETCODE dbinit(void);
+void dbexit(void);
+EHANDLEFUNC dberrhandle(EHANDLEFUNC);
+MHANDLEFUNC dbmsghandle(MHANDLEFUNC);
+
+LOGINREC *dblogin(void);
+void dbloginfree(LOGINREC *);
+RETCODE dbsetlname(LOGINREC *, const char *, int);
+RETCODE dbsetlbool(LOGINREC *, int, int);
+RETCODE dbsetlogintime(int);
+
+DBPROCESS *dbopen(LOGINREC *, const char *);
+void dbclose(DBPROCESS *);
+RETCODE dbuse(DBPROCESS *, const char *);
+DBBOOL dbdead(DBPROCESS *);
+RETCODE dbsetopt(DBPROCESS *, int, const char *, int);
+void dbsetuserdata(DBPROCESS *, BYTE *);
+BYTE *dbgetuserdata(DBPROCESS *);
+
+RETCODE dbcmd(DBPROCESS *, const char *);
+RETCODE dbsqlexec(DBPROCESS *);
+RETCODE dbsqlsend(DBPROCESS *);
+RETCODE dbsqlok(DBPROCESS *);
+RETCODE dbresults(DBPROCESS *);
+RETCODE dbcancel(DBPROCESS *);
+RETCODE dbcanquery(DBPROCESS *);
+DBINT dbcount(DBPROCESS *);
+
+int dbnumcols(DBPROCESS *);
+char *dbcolname(DBPROCESS *, int);
+int dbcoltype(DBPROCESS *, int);
+DBINT dbcollen(DBPROCESS *, int);
+STATUS dbnextrow(DBPROCESS *);
+BYTE *dbdata(DBPROCESS *, int);
+DBINT dbdatlen(DBPROCESS *, int);
+DBINT dbconvert(DBPROCESS *, int, const BYTE *, DBINT, int, BYTE *, DBINT);
+
+RETCODE dbrpcinit(DBPROCESS *, const char *, DBSMALLINT);
+RETCODE dbrpcparam(DBPROCESS *, const char *, BYTE, int, DBINT, DBINT,
+  BYTE *);
+RETCODE dbrpcsend(DBPROCESS *);
+DBBOOL dbhasretstat(DBPROCESS *);
+DBINT dbretstatus(DBPROCESS *);
+int dbnumrets(DBPROCESS *);
+char *dbretname(DBPROCESS *, int);
+int dbrettype(DBPROCESS *, int);
+DBINT dbretlen(DBPROCESS *, int);
+BYTE *dbretdata(DBPROCESS *, int);
+
+RETCODE bcp_init(DBPROCESS *, const char *, const char *, const char *, int);
+RETCODE bcp_bind(DBPROCESS *, BYTE *, int, DBINT, BYTE *, int, int, int);
+RETCODE bcp_colptr(DBPROCESS *, BYTE *, int);
+RETCODE bcp_collen(DBPROCESS *, DBINT, int);
+RETCODE bcp_sendrow(DBPROCESS *);
+DBINT bcp_batch(DBPROCESS *);
+DBINT bcp_done(DBPROCESS *);
+
+#endif /* BENCH_SYBDB_H */
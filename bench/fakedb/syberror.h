@@ -0,0 +1,25 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- syberror.h for the fake db-lib.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_SYBERROR_H
+#define BENCH_SYBERROR_H
+
+#define EXINFO      1
+#define EXUSER      2
+#define EXNONFATAL  3
+#define EXCONVERSION 4
+#define EXSERVER    5
+#define EXTIME      6
+#define EXPROGRAM   7
+#define EXRESOURCE  8
+#define EXCOMM      9
+#define EXFATAL     10
+#define EXCONSISTENCY 11
+
+#endif /* BENCH_SYBERROR_H */
@@ -0,0 +1,51 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- sybfront.h for the fake db-lib in
+ *  fakedb.c.  Values follow FreeTDS where mod_sql_tds.c depends on them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_SYBFRONT_H
+#define BENCH_SYBFRONT_H
+
+typedef unsigned char BYTE;
+typedef int DBBOOL;
+typedef char DBCHAR;
+typedef unsigned char DBTINYINT;
+typedef short DBSMALLINT;
+typedef unsigned short DBUSMALLINT;
+typedef int DBINT;
+typedef long long DBBIGINT;
+typedef double DBFLT8;
+typedef float DBREAL;
+typedef int RETCODE;
+typedef int STATUS;
+
+typedef struct {
+  DBINT dtdays;
+  DBINT dttime;
+} DBDATETIME;
+
+typedef struct {
+  DBUSMALLINT days;
+  DBUSMALLINT minutes;
+} DBDATETIME4;
+
+#define SUCCEED             1
+#define FAIL                0
+
+#define REG_ROW             -1
+#define NO_MORE_ROWS        -2
+#define BUF_FULL            -3
+#define NO_MORE_RESULTS     2
+#define NO_MORE_RPC_RESULTS 3
+
+#define INT_EXIT            0
+#define INT_CONTINUE        1
+#define INT_CANCEL          2
+#define INT_TIMEOUT         3
+
+#endif /* BENCH_SYBFRONT_H */
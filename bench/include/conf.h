@@ -0,0 +1,259 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- the parts of ProFTPD's conf.h that
+ *  mod_sql_tds.c uses, backed by the stubs in stubs.c.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BENCH_CONF_H
+#define BENCH_CONF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef TRUE
+# define TRUE   1
+#endif
+#ifndef FALSE
+# define FALSE  0
+#endif
+
+typedef struct pool_rec pool;
+typedef struct module_struct module;
+
+typedef struct {
+  pool *pool;
+  size_t elt_size;
+  int nelts;
+  int nalloc;
+  void *elts;
+} array_header;
+
+typedef struct xaset_struct {
+  void *xas_list;
+} xaset_t;
+
+typedef struct config_struct {
+  struct config_struct *next, *prev;
+  int config_type;
+  pool *pool;
+  xaset_t *set;
+  char *name;
+  int argc;
+  void **argv;
+} config_rec;
+
+typedef struct server_struct {
+  struct server_struct *next, *prev;
+  pool *pool;
+  const char *ServerName;
+  xaset_t *conf;
+} server_rec;
+
+typedef struct cmd_struct {
+  pool *pool;
+  server_rec *server;
+  config_rec *config;
+  pool *tmp_pool;
+  int argc;
+  char *arg;
+  void **argv;
+  char *group;
+  int config_type;
+} cmd_rec;
+
+typedef struct modret_struct {
+  module *mr_handler_module;
+  int mr_error;
+  char *mr_numeric;
+  char *mr_message;
+  void *data;
+  void *mr_next;
+} modret_t;
+
+#define MODRET  modret_t *
+
+typedef struct {
+  int cmd_type;
+  const char *command;
+  const char *group;
+  modret_t *(*handler)(cmd_rec *);
+  int requires_auth;
+  int interrupt_xfer;
+} cmdtable;
+
+typedef struct {
+  const char *directive;
+  modret_t *(*handler)(cmd_rec *);
+  void *m;
+} conftable;
+
+typedef struct authtable authtable;
+
+struct module_struct {
+  module *next, *prev;
+  int api_version;
+  const char *name;
+  conftable *conftable;
+  cmdtable *cmdtable;
+  authtable *authtable;
+  int (*init)(void);
+  int (*sess_init)(void);
+  const char *module_version;
+};
+
+#define CMD             1
+#define PRE_CMD         2
+#define POST_CMD        3
+#define POST_CMD_ERR    4
+#define LOG_CMD         5
+#define LOG_CMD_ERR     6
+
+#define C_USER          "USER"
+#define C_PASS          "PASS"
+#define G_NONE          NULL
+
+#define CONF_ROOT       (1 << 0)
+#define CONF_DIR        (1 << 1)
+#define CONF_ANON       (1 << 2)
+#define CONF_LIMIT      (1 << 3)
+#define CONF_VIRTUAL    (1 << 4)
+#define CONF_DYNDIR     (1 << 5)
+#define CONF_GLOBAL     (1 << 6)
+#define CONF_CLASS      (1 << 7)
+#define CONF_NAMED      (1 << 8)
+#define CONF_USERDATA   (1 << 14)
+#define CONF_PARAM      (1 << 15)
+
+#define SERVER_INETD      0
+#define SERVER_STANDALONE 1
+
+#define PR_LOG_EMERG    0
+#define PR_LOG_ALERT    1
+#define PR_LOG_CRIT     2
+#define PR_LOG_ERR      3
+#define PR_LOG_WARNING  4
+#define PR_LOG_NOTICE   5
+#define PR_LOG_INFO     6
+#define PR_LOG_DEBUG    7
+
+#define CALLBACK_FRAME  int p1, int p2, int p3, void *p4
+
+modret_t *mod_create_ret(cmd_rec *, unsigned char, const char *, const char *);
+modret_t *mod_create_error(cmd_rec *, int);
+modret_t *mod_create_data(cmd_rec *, void *);
+
+#define PR_HANDLED(cmd)         mod_create_ret((cmd), 0, NULL, NULL)
+#define PR_DECLINED(cmd)        ((modret_t *) NULL)
+#define PR_ERROR(cmd)           mod_create_ret((cmd), 1, NULL, NULL)
+#define PR_ERROR_MSG(cmd,n,m)   mod_create_ret((cmd), 1, (n), (m))
+#define PR_ERROR_INT(cmd,n)     mod_create_error((cmd), (n))
+
+#define MODRET_ISDECLINED(x)    ((x) == NULL)
+#define MODRET_ISHANDLED(x)     ((x) && !(x)->mr_error)
+#define MODRET_ISERROR(x)       ((x) && (x)->mr_error)
+#define MODRET_HASDATA(x)       ((x) ? ((x)->data ? TRUE : FALSE) : FALSE)
+#define MODRET_ERRMSG(x)        ((x) ? (x)->mr_message : NULL)
+#define MODRET_ERROR(x)         ((x) ? (x)->mr_error : 0)
+
+#define CONF_ERROR(cmd,x) \
+  return PR_ERROR_MSG((cmd), NULL, pstrcat((cmd)->tmp_pool, \
+    (char *) (cmd)->argv[0], ": ", (x), NULL))
+
+#define CHECK_ARGS(cmd,n) \
+  if ((cmd)->argc - 1 < (n)) \
+    CONF_ERROR(cmd, "missing parameters")
+
+#define CHECK_CONF(cmd,x) \
+  if (((cmd)->config_type & (x)) == 0) \
+    CONF_ERROR(cmd, "directive not allowed in this context")
+
+#define PRIVS_ROOT      pr_privs_root(__FILE__, __LINE__);
+#define PRIVS_RELINQUISH
+
+/* pools */
+void *palloc(pool *, size_t);
+void *pcalloc(pool *, size_t);
+char *pstrdup(pool *, const char *);
+char *pstrndup(pool *, const char *, size_t);
+char *pstrcat(pool *, ...);
+pool *make_sub_pool(pool *);
+void destroy_pool(pool *);
+
+array_header *make_array(pool *, int, size_t);
+void *push_array(array_header *);
+
+/* tables */
+typedef struct table_rec pr_table_t;
+
+pr_table_t *pr_table_alloc(pool *, int);
+int pr_table_add(pr_table_t *, const char *, const void *, size_t);
+const void *pr_table_get(pr_table_t *, const char *, size_t *);
+int pr_table_count(pr_table_t *);
+
+/* configuration */
+config_rec *add_config_param(const char *, int, ...);
+config_rec *find_config(xaset_t *, int, const char *, int);
+config_rec *find_config_next(config_rec *, config_rec *, int, const char *,
+  int);
+void *get_param_ptr(xaset_t *, const char *, int);
+int get_boolean(cmd_rec *, int);
+
+/* timers and events */
+int pr_timer_add(int, int, module *, int (*)(CALLBACK_FRAME), const char *);
+int pr_timer_remove(int, module *);
+int pr_timer_reset(int, module *);
+
+int pr_event_register(module *, const char *,
+  void (*)(const void *, void *), void *);
+int pr_event_unregister(module *, const char *,
+  void (*)(const void *, void *));
+
+/* logging */
+void pr_log_pri(int, const char *, ...);
+void pr_log_debug(int, const char *, ...);
+int pr_trace_get_level(const char *);
+int pr_trace_msg(const char *, int, const char *, ...);
+
+/* everything else */
+char *sstrncpy(char *, const char *, size_t);
+void end_login(int);
+void pr_privs_root(const char *, int);
+
+extern pool *permanent_pool;
+extern server_rec *main_server;
+extern xaset_t *server_list;
+extern int ServerType;
+extern pid_t mpid;
+extern uid_t daemon_uid;
+extern gid_t daemon_gid;
+
+extern struct session_struct {
+  pool *pool;
+  const char *user;
+} session;
+
+#endif /* BENCH_CONF_H */
@@ -0,0 +1,367 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- loadgen_tds, a load generator that runs
+ *  sessions the way proftpd does: a process per session, forked by one
+ *  of N concurrent workers, going through cmd_defineconnection and
+ *  cmd_open, a cmd_select user lookup, a cmd_insert log line and
+ *  cmd_exit.  It reports the 50th, 99th and 99.9th percentile of each
+ *  step and of the whole session, and the sessions per second.
+ *
+ * With -B the statements go through SQLTDSBroker workers started by the
+ *  master, so sessions skip their own login; comparing a run with and
+ *  without it, given some login latency, shows what the broker saves.
+ *
+ * Built against the fake db-lib it measures the module and the stubs;
+ *  built with BENCH_FREETDS against FreeTDS and pointed at tdsmock or a
+ *  real server, it measures the whole client side.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "../mod_sql_tds.c"
+#include "bench.h"
+
+#include <sys/wait.h>
+
+#define LOADGEN_CONN    "loadgen"
+
+/* the steps of a session, in order */
+#define LOADGEN_OPEN    0
+#define LOADGEN_SELECT  1
+#define LOADGEN_INSERT  2
+#define LOADGEN_EXIT    3
+#define LOADGEN_SESSION 4
+#define LOADGEN_NSTEPS  5
+
+static const char *loadgen_steps[LOADGEN_NSTEPS] = {
+  "open", "select", "insert", "exit", "session"
+};
+
+/*
+ * loadgen_record_struct: what a session sends back to the master.  It is
+ *  small enough to be written to the pipe atomically.
+ */
+struct loadgen_record_struct {
+  int failed;               /* the step that failed, or -1 */
+  long long ns[LOADGEN_NSTEPS];
+};
+
+static unsigned long loadgen_nusers = 1000;
+static const char *loadgen_info = "ftp@tdsmock";
+static const char *loadgen_user = "proftpd";
+static const char *loadgen_pass = "secret";
+
+/* every Nth session's lookup gets a server error from the fake db-lib */
+static unsigned long loadgen_fail_every = 0;
+
+/* broker workers, if any, and their socket */
+static int loadgen_nworkers = 0;
+static char loadgen_socket[108];
+
+static long long _loadgen_ns(struct timespec *from, struct timespec *to){
+  return (to->tv_sec - from->tv_sec) * 1000000000LL +
+    (to->tv_nsec - from->tv_nsec);
+}
+
+/*
+ * _loadgen_session: one session, in a process of its own.  Returns which
+ *  step failed, or -1.
+ */
+static int _loadgen_session(unsigned long n, struct loadgen_record_struct *rec){
+  struct timespec t0, t1, start;
+  modret_t *mr = NULL;
+  cmd_rec *cmd = NULL;
+  char where[64], values[128];
+  int step;
+
+  sql_tds_sess_init();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (step = LOADGEN_OPEN; step < LOADGEN_SESSION; step++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    switch (step) {
+      case LOADGEN_OPEN:
+        cmd = _sql_make_cmd(session.pool, 4, LOADGEN_CONN, loadgen_user,
+          loadgen_pass, loadgen_info);
+        mr = cmd_defineconnection(cmd);
+        if (!MODRET_ERROR(mr))
+          mr = cmd_open(cmd);
+        break;
+
+      case LOADGEN_SELECT:
+        snprintf(where, sizeof(where), "userid = 'user%lu'",
+          n % loadgen_nusers);
+#ifndef BENCH_FREETDS
+        if (loadgen_fail_every && (n + 1) % loadgen_fail_every == 0)
+          fakedb_config.fail_every = 1;
+#endif
+        cmd = _sql_make_cmd(session.pool, 5, LOADGEN_CONN, "users",
+          "userid, passwd, uid, gid, homedir, shell", where, "1");
+        mr = cmd_select(cmd);
+        if (!MODRET_ERROR(mr) && (mr->data == NULL ||
+            ((sql_data_t *) mr->data)->rnum != 1))
+          mr = PR_ERROR_MSG(cmd, "loadgen", "user not found");
+#ifndef BENCH_FREETDS
+        fakedb_config.fail_every = 0;
+#endif
+        break;
+
+      case LOADGEN_INSERT:
+        snprintf(values, sizeof(values), "'user%lu', 'RETR', '/pub/file%lu'",
+          n % loadgen_nusers, n);
+        cmd = _sql_make_cmd(session.pool, 4, LOADGEN_CONN, "xferlog",
+          "userid, command, path", values);
+        mr = cmd_insert(cmd);
+        break;
+
+      case LOADGEN_EXIT:
+        cmd = _sql_make_cmd(session.pool, 1, LOADGEN_CONN);
+        mr = cmd_exit(cmd);
+        break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    rec->ns[step] = _loadgen_ns(&t0, &t1);
+
+    if (MODRET_ERROR(mr)) {
+      if (bench_verbose)
+        fprintf(stderr, "session %lu: %s failed: %s\n", n, loadgen_steps[step],
+          mr->mr_message ? mr->mr_message : "");
+      return step;
+    }
+
+    SQL_FREE_CMD(cmd);
+  }
+
+  rec->ns[LOADGEN_SESSION] = _loadgen_ns(&start, &t1);
+  return -1;
+}
+
+/*
+ * _loadgen_worker: runs its share of the sessions one after another,
+ *  forking a process for each as proftpd would.
+ */
+static void _loadgen_worker(unsigned long first, unsigned long count,
+    int fd){
+  struct loadgen_record_struct rec;
+  unsigned long n;
+  pid_t pid;
+  int status;
+
+  for (n = first; n < first + count; n++) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      _exit(1);
+    }
+
+    if (pid == 0) {
+      memset(&rec, 0, sizeof(rec));
+      rec.failed = _loadgen_session(n, &rec);
+      if (write(fd, &rec, sizeof(rec)) != sizeof(rec))
+        _exit(1);
+      _exit(0);
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+  }
+
+  _exit(0);
+}
+
+static int _loadgen_cmp(const void *a, const void *b){
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* the value at or below which pct percent of the sorted samples fall */
+static double _loadgen_pct(long long *samples, unsigned long n, double pct){
+  unsigned long idx;
+
+  if (n == 0)
+    return 0.0;
+
+  idx = (unsigned long) (pct / 100.0 * n + 0.999999);
+  if (idx > 0)
+    idx--;
+  if (idx >= n)
+    idx = n - 1;
+
+  return samples[idx] / 1000.0;
+}
+
+static void _loadgen_usage(void){
+  fprintf(stderr,
+    "usage: loadgen_tds [-c concurrency] [-n sessions] [-u users]\n"
+    "                   [-B broker-workers] [-v]\n"
+#ifdef BENCH_FREETDS
+    "                   [-S db@server] [-U user] [-P password]\n"
+#else
+    "                   [-l latency-us] [-L login-latency-us] [-f fail-every]\n"
+#endif
+    );
+  exit(2);
+}
+
+int main(int argc, char *argv[]){
+  struct loadgen_record_struct rec;
+  struct timespec start, end;
+  unsigned long nsessions = 1000, nconc = 8, x, nrecs = 0, nfailed = 0;
+  unsigned long failed[LOADGEN_NSTEPS];
+  long long *samples[LOADGEN_NSTEPS];
+  unsigned long nsamples[LOADGEN_NSTEPS];
+  double secs;
+  ssize_t res;
+  pid_t pid;
+  int fds[2], opt, step;
+
+  while ((opt = getopt(argc, argv, "c:n:u:B:S:U:P:l:L:f:v")) != -1) {
+    switch (opt) {
+      case 'c': nconc = strtoul(optarg, NULL, 10); break;
+      case 'n': nsessions = strtoul(optarg, NULL, 10); break;
+      case 'u': loadgen_nusers = strtoul(optarg, NULL, 10); break;
+      case 'B': loadgen_nworkers = atoi(optarg); break;
+#ifdef BENCH_FREETDS
+      case 'S': loadgen_info = optarg; break;
+      case 'U': loadgen_user = optarg; break;
+      case 'P': loadgen_pass = optarg; break;
+#else
+      case 'l': fakedb_config.latency_us = strtoul(optarg, NULL, 10); break;
+      case 'L': fakedb_config.login_latency_us = strtoul(optarg, NULL, 10);
+        break;
+      case 'f': loadgen_fail_every = strtoul(optarg, NULL, 10); break;
+#endif
+      case 'v': bench_verbose = TRUE; break;
+      default: _loadgen_usage();
+    }
+  }
+
+  if (nconc == 0 || nsessions == 0 || loadgen_nusers == 0 ||
+      loadgen_nworkers < 0 || loadgen_nworkers > TDS_BROKER_MAX_WORKERS)
+    _loadgen_usage();
+
+  /* the broker's workers would count failures statement by statement */
+  if (loadgen_nworkers && loadgen_fail_every) {
+    fprintf(stderr, "-f can't be used with -B\n");
+    return 2;
+  }
+  if (nconc > nsessions)
+    nconc = nsessions;
+
+#ifndef BENCH_FREETDS
+  /* a user lookup finds one user */
+  fakedb_config.rows = 1;
+  fakedb_config.cols = 6;
+  fakedb_config.width = 16;
+  fakedb_config.types = "vvviiv";
+#endif
+
+  signal(SIGPIPE, SIG_IGN);
+  bench_init();
+
+  if (loadgen_nworkers) {
+    char workers[16];
+
+    snprintf(loadgen_socket, sizeof(loadgen_socket),
+      "/tmp/loadgen_tds.%lu.sock", (unsigned long) getpid());
+    snprintf(workers, sizeof(workers), "%d", loadgen_nworkers);
+
+    add_config_param("SQLConnectInfo", 3, loadgen_info, loadgen_user,
+      loadgen_pass);
+    bench_directive(set_sqltdsbroker, "SQLTDSBroker", loadgen_socket, workers,
+      NULL);
+
+    _sql_broker_start();
+    if (tds_broker_listenfd < 0) {
+      fprintf(stderr, "unable to start the broker\n");
+      return 1;
+    }
+  }
+
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    return 1;
+  }
+
+  memset(failed, 0, sizeof(failed));
+  memset(nsamples, 0, sizeof(nsamples));
+  for (step = 0; step < LOADGEN_NSTEPS; step++)
+    samples[step] = malloc(nsessions * sizeof(long long));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (x = 0; x < nconc; x++) {
+    unsigned long first = nsessions / nconc * x + (x < nsessions % nconc ? x :
+      nsessions % nconc);
+    unsigned long count = nsessions / nconc + (x < nsessions % nconc);
+
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+
+    if (pid == 0) {
+      close(fds[0]);
+      _loadgen_worker(first, count, fds[1]);
+    }
+  }
+  close(fds[1]);
+
+  /* read until every worker, and so every session, has gone */
+  while ((res = read(fds[0], &rec, sizeof(rec))) != 0) {
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res != sizeof(rec))
+      break;
+    nrecs++;
+
+    for (step = 0; step < LOADGEN_NSTEPS; step++) {
+      if (rec.failed >= 0 && step >= rec.failed)
+        break;
+      samples[step][nsamples[step]++] = rec.ns[step];
+    }
+
+    if (rec.failed >= 0) {
+      failed[rec.failed]++;
+      nfailed++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (loadgen_nworkers) {
+    _sql_broker_stop();
+    (void) unlink(loadgen_socket);
+  }
+
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+
+  secs = _loadgen_ns(&start, &end) / 1e9;
+
+  printf("%lu sessions, %lu concurrent, %d broker workers, %lu failed, "
+    "%lu lost; %.2fs, %.1f sessions/s\n", nrecs, nconc, loadgen_nworkers,
+    nfailed, nsessions - nrecs, secs,
+    secs > 0 ? (nrecs - nfailed) / secs : 0.0);
+  printf("%-10s %10s %10s %10s %10s %10s\n", "step", "ok", "failed",
+    "p50 us", "p99 us", "p999 us");
+
+  for (step = 0; step < LOADGEN_NSTEPS; step++) {
+    qsort(samples[step], nsamples[step], sizeof(long long), _loadgen_cmp);
+    printf("%-10s %10lu %10lu %10.1f %10.1f %10.1f\n", loadgen_steps[step],
+      nsamples[step], step == LOADGEN_SESSION ? nfailed : failed[step],
+      _loadgen_pct(samples[step], nsamples[step], 50.0),
+      _loadgen_pct(samples[step], nsamples[step], 99.0),
+      _loadgen_pct(samples[step], nsamples[step], 99.9));
+    free(samples[step]);
+  }
+
+  return nrecs == nsessions && nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,558 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- just enough of ProFTPD's pool, config,
+ *  cmd and mod_sql APIs to run mod_sql_tds.c outside of proftpd.  Every
+ *  pool allocation is a separate malloc, so what the module asks for can
+ *  be counted exactly.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "bench.h"
+#include "../contrib/mod_sql.h"
+
+/*
+ * pool_blk_struct: header of one allocation, aligned for any type.
+ */
+struct pool_blk_struct {
+  struct pool_blk_struct *next;
+  size_t size;
+} __attribute__((aligned(16)));
+
+struct pool_rec {
+  struct pool_rec *parent;
+  struct pool_rec *sub;         /* first child                           */
+  struct pool_rec *next, *prev; /* siblings                              */
+  struct pool_blk_struct *blks;
+};
+
+struct table_ent_struct {
+  struct table_ent_struct *next;
+  const char *key;
+  const void *value;
+  size_t valuesz;
+};
+
+struct table_rec {
+  pool *pool;
+  struct table_ent_struct *ents;
+  int count;
+};
+
+struct bench_pool_stats_struct bench_pool_stats;
+
+int bench_verbose = FALSE;
+int bench_trace_level = -1;
+
+pool *permanent_pool = NULL;
+server_rec *main_server = NULL;
+xaset_t *server_list = NULL;
+int ServerType = SERVER_STANDALONE;
+pid_t mpid = 0;
+uid_t daemon_uid = 0;
+gid_t daemon_gid = 0;
+struct session_struct session;
+
+int pr_sql_conn_policy = SQL_CONN_POLICY_PERSESSION;
+
+static xaset_t bench_conf;
+static int bench_timerno = 0;
+
+
+/* pools
+ */
+
+static void _pool_count(size_t size){
+  size_t live, peak;
+
+  __sync_fetch_and_add(&bench_pool_stats.allocs, 1);
+  live = __sync_add_and_fetch(&bench_pool_stats.live, size);
+
+  while ((peak = bench_pool_stats.peak) < live)
+    __sync_bool_compare_and_swap(&bench_pool_stats.peak, peak, live);
+}
+
+void *palloc(pool *p, size_t size){
+  struct pool_blk_struct *blk = NULL;
+
+  blk = malloc(sizeof(struct pool_blk_struct) + (size ? size : 1));
+  if (blk == NULL) {
+    fprintf(stderr, "out of memory\n");
+    abort();
+  }
+
+  blk->size = size;
+  blk->next = p->blks;
+  p->blks = blk;
+  _pool_count(size);
+
+  return blk + 1;
+}
+
+void *pcalloc(pool *p, size_t size){
+  void *ptr = palloc(p, size);
+
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+char *pstrdup(pool *p, const char *str){
+  size_t len = strlen(str);
+
+  return memcpy(palloc(p, len + 1), str, len + 1);
+}
+
+char *pstrndup(pool *p, const char *str, size_t n){
+  char *res = NULL;
+  size_t len = 0;
+
+  while (len < n && str[len])
+    len++;
+
+  res = palloc(p, len + 1);
+  memcpy(res, str, len);
+  res[len] = '\0';
+  return res;
+}
+
+char *pstrcat(pool *p, ...){
+  va_list ap;
+  char *str = NULL, *res = NULL, *ptr = NULL;
+  size_t len = 0;
+
+  va_start(ap, p);
+  while ((str = va_arg(ap, char *)) != NULL)
+    len += strlen(str);
+  va_end(ap);
+
+  res = ptr = palloc(p, len + 1);
+
+  va_start(ap, p);
+  while ((str = va_arg(ap, char *)) != NULL) {
+    len = strlen(str);
+    memcpy(ptr, str, len);
+    ptr += len;
+  }
+  va_end(ap);
+  *ptr = '\0';
+
+  return res;
+}
+
+pool *make_sub_pool(pool *parent){
+  pool *p = calloc(1, sizeof(pool));
+
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    abort();
+  }
+
+  p->parent = parent;
+  if (parent) {
+    p->next = parent->sub;
+    if (parent->sub)
+      parent->sub->prev = p;
+    parent->sub = p;
+  }
+
+  return p;
+}
+
+void destroy_pool(pool *p){
+  struct pool_blk_struct *blk = NULL;
+
+  if (p == NULL)
+    return;
+
+  while (p->sub)
+    destroy_pool(p->sub);
+
+  if (p->parent) {
+    if (p->prev)
+      p->prev->next = p->next;
+    else
+      p->parent->sub = p->next;
+    if (p->next)
+      p->next->prev = p->prev;
+  }
+
+  while ((blk = p->blks) != NULL) {
+    p->blks = blk->next;
+    __sync_fetch_and_sub(&bench_pool_stats.live, blk->size);
+    free(blk);
+  }
+
+  free(p);
+}
+
+void bench_pool_mark(void){
+  bench_pool_stats.peak = bench_pool_stats.live;
+}
+
+array_header *make_array(pool *p, int nelts, size_t elt_size){
+  array_header *res = palloc(p, sizeof(array_header));
+
+  if (nelts < 1)
+    nelts = 1;
+
+  res->pool = p;
+  res->elt_size = elt_size;
+  res->nelts = 0;
+  res->nalloc = nelts;
+  res->elts = pcalloc(p, nelts * elt_size);
+  return res;
+}
+
+void *push_array(array_header *arr){
+  void *elts = NULL;
+
+  if (arr->nelts == arr->nalloc) {
+    elts = pcalloc(arr->pool, arr->nalloc * 2 * arr->elt_size);
+    memcpy(elts, arr->elts, arr->nalloc * arr->elt_size);
+    arr->elts = elts;
+    arr->nalloc *= 2;
+  }
+
+  return (char *) arr->elts + arr->elt_size * arr->nelts++;
+}
+
+
+/* tables
+ */
+
+pr_table_t *pr_table_alloc(pool *p, int flags){
+  pr_table_t *tab = pcalloc(p, sizeof(pr_table_t));
+
+  tab->pool = p;
+  return tab;
+}
+
+int pr_table_add(pr_table_t *tab, const char *key, const void *value,
+    size_t valuesz){
+  struct table_ent_struct *ent = NULL;
+
+  for (ent = tab->ents; ent; ent = ent->next) {
+    if (strcmp(ent->key, key) == 0) {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  ent = palloc(tab->pool, sizeof(struct table_ent_struct));
+  ent->key = key;
+  ent->value = value;
+  ent->valuesz = valuesz;
+  ent->next = tab->ents;
+  tab->ents = ent;
+  tab->count++;
+  return 0;
+}
+
+const void *pr_table_get(pr_table_t *tab, const char *key, size_t *valuesz){
+  struct table_ent_struct *ent = NULL;
+
+  for (ent = tab->ents; ent; ent = ent->next) {
+    if (strcmp(ent->key, key) == 0) {
+      if (valuesz)
+        *valuesz = ent->valuesz;
+      return ent->value;
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+int pr_table_count(pr_table_t *tab){
+  return tab->count;
+}
+
+
+/* configuration
+ */
+
+config_rec *add_config_param(const char *name, int num, ...){
+  config_rec *c = NULL, *last = NULL;
+  va_list ap;
+  int x;
+
+  c = pcalloc(permanent_pool, sizeof(config_rec));
+  c->config_type = CONF_PARAM;
+  c->pool = permanent_pool;
+  c->set = main_server->conf;
+  c->name = pstrdup(permanent_pool, name);
+  c->argc = num;
+  c->argv = pcalloc(permanent_pool, sizeof(void *) * (num + 1));
+
+  va_start(ap, num);
+  for (x = 0; x < num; x++)
+    c->argv[x] = va_arg(ap, void *);
+  va_end(ap);
+
+  /* in file order, the way find_config_next walks them */
+  for (last = main_server->conf->xas_list; last && last->next; last = last->next)
+    ;
+  if (last) {
+    last->next = c;
+    c->prev = last;
+  } else {
+    main_server->conf->xas_list = c;
+  }
+
+  return c;
+}
+
+config_rec *find_config_next(config_rec *prev, config_rec *c, int type,
+    const char *name, int recurse){
+  for (; c; c = c->next) {
+    if ((type == -1 || c->config_type == type) &&
+        (name == NULL || strcmp(c->name, name) == 0))
+      return c;
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+config_rec *find_config(xaset_t *set, int type, const char *name,
+    int recurse){
+  if (set == NULL)
+    return NULL;
+
+  return find_config_next(NULL, set->xas_list, type, name, recurse);
+}
+
+void *get_param_ptr(xaset_t *set, const char *name, int recurse){
+  config_rec *c = find_config(set, -1, name, recurse);
+
+  return c ? c->argv[0] : NULL;
+}
+
+int get_boolean(cmd_rec *cmd, int av){
+  const char *str = cmd->argv[av];
+
+  if (!strcasecmp(str, "on") || !strcasecmp(str, "yes") ||
+      !strcasecmp(str, "true") || !strcmp(str, "1"))
+    return TRUE;
+
+  if (!strcasecmp(str, "off") || !strcasecmp(str, "no") ||
+      !strcasecmp(str, "false") || !strcmp(str, "0"))
+    return FALSE;
+
+  return -1;
+}
+
+void bench_directive(modret_t *(*handler)(cmd_rec *), const char *name, ...){
+  cmd_rec *cmd = NULL;
+  modret_t *mr = NULL;
+  va_list ap;
+  int argc = 1, x;
+
+  va_start(ap, name);
+  while (va_arg(ap, char *) != NULL)
+    argc++;
+  va_end(ap);
+
+  cmd = pcalloc(permanent_pool, sizeof(cmd_rec));
+  cmd->pool = cmd->tmp_pool = make_sub_pool(permanent_pool);
+  cmd->server = main_server;
+  cmd->config_type = CONF_ROOT;
+  cmd->argc = argc;
+  cmd->argv = pcalloc(cmd->pool, sizeof(void *) * (argc + 1));
+  cmd->argv[0] = (void *) name;
+
+  va_start(ap, name);
+  for (x = 1; x < argc; x++)
+    cmd->argv[x] = va_arg(ap, char *);
+  va_end(ap);
+
+  mr = handler(cmd);
+  if (MODRET_ERROR(mr)) {
+    fprintf(stderr, "%s\n", mr->mr_message ? mr->mr_message : name);
+    exit(2);
+  }
+}
+
+
+/* commands
+ */
+
+modret_t *mod_create_ret(cmd_rec *cmd, unsigned char err, const char *n,
+    const char *m){
+  modret_t *mr = pcalloc(cmd->tmp_pool, sizeof(modret_t));
+
+  mr->mr_error = err;
+  mr->mr_numeric = n ? pstrdup(cmd->tmp_pool, n) : NULL;
+  mr->mr_message = m ? pstrdup(cmd->tmp_pool, m) : NULL;
+  return mr;
+}
+
+modret_t *mod_create_error(cmd_rec *cmd, int err){
+  modret_t *mr = pcalloc(cmd->tmp_pool, sizeof(modret_t));
+
+  mr->mr_error = err;
+  return mr;
+}
+
+modret_t *mod_create_data(cmd_rec *cmd, void *data){
+  modret_t *mr = pcalloc(cmd->tmp_pool, sizeof(modret_t));
+
+  mr->data = data;
+  return mr;
+}
+
+cmd_rec *_sql_make_cmd(pool *p, int argc, ...){
+  pool *newpool = make_sub_pool(p);
+  cmd_rec *cmd = NULL;
+  va_list ap;
+  int x;
+
+  cmd = pcalloc(newpool, sizeof(cmd_rec));
+  cmd->argc = argc;
+  cmd->pool = cmd->tmp_pool = newpool;
+  cmd->server = main_server;
+  cmd->argv = pcalloc(newpool, sizeof(void *) * (argc + 1));
+
+  va_start(ap, argc);
+  for (x = 0; x < argc; x++)
+    cmd->argv[x] = va_arg(ap, void *);
+  va_end(ap);
+
+  return cmd;
+}
+
+int sql_register_backend(const char *name, cmdtable *tab){
+  return 0;
+}
+
+int sql_unregister_backend(const char *name){
+  return 0;
+}
+
+
+/* timers, events and logging
+ */
+
+int pr_timer_add(int secs, int timerno, module *m,
+    int (*cb)(CALLBACK_FRAME), const char *desc){
+  return timerno > 0 ? timerno : ++bench_timerno;
+}
+
+int pr_timer_remove(int timerno, module *m){
+  return 0;
+}
+
+int pr_timer_reset(int timerno, module *m){
+  return 0;
+}
+
+int pr_event_register(module *m, const char *event,
+    void (*cb)(const void *, void *), void *data){
+  return 0;
+}
+
+int pr_event_unregister(module *m, const char *event,
+    void (*cb)(const void *, void *)){
+  return 0;
+}
+
+static void _log(const char *prefix, const char *fmt, va_list ap){
+  fprintf(stderr, "%s", prefix);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+}
+
+void pr_log_pri(int prio, const char *fmt, ...){
+  va_list ap;
+
+  if (!bench_verbose && prio > PR_LOG_ERR)
+    return;
+
+  va_start(ap, fmt);
+  _log("proftpd: ", fmt, ap);
+  va_end(ap);
+}
+
+void pr_log_debug(int level, const char *fmt, ...){
+  va_list ap;
+
+  if (!bench_verbose)
+    return;
+
+  va_start(ap, fmt);
+  _log("proftpd: ", fmt, ap);
+  va_end(ap);
+}
+
+int sql_log(int level, const char *fmt, ...){
+  va_list ap;
+
+  if (!bench_verbose)
+    return 0;
+
+  va_start(ap, fmt);
+  _log("mod_sql: ", fmt, ap);
+  va_end(ap);
+  return 0;
+}
+
+int pr_trace_get_level(const char *channel){
+  return bench_trace_level;
+}
+
+int pr_trace_msg(const char *channel, int level, const char *fmt, ...){
+  va_list ap;
+
+  va_start(ap, fmt);
+  _log("trace: ", fmt, ap);
+  va_end(ap);
+  return 0;
+}
+
+
+/* everything else
+ */
+
+char *sstrncpy(char *dst, const char *src, size_t n){
+  if (n == 0)
+    return dst;
+
+  strncpy(dst, src, n - 1);
+  dst[n - 1] = '\0';
+  return dst;
+}
+
+void end_login(int exitcode){
+  exit(exitcode);
+}
+
+void pr_privs_root(const char *file, int lineno){
+}
+
+void bench_init(void){
+  permanent_pool = make_sub_pool(NULL);
+
+  main_server = pcalloc(permanent_pool, sizeof(server_rec));
+  main_server->pool = permanent_pool;
+  main_server->ServerName = "bench";
+  main_server->conf = &bench_conf;
+
+  server_list = pcalloc(permanent_pool, sizeof(xaset_t));
+  server_list->xas_list = main_server;
+
+  session.pool = make_sub_pool(permanent_pool);
+  session.user = NULL;
+
+  mpid = getpid();
+  daemon_uid = getuid();
+  daemon_gid = getgid();
+}
+
+/* the broker workers drop to the daemon's User and Group, which the bench
+ * already runs as; only setgroups would need root to say so
+ */
+int setgroups(size_t size, const gid_t *list){
+  return 0;
+}
@@ -0,0 +1,1209 @@
+/*
+ * ProFTPD: mod_sql_tds bench -- tdsmock, a local TDS 7.x responder.  It
+ *  speaks just enough of the protocol for FreeTDS's dbopen, dbuse,
+ *  dbsqlexec and dbnextrow: PRELOGIN without encryption, LOGIN7, SQL
+ *  batches and attentions.  SELECTs are answered from canned users and
+ *  groups tables, other statements are acknowledged and discarded.  Reply
+ *  latency and failures can be injected.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef FALSE
+# define FALSE 0
+# define TRUE  1
+#endif
+
+#define MOCK_VERSION        "tdsmock/1.0"
+
+/* packet types */
+#define TDS_PKT_QUERY       0x01
+#define TDS_PKT_RPC         0x03
+#define TDS_PKT_REPLY       0x04
+#define TDS_PKT_CANCEL      0x06
+#define TDS_PKT_LOGIN7      0x10
+#define TDS_PKT_PRELOGIN    0x12
+
+#define TDS_PKT_EOM         0x01
+#define TDS_PKT_HDRLEN      8
+
+/* tokens */
+#define TDS_TOK_COLMETADATA 0x81
+#define TDS_TOK_ERROR       0xaa
+#define TDS_TOK_LOGINACK    0xad
+#define TDS_TOK_ROW         0xd1
+#define TDS_TOK_ENVCHANGE   0xe3
+#define TDS_TOK_DONE        0xfd
+
+#define TDS_DONE_MORE       0x0001
+#define TDS_DONE_ERROR      0x0002
+#define TDS_DONE_COUNT      0x0010
+#define TDS_DONE_ATTN       0x0020
+
+#define TDS_TYPE_INTN       0x26
+#define TDS_TYPE_BIGVARCHAR 0xa7
+
+#define MOCK_MAX_MSG        (1024 * 1024)
+#define MOCK_MAX_COLS       32
+#define MOCK_MAX_CONDS      8
+
+/* Latin1_General_CI_AS */
+static const unsigned char mock_collation[5] = { 0x09, 0x04, 0xd0, 0x00, 0x34 };
+
+/*
+ * mock_config_struct: what the responder serves, and how badly.
+ */
+struct mock_config_struct {
+  unsigned long nusers;
+  unsigned long ngroups;
+  const char *user;           /* login required, if set               */
+  const char *pass;
+
+  unsigned long latency_us;   /* before each batch's reply            */
+  unsigned long login_latency_us;
+
+  unsigned long fail_every;   /* fail every Nth statement             */
+  long fail_msgno;
+  unsigned long drop_every;   /* hang up instead of the Nth reply     */
+  unsigned long refuse_every; /* refuse every Nth login               */
+
+  int verbose;
+};
+
+static struct mock_config_struct mock_config = {
+  1000, 50, NULL, NULL, 0, 0, 0, 1205, 0, 0, 0
+};
+
+static unsigned long mock_nsessions = 0;
+static unsigned long mock_nstatements = 0;
+static unsigned long mock_nbatches = 0;
+static unsigned long mock_nlogins = 0;
+
+/*
+ * mock_buf_struct: a growable byte buffer.
+ */
+struct mock_buf_struct {
+  unsigned char *data;
+  size_t len, size;
+};
+
+/*
+ * mock_conn_struct: one client connection.
+ */
+struct mock_conn_struct {
+  int fd;
+  unsigned short spid;
+  unsigned int tdsver;        /* as sent in LOGIN7, e.g. 0x74000004   */
+  size_t pktsize;
+  char db[128];
+
+  struct mock_buf_struct in;  /* the message being read               */
+  struct mock_buf_struct out; /* the reply being put together         */
+  int type;                   /* of the message read                  */
+};
+
+/*
+ * mock_col_struct: a column of a canned table.
+ */
+struct mock_col_struct {
+  const char *name;
+  int isint;
+  unsigned short maxlen;
+};
+
+static const struct mock_col_struct mock_users_cols[] = {
+  { "userid",  0, 32 },
+  { "passwd",  0, 64 },
+  { "uid",     1, 4 },
+  { "gid",     1, 4 },
+  { "homedir", 0, 128 },
+  { "shell",   0, 32 },
+  { NULL, 0, 0 }
+};
+
+static const struct mock_col_struct mock_groups_cols[] = {
+  { "groupname", 0, 32 },
+  { "gid",       1, 4 },
+  { "members",   0, 1024 },
+  { NULL, 0, 0 }
+};
+
+/*
+ * mock_select_struct: a parsed SELECT.  cols index the table's columns,
+ *  or are -1 for names it doesn't have, which come back NULL.
+ */
+struct mock_select_struct {
+  const struct mock_col_struct *table;
+  unsigned long nrows;
+  int ncols;
+  int cols[MOCK_MAX_COLS];
+  char names[MOCK_MAX_COLS][64];
+  long top;
+  int spid;                   /* SELECT @@spid                        */
+
+  int nconds;
+  int condcol[MOCK_MAX_CONDS];
+  int condlike[MOCK_MAX_CONDS];
+  char condval[MOCK_MAX_CONDS][256];
+};
+
+static void mock_log(const char *fmt, ...){
+  va_list ap;
+
+  if (!mock_config.verbose)
+    return;
+
+  va_start(ap, fmt);
+  fprintf(stderr, MOCK_VERSION ": ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+}
+
+static void mock_sleep(unsigned long us){
+  struct timespec ts;
+
+  if (us == 0)
+    return;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+/* building replies
+ */
+
+static void mock_put(struct mock_buf_struct *buf, const void *data,
+    size_t len){
+  if (buf->len + len > buf->size) {
+    buf->size = (buf->len + len) * 2;
+    buf->data = realloc(buf->data, buf->size);
+    if (buf->data == NULL) {
+      fprintf(stderr, MOCK_VERSION ": out of memory\n");
+      exit(1);
+    }
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void mock_put_byte(struct mock_buf_struct *buf, unsigned int val){
+  unsigned char b = (unsigned char) val;
+
+  mock_put(buf, &b, 1);
+}
+
+static void mock_put_le16(struct mock_buf_struct *buf, unsigned int val){
+  unsigned char b[2];
+
+  b[0] = val & 0xff;
+  b[1] = (val >> 8) & 0xff;
+  mock_put(buf, b, 2);
+}
+
+static void mock_put_le32(struct mock_buf_struct *buf, uint32_t val){
+  unsigned char b[4];
+
+  b[0] = val & 0xff;
+  b[1] = (val >> 8) & 0xff;
+  b[2] = (val >> 16) & 0xff;
+  b[3] = (val >> 24) & 0xff;
+  mock_put(buf, b, 4);
+}
+
+static void mock_put_le64(struct mock_buf_struct *buf, uint64_t val){
+  mock_put_le32(buf, (uint32_t) val);
+  mock_put_le32(buf, (uint32_t) (val >> 32));
+}
+
+/* an ASCII string as UCS-2 */
+static void mock_put_ucs2(struct mock_buf_struct *buf, const char *str,
+    size_t len){
+  size_t x;
+
+  for (x = 0; x < len; x++)
+    mock_put_le16(buf, (unsigned char) str[x]);
+}
+
+static void mock_put_bvarchar(struct mock_buf_struct *buf, const char *str){
+  size_t len = strlen(str);
+
+  if (len > 255)
+    len = 255;
+
+  mock_put_byte(buf, len);
+  mock_put_ucs2(buf, str, len);
+}
+
+/* the token's length field, once everything after it is in place */
+static void mock_put_len_at(struct mock_buf_struct *buf, size_t at){
+  size_t len = buf->len - at - 2;
+
+  buf->data[at] = len & 0xff;
+  buf->data[at + 1] = (len >> 8) & 0xff;
+}
+
+static int mock_tds72(struct mock_conn_struct *conn){
+  return (conn->tdsver >> 24) >= 0x72;
+}
+
+static void mock_put_done(struct mock_conn_struct *conn, unsigned int status,
+    unsigned int curcmd, uint64_t count){
+  mock_put_byte(&conn->out, TDS_TOK_DONE);
+  mock_put_le16(&conn->out, status);
+  mock_put_le16(&conn->out, curcmd);
+
+  if (mock_tds72(conn))
+    mock_put_le64(&conn->out, count);
+  else
+    mock_put_le32(&conn->out, (uint32_t) count);
+}
+
+static void mock_put_error(struct mock_conn_struct *conn, long msgno,
+    int severity, const char *text){
+  size_t at, len = strlen(text);
+
+  mock_put_byte(&conn->out, TDS_TOK_ERROR);
+  at = conn->out.len;
+  mock_put_le16(&conn->out, 0);
+  mock_put_le32(&conn->out, (uint32_t) msgno);
+  mock_put_byte(&conn->out, 1);
+  mock_put_byte(&conn->out, severity);
+  mock_put_le16(&conn->out, len);
+  mock_put_ucs2(&conn->out, text, len);
+  mock_put_bvarchar(&conn->out, "tdsmock");
+  mock_put_bvarchar(&conn->out, "");
+
+  if (mock_tds72(conn))
+    mock_put_le32(&conn->out, 1);
+  else
+    mock_put_le16(&conn->out, 1);
+
+  mock_put_len_at(&conn->out, at);
+}
+
+static void mock_put_envchange(struct mock_conn_struct *conn, int type,
+    const char *newval, const char *oldval){
+  size_t at;
+
+  mock_put_byte(&conn->out, TDS_TOK_ENVCHANGE);
+  at = conn->out.len;
+  mock_put_le16(&conn->out, 0);
+  mock_put_byte(&conn->out, type);
+  mock_put_bvarchar(&conn->out, newval);
+  mock_put_bvarchar(&conn->out, oldval);
+  mock_put_len_at(&conn->out, at);
+}
+
+/*
+ * mock_send: sends the reply put together in conn->out as packets of the
+ *  negotiated size, the last one marked as the end of the message.
+ */
+static int mock_send(struct mock_conn_struct *conn){
+  unsigned char hdr[TDS_PKT_HDRLEN];
+  size_t off = 0, chunk, max = conn->pktsize - TDS_PKT_HDRLEN;
+  unsigned char pktid = 1;
+  struct mock_part_struct {
+    const void *base;
+    size_t len;
+  } parts[2];
+  ssize_t res;
+  int x;
+
+  do {
+    chunk = conn->out.len - off;
+    if (chunk > max)
+      chunk = max;
+
+    hdr[0] = TDS_PKT_REPLY;
+    hdr[1] = off + chunk == conn->out.len ? TDS_PKT_EOM : 0;
+    hdr[2] = ((chunk + TDS_PKT_HDRLEN) >> 8) & 0xff;
+    hdr[3] = (chunk + TDS_PKT_HDRLEN) & 0xff;
+    hdr[4] = (conn->spid >> 8) & 0xff;
+    hdr[5] = conn->spid & 0xff;
+    hdr[6] = pktid++;
+    hdr[7] = 0;
+
+    parts[0].base = hdr;
+    parts[0].len = TDS_PKT_HDRLEN;
+    parts[1].base = conn->out.data + off;
+    parts[1].len = chunk;
+
+    for (x = 0; x < 2; x++) {
+      const unsigned char *ptr = parts[x].base;
+      size_t left = parts[x].len;
+
+      while (left > 0) {
+        res = send(conn->fd, ptr, left, MSG_NOSIGNAL | (x == 0 ? MSG_MORE : 0));
+        if (res < 0 && errno == EINTR)
+          continue;
+        if (res <= 0)
+          return -1;
+        ptr += res;
+        left -= (size_t) res;
+      }
+    }
+
+    off += chunk;
+  } while (off < conn->out.len);
+
+  conn->out.len = 0;
+  return 0;
+}
+
+/* reading requests
+ */
+
+static int mock_read_full(int fd, unsigned char *buf, size_t len){
+  ssize_t res;
+
+  while (len > 0) {
+    res = read(fd, buf, len);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return -1;
+    buf += res;
+    len -= (size_t) res;
+  }
+
+  return 0;
+}
+
+/*
+ * mock_recv: reads one whole message, which may span several packets,
+ *  into conn->in.
+ *
+ * Returns: 0, or -1 once the client has gone or sent garbage.
+ */
+static int mock_recv(struct mock_conn_struct *conn){
+  unsigned char hdr[TDS_PKT_HDRLEN];
+  size_t len;
+
+  conn->in.len = 0;
+
+  do {
+    if (mock_read_full(conn->fd, hdr, sizeof(hdr)) < 0)
+      return -1;
+
+    len = ((size_t) hdr[2] << 8) | hdr[3];
+    if (len < TDS_PKT_HDRLEN || conn->in.len + len > MOCK_MAX_MSG)
+      return -1;
+    len -= TDS_PKT_HDRLEN;
+
+    conn->type = hdr[0];
+    if (conn->in.len + len > conn->in.size) {
+      conn->in.size = (conn->in.len + len) * 2;
+      conn->in.data = realloc(conn->in.data, conn->in.size);
+      if (conn->in.data == NULL)
+        return -1;
+    }
+
+    if (mock_read_full(conn->fd, conn->in.data + conn->in.len, len) < 0)
+      return -1;
+    conn->in.len += len;
+  } while (!(hdr[1] & TDS_PKT_EOM));
+
+  return 0;
+}
+
+static unsigned int mock_get_le16(const unsigned char *p){
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t mock_get_le32(const unsigned char *p){
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* UCS-2 from the client, folded to ASCII */
+static void mock_get_ucs2(const unsigned char *p, size_t nchars, char *dst,
+    size_t dstsz){
+  size_t x;
+
+  for (x = 0; x < nchars && x + 1 < dstsz; x++)
+    dst[x] = p[2 * x + 1] ? '?' : (char) p[2 * x];
+  dst[x] = '\0';
+}
+
+/*
+ * mock_login7_field: copies one of LOGIN7's variable length fields,
+ *  described by the offset and length at 'at' in the fixed part.
+ */
+static int mock_login7_field(struct mock_conn_struct *conn, size_t at,
+    char *dst, size_t dstsz, int password){
+  const unsigned char *msg = conn->in.data;
+  size_t off, nchars, x;
+
+  if (at + 4 > conn->in.len)
+    return -1;
+
+  off = mock_get_le16(msg + at);
+  nchars = mock_get_le16(msg + at + 2);
+  if (off + nchars * 2 > conn->in.len)
+    return -1;
+
+  if (nchars >= dstsz)
+    nchars = dstsz - 1;
+
+  for (x = 0; x < nchars; x++) {
+    unsigned char lo = msg[off + 2 * x], hi = msg[off + 2 * x + 1];
+
+    /* passwords have each byte's nibbles swapped, then XORed with 0xa5 */
+    if (password) {
+      lo ^= 0xa5;
+      lo = (lo << 4) | (lo >> 4);
+      hi ^= 0xa5;
+      hi = (hi << 4) | (hi >> 4);
+    }
+    dst[x] = hi ? '?' : (char) lo;
+  }
+  dst[x] = '\0';
+
+  return 0;
+}
+
+/* the protocol
+ */
+
+/*
+ * mock_prelogin: answers PRELOGIN with the version and that encryption is
+ *  not supported, so the client carries on in the clear.
+ */
+static int mock_prelogin(struct mock_conn_struct *conn){
+  /* VERSION at 11, ENCRYPTION at 17, then the terminator */
+  static const unsigned char reply[] = {
+    0x00, 0x00, 0x0b, 0x00, 0x06,
+    0x01, 0x00, 0x11, 0x00, 0x01,
+    0xff,
+    0x0f, 0x00, 0x07, 0xd0, 0x00, 0x00,
+    0x02
+  };
+
+  mock_put(&conn->out, reply, sizeof(reply));
+  return mock_send(conn);
+}
+
+/*
+ * mock_login: answers LOGIN7, with the database it names, or refuses it.
+ */
+static int mock_login(struct mock_conn_struct *conn){
+  const unsigned char *msg = conn->in.data;
+  char user[128], pass[128], db[128];
+  unsigned long n;
+  size_t at;
+  uint32_t pktsize;
+
+  /* the fixed part ends with the offsets up to the database name */
+  if (conn->in.len < 94)
+    return -1;
+
+  conn->tdsver = mock_get_le32(msg + 4);
+  pktsize = mock_get_le32(msg + 8);
+  if (pktsize >= 512 && pktsize <= 32767)
+    conn->pktsize = pktsize;
+
+  if (mock_login7_field(conn, 40, user, sizeof(user), 0) < 0 ||
+      mock_login7_field(conn, 44, pass, sizeof(pass), 1) < 0 ||
+      mock_login7_field(conn, 68, db, sizeof(db), 0) < 0)
+    return -1;
+
+  mock_sleep(mock_config.login_latency_us);
+
+  n = __sync_add_and_fetch(&mock_nlogins, 1);
+  if ((mock_config.refuse_every && n % mock_config.refuse_every == 0) ||
+      (mock_config.user && strcmp(user, mock_config.user) != 0) ||
+      (mock_config.pass && strcmp(pass, mock_config.pass) != 0)) {
+    char text[256];
+
+    snprintf(text, sizeof(text), "Login failed for user '%s'.", user);
+    mock_log("spid %u: refusing login for '%s'", conn->spid, user);
+    mock_put_error(conn, 18456, 14, text);
+    mock_put_done(conn, TDS_DONE_ERROR, 0, 0);
+    mock_send(conn);
+    return -1;
+  }
+
+  if (*db == '\0')
+    strcpy(db, "master");
+  snprintf(conn->db, sizeof(conn->db), "%s", db);
+
+  mock_log("spid %u: login '%s', database '%s', TDS %08x", conn->spid, user,
+    db, conn->tdsver);
+
+  mock_put_envchange(conn, 1, conn->db, "master");
+
+  /* the server's collation, which db-lib converts character data by */
+  mock_put_byte(&conn->out, TDS_TOK_ENVCHANGE);
+  mock_put_le16(&conn->out, 1 + 1 + sizeof(mock_collation) + 1);
+  mock_put_byte(&conn->out, 7);
+  mock_put_byte(&conn->out, sizeof(mock_collation));
+  mock_put(&conn->out, mock_collation, sizeof(mock_collation));
+  mock_put_byte(&conn->out, 0);
+
+  /* LOGINACK: interface, TDS version (big endian), program and version */
+  mock_put_byte(&conn->out, TDS_TOK_LOGINACK);
+  at = conn->out.len;
+  mock_put_le16(&conn->out, 0);
+  mock_put_byte(&conn->out, 1);
+  mock_put_byte(&conn->out, (conn->tdsver >> 24) & 0xff);
+  mock_put_byte(&conn->out, (conn->tdsver >> 16) & 0xff);
+  mock_put_byte(&conn->out, (conn->tdsver >> 8) & 0xff);
+  mock_put_byte(&conn->out, conn->tdsver & 0xff);
+  mock_put_bvarchar(&conn->out, "tdsmock");
+  mock_put_byte(&conn->out, 15);
+  mock_put_byte(&conn->out, 0);
+  mock_put_byte(&conn->out, 0x07);
+  mock_put_byte(&conn->out, 0xd0);
+  mock_put_len_at(&conn->out, at);
+
+  {
+    char size[16];
+
+    snprintf(size, sizeof(size), "%lu", (unsigned long) conn->pktsize);
+    mock_put_envchange(conn, 4, size, size);
+  }
+
+  mock_put_done(conn, 0, 0, 0);
+  return mock_send(conn);
+}
+
+/* the canned tables
+ */
+
+/*
+ * mock_value: the text of column col of row in the canned table, or NULL.
+ */
+static const char *mock_value(const struct mock_col_struct *table,
+    unsigned long row, int col, char *buf, size_t bufsz){
+  const char *name = NULL;
+  size_t len;
+  unsigned long x;
+
+  if (col < 0)
+    return NULL;
+
+  name = table[col].name;
+
+  if (table == mock_users_cols) {
+    if (!strcmp(name, "userid"))
+      snprintf(buf, bufsz, "user%lu", row);
+    else if (!strcmp(name, "passwd"))
+      snprintf(buf, bufsz, "password%lu", row);
+    else if (!strcmp(name, "uid"))
+      snprintf(buf, bufsz, "%lu", 10000 + row);
+    else if (!strcmp(name, "gid"))
+      snprintf(buf, bufsz, "%lu", 10000 + row % mock_config.ngroups);
+    else if (!strcmp(name, "homedir"))
+      snprintf(buf, bufsz, "/home/user%lu", row);
+    else
+      snprintf(buf, bufsz, "/bin/sh");
+
+    return buf;
+  }
+
+  if (!strcmp(name, "groupname")) {
+    snprintf(buf, bufsz, "group%lu", row);
+
+  } else if (!strcmp(name, "gid")) {
+    snprintf(buf, bufsz, "%lu", 10000 + row);
+
+  } else {
+    /* the first few users whose primary group this is */
+    *buf = '\0';
+    len = 0;
+    for (x = row; x < mock_config.nusers && x < row + 8 * mock_config.ngroups;
+        x += mock_config.ngroups)
+      len += snprintf(buf + len, bufsz - len, "%suser%lu", len ? "," : "", x);
+  }
+
+  return buf;
+}
+
+static int mock_col_index(const struct mock_col_struct *table,
+    const char *name){
+  int x;
+
+  for (x = 0; table[x].name; x++) {
+    if (strcasecmp(table[x].name, name) == 0)
+      return x;
+  }
+
+  return -1;
+}
+
+/* a SQL LIKE pattern with % and _ only */
+static int mock_like(const char *str, const char *pat){
+  if (*pat == '\0')
+    return *str == '\0';
+
+  if (*pat == '%') {
+    for (; ; str++) {
+      if (mock_like(str, pat + 1))
+        return 1;
+      if (*str == '\0')
+        return 0;
+    }
+  }
+
+  if (*str == '\0' || (*pat != '_' && tolower(*pat) != tolower(*str)))
+    return 0;
+
+  return mock_like(str + 1, pat + 1);
+}
+
+/* the next identifier, with [] and table prefixes taken off */
+static const char *mock_ident(const char *ptr, char *dst, size_t dstsz){
+  size_t len = 0;
+
+  while (isspace((int) *ptr))
+    ptr++;
+
+  while (*ptr && (isalnum((int) *ptr) || strchr("_@.[]#", *ptr))) {
+    if (*ptr == '.')
+      len = 0;
+    else if (*ptr != '[' && *ptr != ']' && len + 1 < dstsz)
+      dst[len++] = *ptr;
+    ptr++;
+  }
+  dst[len] = '\0';
+
+  return ptr;
+}
+
+/* a quoted literal, with '' turned back into ' */
+static const char *mock_literal(const char *ptr, char *dst, size_t dstsz){
+  size_t len = 0;
+
+  while (isspace((int) *ptr))
+    ptr++;
+  if (*ptr == 'N' && ptr[1] == '\'')
+    ptr++;
+  if (*ptr != '\'')
+    return NULL;
+
+  for (ptr++; *ptr; ptr++) {
+    if (*ptr == '\'') {
+      if (ptr[1] != '\'')
+        break;
+      ptr++;
+    }
+    if (len + 1 < dstsz)
+      dst[len++] = *ptr;
+  }
+  dst[len] = '\0';
+
+  return *ptr ? ptr + 1 : NULL;
+}
+
+static const char *mock_keyword(const char *ptr, const char *word){
+  size_t len = strlen(word);
+
+  while (isspace((int) *ptr))
+    ptr++;
+
+  if (strncasecmp(ptr, word, len) == 0 &&
+      !(isalnum((int) ptr[len]) || ptr[len] == '_'))
+    return ptr + len;
+
+  return NULL;
+}
+
+/*
+ * mock_parse_where: understands "col = 'value'" and "col LIKE 'pattern'"
+ *  terms joined by AND.  Anything else matches every row.
+ */
+static void mock_parse_where(struct mock_select_struct *sel, const char *ptr){
+  const char *next = NULL;
+  char name[64];
+  int col, like;
+
+  while (ptr && *ptr && sel->nconds < MOCK_MAX_CONDS) {
+    while (isspace((int) *ptr) || *ptr == '(')
+      ptr++;
+
+    ptr = mock_ident(ptr, name, sizeof(name));
+    while (isspace((int) *ptr))
+      ptr++;
+
+    like = FALSE;
+    if (*ptr == '=') {
+      ptr++;
+    } else if ((next = mock_keyword(ptr, "LIKE")) != NULL) {
+      ptr = next;
+      like = TRUE;
+    } else {
+      return;
+    }
+
+    col = mock_col_index(sel->table, name);
+    ptr = mock_literal(ptr, sel->condval[sel->nconds],
+      sizeof(sel->condval[0]));
+    if (ptr == NULL || col < 0)
+      return;
+
+    sel->condcol[sel->nconds] = col;
+    sel->condlike[sel->nconds] = like;
+    sel->nconds++;
+
+    while (isspace((int) *ptr) || *ptr == ')')
+      ptr++;
+    if ((ptr = mock_keyword(ptr, "AND")) == NULL)
+      return;
+  }
+}
+
+/*
+ * mock_parse_select: parses "SELECT [TOP n] [DISTINCT] cols FROM table
+ *  [WHERE ...]".  A SELECT without FROM, such as a ping, gets one row
+ *  with one int column: 1, or the spid for @@spid.
+ *
+ * Returns: 0, or -1 for a table it doesn't know.
+ */
+static int mock_parse_select(struct mock_select_struct *sel, const char *sql){
+  const char *ptr = sql + 6, *from = NULL, *where = NULL, *next = NULL;
+  char name[64], list[4096];
+  size_t len;
+  char *field = NULL, *save = NULL;
+
+  memset(sel, 0, sizeof(*sel));
+  sel->top = -1;
+
+  if ((next = mock_keyword(ptr, "TOP")) != NULL) {
+    while (isspace((int) *next) || *next == '(')
+      next++;
+    sel->top = strtol(next, (char **) &ptr, 10);
+    while (isspace((int) *ptr) || *ptr == ')')
+      ptr++;
+  }
+  if ((next = mock_keyword(ptr, "DISTINCT")) != NULL)
+    ptr = next;
+
+  for (from = ptr; *from; from++) {
+    if (isspace((int) from[-1]) && mock_keyword(from, "FROM") == from + 4)
+      break;
+  }
+
+  if (*from == '\0') {
+    sel->table = NULL;
+    sel->ncols = 1;
+    sel->nrows = 1;
+    sel->spid = (strstr(ptr, "@@spid") != NULL);
+    return 0;
+  }
+
+  len = from - ptr;
+  if (len >= sizeof(list))
+    len = sizeof(list) - 1;
+  memcpy(list, ptr, len);
+  list[len] = '\0';
+
+  ptr = mock_ident(from + 4, name, sizeof(name));
+  if (strcasecmp(name, "users") == 0) {
+    sel->table = mock_users_cols;
+    sel->nrows = mock_config.nusers;
+  } else if (strcasecmp(name, "groups") == 0) {
+    sel->table = mock_groups_cols;
+    sel->nrows = mock_config.ngroups;
+  } else {
+    return -1;
+  }
+
+  for (field = strtok_r(list, ",", &save); field && sel->ncols < MOCK_MAX_COLS;
+      field = strtok_r(NULL, ",", &save)) {
+    mock_ident(field, name, sizeof(name));
+
+    if (strcmp(name, "") == 0 && strchr(field, '*')) {
+      int x;
+
+      for (x = 0; sel->table[x].name && sel->ncols < MOCK_MAX_COLS; x++) {
+        sel->cols[sel->ncols] = x;
+        snprintf(sel->names[sel->ncols++], sizeof(sel->names[0]), "%s",
+          sel->table[x].name);
+      }
+      continue;
+    }
+
+    sel->cols[sel->ncols] = mock_col_index(sel->table, name);
+    snprintf(sel->names[sel->ncols++], sizeof(sel->names[0]), "%s", name);
+  }
+
+  for (where = ptr; *where; where++) {
+    if (isspace((int) where[-1]) && (next = mock_keyword(where, "WHERE")) ==
+        where + 5) {
+      mock_parse_where(sel, next);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static int mock_row_matches(struct mock_select_struct *sel,
+    unsigned long row){
+  char buf[1024];
+  const char *val = NULL;
+  int x;
+
+  for (x = 0; x < sel->nconds; x++) {
+    val = mock_value(sel->table, row, sel->condcol[x], buf, sizeof(buf));
+    if (val == NULL)
+      return FALSE;
+
+    if (sel->condlike[x] ? !mock_like(val, sel->condval[x]) :
+        strcasecmp(val, sel->condval[x]) != 0)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * mock_put_select: the result set of a SELECT.
+ */
+static unsigned long mock_put_select(struct mock_conn_struct *conn,
+    struct mock_select_struct *sel){
+  const struct mock_col_struct *col = NULL;
+  static const struct mock_col_struct unknown = { NULL, 0, 255 };
+  static const struct mock_col_struct intcol = { NULL, 1, 4 };
+  char buf[1024];
+  const char *val = NULL;
+  unsigned long row, nrows = 0;
+  size_t len;
+  int x;
+
+  mock_put_byte(&conn->out, TDS_TOK_COLMETADATA);
+  mock_put_le16(&conn->out, sel->ncols);
+
+  for (x = 0; x < sel->ncols; x++) {
+    col = sel->table == NULL ? &intcol :
+      sel->cols[x] < 0 ? &unknown : &sel->table[sel->cols[x]];
+
+    if (mock_tds72(conn))
+      mock_put_le32(&conn->out, 0);
+    else
+      mock_put_le16(&conn->out, 0);
+    mock_put_le16(&conn->out, 0x0001);
+
+    if (col->isint) {
+      mock_put_byte(&conn->out, TDS_TYPE_INTN);
+      mock_put_byte(&conn->out, 4);
+    } else {
+      mock_put_byte(&conn->out, TDS_TYPE_BIGVARCHAR);
+      mock_put_le16(&conn->out, col->maxlen);
+      mock_put(&conn->out, mock_collation, sizeof(mock_collation));
+    }
+
+    mock_put_bvarchar(&conn->out, sel->table ? sel->names[x] : "");
+  }
+
+  if (sel->table == NULL) {
+    mock_put_byte(&conn->out, TDS_TOK_ROW);
+    mock_put_byte(&conn->out, 4);
+    mock_put_le32(&conn->out, sel->spid ? conn->spid : 1);
+    return 1;
+  }
+
+  for (row = 0; row < sel->nrows; row++) {
+    if (sel->top >= 0 && nrows >= (unsigned long) sel->top)
+      break;
+    if (!mock_row_matches(sel, row))
+      continue;
+
+    mock_put_byte(&conn->out, TDS_TOK_ROW);
+    for (x = 0; x < sel->ncols; x++) {
+      col = sel->cols[x] < 0 ? &unknown : &sel->table[sel->cols[x]];
+      val = mock_value(sel->table, row, sel->cols[x], buf, sizeof(buf));
+
+      if (col->isint) {
+        mock_put_byte(&conn->out, 4);
+        mock_put_le32(&conn->out, (uint32_t) strtoul(val, NULL, 10));
+
+      } else if (val == NULL) {
+        mock_put_le16(&conn->out, 0xffff);
+
+      } else {
+        len = strlen(val);
+        if (len > col->maxlen)
+          len = col->maxlen;
+        mock_put_le16(&conn->out, len);
+        mock_put(&conn->out, val, len);
+      }
+    }
+    nrows++;
+  }
+
+  return nrows;
+}
+
+/*
+ * mock_statement: the reply to one statement of a batch.
+ */
+static void mock_statement(struct mock_conn_struct *conn, const char *sql,
+    int more){
+  struct mock_select_struct sel;
+  unsigned int status = more ? TDS_DONE_MORE : 0;
+  unsigned long n, nrows;
+  char db[128];
+  char text[256];
+
+  n = __sync_add_and_fetch(&mock_nstatements, 1);
+  if (mock_config.fail_every && n % mock_config.fail_every == 0) {
+    snprintf(text, sizeof(text), "Injected failure %lu.", n);
+    mock_put_error(conn, mock_config.fail_msgno, 13, text);
+    mock_put_done(conn, status | TDS_DONE_ERROR, 0, 0);
+    return;
+  }
+
+  if (mock_keyword(sql, "SELECT") == sql + 6) {
+    if (mock_parse_select(&sel, sql) < 0) {
+      mock_put_error(conn, 208, 16, "Invalid object name.");
+      mock_put_done(conn, status | TDS_DONE_ERROR, 0xc1, 0);
+      return;
+    }
+
+    nrows = mock_put_select(conn, &sel);
+    mock_put_done(conn, status | TDS_DONE_COUNT, 0xc1, nrows);
+    return;
+  }
+
+  if (mock_keyword(sql, "USE") == sql + 3) {
+    mock_ident(sql + 3, db, sizeof(db));
+    mock_put_envchange(conn, 1, db, conn->db);
+    snprintf(conn->db, sizeof(conn->db), "%s", db);
+    mock_put_done(conn, status, 0xe2, 0);
+    return;
+  }
+
+  if (mock_keyword(sql, "INSERT") || mock_keyword(sql, "UPDATE") ||
+      mock_keyword(sql, "DELETE")) {
+    mock_put_done(conn, status | TDS_DONE_COUNT,
+      mock_keyword(sql, "INSERT") ? 0xc3 : mock_keyword(sql, "UPDATE") ?
+      0xc5 : 0xc4, 1);
+    return;
+  }
+
+  mock_put_done(conn, status, 0, 0);
+}
+
+/*
+ * mock_batch: answers a SQL batch, one statement per line.
+ */
+static int mock_batch(struct mock_conn_struct *conn){
+  const unsigned char *msg = conn->in.data;
+  size_t off = 0, nchars;
+  char *sql = NULL, *stmt = NULL, *next = NULL;
+  unsigned long n;
+
+  /* TDS 7.2 puts headers, led by their total length, before the text */
+  if (mock_tds72(conn)) {
+    if (conn->in.len < 4)
+      return -1;
+    off = mock_get_le32(msg);
+    if (off > conn->in.len)
+      return -1;
+  }
+
+  nchars = (conn->in.len - off) / 2;
+  sql = malloc(nchars + 1);
+  mock_get_ucs2(msg + off, nchars, sql, nchars + 1);
+
+  mock_log("spid %u: %s", conn->spid, sql);
+
+  n = __sync_add_and_fetch(&mock_nbatches, 1);
+  if (mock_config.drop_every && n % mock_config.drop_every == 0) {
+    mock_log("spid %u: dropping the connection", conn->spid);
+    free(sql);
+    return -1;
+  }
+
+  mock_sleep(mock_config.latency_us);
+
+  for (stmt = sql; stmt; stmt = next) {
+    next = strchr(stmt, '\n');
+    if (next)
+      *next++ = '\0';
+
+    while (isspace((int) *stmt) || *stmt == ';')
+      stmt++;
+    while (next && (isspace((int) *next) || *next == ';'))
+      next++;
+    if (next && *next == '\0')
+      next = NULL;
+
+    if (*stmt == '\0' && next)
+      continue;
+
+    mock_statement(conn, stmt, next != NULL);
+  }
+
+  free(sql);
+  return mock_send(conn);
+}
+
+/*
+ * mock_session: serves one client until it hangs up.
+ */
+static void *mock_session(void *arg){
+  struct mock_conn_struct *conn = arg;
+  int logged_in = FALSE;
+  int res = 0;
+
+  while (res == 0 && mock_recv(conn) == 0) {
+    switch (conn->type) {
+      case TDS_PKT_PRELOGIN:
+        res = logged_in ? -1 : mock_prelogin(conn);
+        break;
+
+      case TDS_PKT_LOGIN7:
+        res = logged_in ? -1 : mock_login(conn);
+        logged_in = (res == 0);
+        break;
+
+      case TDS_PKT_QUERY:
+        res = logged_in ? mock_batch(conn) : -1;
+        break;
+
+      case TDS_PKT_RPC:
+        if (!logged_in) {
+          res = -1;
+          break;
+        }
+        mock_put_error(conn, 2812, 16,
+          "Remote procedure calls are not supported by tdsmock.");
+        mock_put_done(conn, TDS_DONE_ERROR, 0, 0);
+        res = mock_send(conn);
+        break;
+
+      case TDS_PKT_CANCEL:
+        /* replies are always complete, so there is nothing to cut short */
+        mock_put_done(conn, TDS_DONE_ATTN, 0, 0);
+        res = mock_send(conn);
+        break;
+
+      default:
+        mock_log("spid %u: unsupported packet type 0x%02x", conn->spid,
+          conn->type);
+        res = -1;
+        break;
+    }
+  }
+
+  mock_log("spid %u: closed", conn->spid);
+  close(conn->fd);
+  free(conn->in.data);
+  free(conn->out.data);
+  free(conn);
+  return NULL;
+}
+
+static void mock_usage(void){
+  fprintf(stderr,
+    "usage: tdsmock [-a addr] [-p port] [-u users] [-g groups]\n"
+    "               [-U user] [-P password] [-l latency-us] [-L login-latency-us]\n"
+    "               [-f fail-every] [-e msgno] [-d drop-every] [-r refuse-every]\n"
+    "               [-v]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]){
+  struct sockaddr_in sin;
+  struct mock_conn_struct *conn = NULL;
+  const char *addr = "127.0.0.1";
+  pthread_attr_t attr;
+  pthread_t tid;
+  int port = 1433, fd, sfd, opt, on = 1;
+
+  while ((opt = getopt(argc, argv, "a:p:u:g:U:P:l:L:f:e:d:r:v")) != -1) {
+    switch (opt) {
+      case 'a': addr = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'u': mock_config.nusers = strtoul(optarg, NULL, 10); break;
+      case 'g': mock_config.ngroups = strtoul(optarg, NULL, 10); break;
+      case 'U': mock_config.user = optarg; break;
+      case 'P': mock_config.pass = optarg; break;
+      case 'l': mock_config.latency_us = strtoul(optarg, NULL, 10); break;
+      case 'L': mock_config.login_latency_us = strtoul(optarg, NULL, 10); break;
+      case 'f': mock_config.fail_every = strtoul(optarg, NULL, 10); break;
+      case 'e': mock_config.fail_msgno = strtol(optarg, NULL, 10); break;
+      case 'd': mock_config.drop_every = strtoul(optarg, NULL, 10); break;
+      case 'r': mock_config.refuse_every = strtoul(optarg, NULL, 10); break;
+      case 'v': mock_config.verbose = TRUE; break;
+      default: mock_usage();
+    }
+  }
+
+  if (mock_config.ngroups == 0)
+    mock_usage();
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+    mock_usage();
+
+  sfd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (sfd < 0 || bind(sfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+      listen(sfd, 128) < 0) {
+    fprintf(stderr, MOCK_VERSION ": unable to listen on %s:%d: %s\n", addr,
+      port, strerror(errno));
+    return 1;
+  }
+
+  fprintf(stderr, MOCK_VERSION ": listening on %s:%d, %lu users, %lu groups\n",
+    addr, port, mock_config.nusers, mock_config.ngroups);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    fd = accept(sfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, MOCK_VERSION ": accept: %s\n", strerror(errno));
+      return 1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    conn = calloc(1, sizeof(*conn));
+    conn->fd = fd;
+    conn->spid = 51 + (__sync_add_and_fetch(&mock_nsessions, 1) % 30000);
+    conn->pktsize = 4096;
+    conn->tdsver = 0x71000001;
+
+    if (pthread_create(&tid, &attr, mock_session, conn) != 0) {
+      close(fd);
+      free(conn);
+    }
+  }
+
+  return 0;
+}
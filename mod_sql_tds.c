@@ -27,7 +27,7 @@
  * the source code for OpenSSL in the source distribution.
  */
 /*
- * $Libraries: -lsybdb $
+ * $Libraries: -lsybdb -lpthread $
  */
 
 /* INTRO:
@@ -58,9 +58,41 @@
 #include "conf.h"
 #include "../contrib/mod_sql.h"
 
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * vector width for the quote scan in _sql_escape_quotes; without SSE2
+ * the scan is done a byte at a time.
+ */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define TDS_VEC_LEN		32
+typedef __m256i tds_vec_t;
+# define TDS_VEC_LOADU(p)	_mm256_loadu_si256((const __m256i *) (p))
+# define TDS_VEC_STOREU(p, v)	_mm256_storeu_si256((__m256i *) (p), (v))
+# define TDS_VEC_SET1(c)	_mm256_set1_epi8(c)
+# define TDS_VEC_EQ(a, b)	_mm256_cmpeq_epi8((a), (b))
+# define TDS_VEC_OR(a, b)	_mm256_or_si256((a), (b))
+# define TDS_VEC_MASK(v)	((unsigned int) _mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define TDS_VEC_LEN		16
+typedef __m128i tds_vec_t;
+# define TDS_VEC_LOADU(p)	_mm_loadu_si128((const __m128i *) (p))
+# define TDS_VEC_STOREU(p, v)	_mm_storeu_si128((__m128i *) (p), (v))
+# define TDS_VEC_SET1(c)	_mm_set1_epi8(c)
+# define TDS_VEC_EQ(a, b)	_mm_cmpeq_epi8((a), (b))
+# define TDS_VEC_OR(a, b)	_mm_or_si128((a), (b))
+# define TDS_VEC_MASK(v)	((unsigned int) _mm_movemask_epi8(v))
+#endif
+
 /* 
  * timer-handling code adds the need for a couple of forward declarations
  */
+MODRET cmd_open( cmd_rec *cmd );
 MODRET cmd_close( cmd_rec *cmd );
 module sql_tds_module;
 
@@ -71,12 +103,32 @@ module sql_tds_module;
  */
 struct db_conn_struct {
 
+  char *servers;      /* server list, as configured       */
+  char **serverv;     /* ... split up, in configured order */
+  int serverc;
   char *server;       /* server name from INTERFACE file  */
   char *user;         /* User to access the server        */
   char *pass;         /* Password                         */
   char *db;           /* What Database Are we using       */
 
   DBPROCESS *dbproc;  /* Our connection to the DB         */
+  time_t last_used;   /* When dbproc was last known alive */
+
+  int query_timeout;  /* SQLTDSTimeouts, 0 for none       */
+  int login_timeout;
+  int armed;          /* Timeout currently set on dbproc  */
+
+  int read_intent;    /* Log in with ApplicationIntent=ReadOnly */
+
+  unsigned long max_rows;  /* SQLTDSResultLimit, 0 for none */
+  size_t max_bytes;
+  size_t fetched;     /* Bytes read by the last fetch, and */
+  int truncated;      /*  whether it stopped at the limit  */
+  array_header *nulls; /* if set, the fetch notes NULLs here */
+
+  int timed_out;      /* Last error state, kept by the    */
+  DBINT msgno;        /*  db-lib handlers for _build_error */
+  char msgtext[256];
 };
 
 typedef struct db_conn_struct db_conn_t;
@@ -87,12 +139,78 @@ struct rowdata{
 };
 typedef struct rowdata rowdata_t;
 
-struct tempdata{
-  char **data;
-  struct tempdata *next;
+/*
+ * result_arena_struct: growable storage used by _build_data.  Values are
+ *  carved out of blocks allocated from the cmd's tmp_pool, and the flat
+ *  data array handed to mod_sql grows by doubling, so each row costs at
+ *  most one allocation and each value is copied exactly once.
+ */
+struct result_arena_struct {
+  pool *pool;
+
+  char **data;          /* flat value array returned in sql_data_t     */
+  unsigned long nused;  /* slots used in data                          */
+  unsigned long nalloc; /* slots allocated in data                     */
+
+  char *buf;            /* free space in the current string block      */
+  size_t bufleft;       /* bytes left in the current string block      */
+  size_t blocksz;       /* size of the last string block allocated     */
+};
+
+typedef struct result_arena_struct result_arena_t;
+
+/*
+ * result_col_struct: per-column binding information read once per result
+ *  set.  Character data is copied straight out of dbdata(); every other
+ *  type is formatted into the column's scratch buffer first.
+ */
+struct result_col_struct {
+  int type;             /* dbcoltype() of the column                   */
+  DBINT collen;         /* dbcollen() of the column                    */
+
+  char *scratch;        /* formatting buffer for non-character types   */
+  size_t scratchsz;     /* size of scratch                             */
+};
+
+typedef struct result_col_struct result_col_t;
+
+#define TDS_SCRATCH_MIN   64  /* a formatted number or date */
+
+#define ARENA_MIN_SLOTS  64
+#define ARENA_MIN_BLOCK  4096
+#define ARENA_MAX_BLOCK  (256 * 1024)
+
+/*
+ * result_cache_struct: a memoized SELECT result, see SQLTDSQueryCache.
+ *  Each entry lives in its own sub-pool so it can be dropped on its own.
+ */
+struct result_cache_struct {
+  pool *pool;
+  struct result_cache_struct *next;
+
+  unsigned int hash;    /* _sql_hash() of query                        */
+  char *query;          /* final query text                            */
+  time_t expires;
+  sql_data_t *sd;
 };
 
-typedef struct tempdata tempdata_t;
+typedef struct result_cache_struct result_cache_t;
+
+/* how long prefetched login rows stand in for the server */
+#define TDS_PREFETCH_TTL 30
+
+/* sp_executesql shapes, and literals remembered for them */
+#define TDS_SHAPE_PARAMS   1    /* has run parameterized */
+#define TDS_SHAPE_LITERAL  2    /* was refused, send it as it is */
+#define TDS_MAX_SHAPES     256
+#define TDS_MAX_PARAMVALS  64
+#define TDS_MAX_PARAMLEN   8000
+
+#ifdef SYBNVARCHAR
+# define TDS_RPC_NTEXT SYBNVARCHAR
+#else
+# define TDS_RPC_NTEXT SYBVARCHAR
+#endif
 
 struct conn_entry_struct {
   char *name;
@@ -106,19 +224,315 @@ struct conn_entry_struct {
   /* connection handling */
 
   unsigned int connections;
+
+  /* result caching */
+
+  result_cache_t *cache;
+  unsigned int ncached;
+
+  /* write-behind, see SQLTDSWriteBehind */
+
+  unsigned int wb_max_count;
+  size_t wb_max_bytes;
+  int wb_interval;
+  char *wb_tables;              /* comma-separated, the only ones queued */
+
+  pool *wb_pool;
+  array_header *wb_queue;
+  size_t wb_bytes;
+  int wb_timer;
+
+  /* bulk copy, see SQLTDSBulkCopy */
+
+  char *bcp_table;
+  unsigned int bcp_batch;
+  int bcp_interval;
+  int bcp_disabled;
+
+  pool *bcp_pool;
+  DBPROCESS *bcp_dbproc;
+  char *bcp_cols;               /* INSERT column list currently bound */
+  array_header *bcp_ordinals;   /* table ordinal of each bound column */
+  unsigned int bcp_rows;        /* rows sent in the open batch */
+  int bcp_timer;
+
+  /* deferred results, see SQLTDSDeferResults */
+
+  int defer;
+  int defer_interval;
+
+  pool *defer_pool;
+  char *defer_query;            /* sent, results not yet read */
+  int defer_timer;
+
+  /* read servers, see SQLTDSReadServers */
+
+  struct conn_entry_struct *read_entry;
+  int read_pin;
+  time_t last_write;
+
+  /* parameterized statements, see SQLTDSParameterize */
+
+  int param;
+  pool *param_pool;
+  array_header *param_vals;     /* literals made by cmd_escapestring */
+  pr_table_t *param_shapes;     /* statement shape, TDS_SHAPE_* */
+
+  /* login prefetch, see SQLTDSLoginPrefetch */
+
+  char *pf_users;               /* user table, whose lookup triggers it */
+  char *pf_groups;              /* group table, answered locally */
+  char *pf_where;               /* group rows to fetch, %u for the user */
+  pool *pf_pool;
+  sql_data_t *pf_rows;
+  char **pf_cols;               /* column names of pf_rows */
+  unsigned char *pf_nulls;      /* which of pf_rows' values are NULL */
+  char *pf_pred;                /* group-where as sent, normalized */
+  time_t pf_expires;
+
+  /* paged selects, see SQLTDSPageSize */
+
+  unsigned long page_rows;
+  char *page_key;
+
+  /* early login, see _sql_tds_login_start */
+
+  int login_started;            /* login_thread is running */
+  int login_joined;             /* ... and has finished, not yet used */
+  pthread_t login_thread;
+  LOGINREC *login_rec;
+  DBPROCESS *login_dbproc;      /* written by login_thread until joined */
+  const char *login_error;
 };
 
 typedef struct conn_entry_struct conn_entry_t;
 
+/* the entry-based halves of cmd_open and cmd_close */
+static modret_t *_sql_tds_open(cmd_rec *cmd, conn_entry_t *entry);
+static void _sql_tds_close(conn_entry_t *entry, int force);
+
 #define DEF_CONN_POOL_SIZE 10
 
 static array_header *conn_cache;
+static pr_table_t *conn_index;      /* conn_cache, by name */
 static pool *conn_pool;
 
+/* module configuration, read once per session by _sql_tds_read_config */
+static int tds_config_read = FALSE;
+static int tds_ping_interval = 0;
+static char *tds_broker_path = NULL;
+static int tds_cache_ttl = 0;
+static unsigned int tds_cache_max = 0;
+static int tds_auth_timeout = 0;
+
+/* when the USER or PASS command in progress must be done by, or 0 */
+static time_t tds_auth_deadline = 0;
+
+/* broker mode state, see SQLTDSBroker */
+#define TDS_BROKER_MAGIC        0x54445342 /* "TDSB" */
+#define TDS_BROKER_MAX_FRAME    (64 * 1024 * 1024)
+#define TDS_BROKER_DEF_WORKERS  4
+#define TDS_BROKER_MAX_WORKERS  64
+
+#define TDS_BROKER_OP_SELECT    1 /* always returns a result set */
+#define TDS_BROKER_OP_EXEC      2 /* never returns a result set  */
+#define TDS_BROKER_OP_QUERY     3 /* returns rows if there are any */
+
+#define TDS_BROKER_OK           0
+#define TDS_BROKER_DATA         1
+#define TDS_BROKER_ERROR        2
+
+#define TDS_BROKER_REQ_TIMEOUT  30 /* to send a request, or to run it */
+#define TDS_BROKER_CHECK_SECS   5  /* how often dead workers are replaced */
+#define TDS_BROKER_REQ_HDRLEN   (1 + 3 * sizeof(uint32_t))
+
+/*
+ * broker_login_struct: a login the broker workers may use.  The master
+ *  collects these from SQLConnectInfo before forking; a request only
+ *  names one by its index, so credentials never cross the socket.
+ */
+struct broker_login_struct {
+  char *servers;
+  char *user;
+  char *pass;
+  char *db;
+};
+
+typedef struct broker_login_struct broker_login_t;
+
+/*
+ * broker_client_struct: a worker's view of one session connection.  A
+ *  request is read as its bytes arrive, never blocking the worker, and
+ *  has to be complete within TDS_BROKER_REQ_TIMEOUT of its first byte.
+ */
+struct broker_client_struct {
+  pool *pool;         /* request in progress, NULL between requests */
+  char hdr[TDS_BROKER_REQ_HDRLEN];
+  char *payload;
+  uint32_t len;       /* payload length, from the header            */
+  size_t have;        /* header and payload bytes read so far       */
+  time_t deadline;
+};
+
+typedef struct broker_client_struct broker_client_t;
+
+static int tds_broker_fd = -1;          /* session's socket to the broker */
+static int tds_broker_listenfd = -1;    /* master's listening socket      */
+static volatile pid_t tds_broker_pids[TDS_BROKER_MAX_WORKERS]; /* 0 if dead */
+static int tds_broker_nworkers = 0;
+static int tds_broker_timerno = -1;     /* master's respawn timer         */
+static int tds_child_hooked = FALSE;    /* SIGCHLD handler installed?     */
+static void (*tds_child_chld)(int) = NULL; /* ... and the one it chains to */
+static pool *tds_broker_pool = NULL;
+static array_header *tds_broker_logins = NULL;
+
+/*
+ * shm_cache_struct: the cross-process lookup cache, see SQLTDSSharedCache.
+ *  It is mapped in the master before any session is forked.  Slots are
+ *  grouped into sets of TDS_SHM_WAYS; readers use each slot's sequence
+ *  number as a seqlock, writers claim a slot by making it odd.
+ */
+#define TDS_SHM_WAYS            4
+#define TDS_SHM_REFRESH_PCT     80 /* refresh ahead after 80% of the TTL */
+#define TDS_SHM_DEF_SLOTSZ      2048
+#define TDS_SHM_MAX_SLOTS       (1024 * 1024)
+
+struct shm_slot_struct {
+  volatile unsigned int seq;        /* odd while being written         */
+  volatile unsigned char ref;       /* CLOCK reference bit             */
+  volatile unsigned char refreshing;/* one session is refreshing it    */
+
+  unsigned int hash;
+  time_t expires;
+  unsigned int keylen;              /* key, NUL included               */
+  unsigned int datalen;             /* values, each NUL terminated     */
+  unsigned long rnum;
+  unsigned long fnum;
+
+  char buf[1];                      /* key, then values                */
+};
+
+typedef struct shm_slot_struct shm_slot_t;
+
+struct shm_cache_struct {
+  unsigned int nsets;
+  size_t slotsz;                    /* bytes per slot, header included */
+  int ttl;
+
+  volatile unsigned long hits;
+  volatile unsigned long misses;
+  volatile unsigned long stores;
+  volatile unsigned long evictions;
+  volatile unsigned long refreshes;
+
+  int neg_ttl;                      /* SQLTDSNegativeCache, 0 for ttl  */
+  volatile unsigned long neg_hits;  /* empty results served            */
+  volatile unsigned long neg_stores;
+
+  char slots[1];
+};
+
+typedef struct shm_cache_struct shm_cache_t;
+
+static shm_cache_t *tds_shm_cache = NULL;
+static size_t tds_shm_cache_len = 0;
+
+/*
+ * shm_filter_struct: the shared Bloom filter of user names, see
+ *  SQLTDSUserFilter.  It is mapped in the master like the shared cache.
+ *  A child of the master rebuilds it into the half that isn't live, then
+ *  makes that half live with a single store, so readers never need a
+ *  lock.
+ */
+#define TDS_FILTER_BUILD_TIMEOUT  600 /* for the rebuild's SELECT */
+
+struct shm_filter_struct {
+  size_t nbytes;                    /* bytes in each half              */
+  unsigned int k;                   /* bits set per name               */
+  int refresh;
+  unsigned long capacity;           /* names before the rate is missed */
+
+  volatile int live;                /* 0 or 1, -1 until first built    */
+  volatile time_t built;
+  volatile unsigned long nnames;
+
+  volatile unsigned long checks;
+  volatile unsigned long rejects;
+
+  unsigned char bits[1];            /* two halves of nbytes            */
+};
+
+typedef struct shm_filter_struct shm_filter_t;
+
+static shm_filter_t *tds_filter = NULL;
+static size_t tds_filter_len = 0;
+static char *tds_filter_conn = NULL;
+static broker_login_t tds_filter_login;   /* what the rebuild logs in as */
+static volatile pid_t tds_filter_pid = 0; /* rebuild running, or 0       */
+static int tds_filter_timerno = -1;
+static pool *tds_filter_pool = NULL;
+static char *tds_user_field = NULL;
+static char *tds_pass_field = NULL;
+static char *tds_user_table = NULL;
+static char *tds_group_table = NULL;
+
+/*
+ * shm_health_struct: how each database server has been doing, shared by
+ *  all sessions so that one session's bad experience steers the others
+ *  away.  Latencies are EWMAs in microseconds; updates from different
+ *  processes may race, which only costs a sample.
+ */
+#define TDS_HEALTH_SLOTS        64
+#define TDS_HEALTH_NAMELEN      64
+#define TDS_HEALTH_MAX_BACKOFF  64 /* seconds a failing server is avoided */
+#define TDS_MAX_SERVERS         16
+
+#define TDS_HEALTH_FREE         0
+#define TDS_HEALTH_CLAIMED      1  /* name being written */
+#define TDS_HEALTH_READY        2
+#define TDS_HEALTH_SPINS        1000
+
+struct shm_health_struct {
+  volatile unsigned int state;      /* TDS_HEALTH_FREE etc.            */
+  unsigned int hash;                /* set before the slot is READY    */
+  char name[TDS_HEALTH_NAMELEN];
+
+  volatile unsigned int login_us;   /* dbopen plus dbuse               */
+  volatile unsigned int query_us;   /* dbsqlexec, to the first reply   */
+  volatile unsigned int failures;   /* consecutive                     */
+  volatile time_t failed_at;
+};
+
+typedef struct shm_health_struct shm_health_t;
+
+static shm_health_t *tds_health = NULL;
+
 /*
- *  _sql_get_connection: walks the connection cache looking for the named
- *   connection.  Returns NULL if unsuccessful, a pointer to the conn_entry_t
- *   if successful.
+ * tds_trace_struct: timings for the command being traced, see
+ *  _sql_trace_cmd.  Phases are appended to 'phases' as they finish.
+ */
+#define TDS_TRACE_LEVEL         8
+
+struct tds_trace_struct {
+  int on;
+  struct timespec start;
+  struct timespec last;
+
+  char phases[512];
+  size_t len;
+
+  unsigned long rows;
+  unsigned long cols;
+  unsigned long bytes;              /* materialized by _sql_fetch_rows */
+};
+
+static const char *trace_channel = "sql.tds";
+static struct tds_trace_struct tds_trace;
+
+/*
+ *  _sql_get_connection: looks up the named connection in the connection
+ *   index, or walks the connection cache if there is no index.  Returns
+ *   NULL if unsuccessful, a pointer to the conn_entry_t if successful.
  */
 static conn_entry_t *_sql_get_connection(char *name){
   conn_entry_t *entry = NULL;
@@ -126,6 +540,9 @@ static conn_entry_t *_sql_get_connection(char *name){
 
   if (name == NULL) return NULL;
 
+  if (conn_index)
+    return (conn_entry_t *) pr_table_get(conn_index, name, NULL);
+
   /* walk the array looking for our entry */
   for (cnt=0; cnt < conn_cache->nelts; cnt++) {
     entry = ((conn_entry_t **) conn_cache->elts)[cnt];
@@ -139,8 +556,9 @@ static conn_entry_t *_sql_get_connection(char *name){
 
 /*
  * _sql_add_connection: internal helper function to maintain a cache of 
- *  connections.  Since we expect the number of named connections to
- *  be small, simply use an array header to hold them.  We don't allow 
+ *  connections.  The array header keeps them in order for the walks in
+ *  cmd_exit and the timer callbacks; lookups by name go through
+ *  conn_index, since every statement does one.  We don't allow 
  *  duplicate connection names.
  *
  * Returns: NULL if the insertion was unsuccessful, a pointer to the 
@@ -161,6 +579,8 @@ static void *_sql_add_connection(pool *p, char *name, db_conn_t *conn){
   entry->data = conn;
 
   *((conn_entry_t **) push_array(conn_cache)) = entry;
+  if (conn_index)
+    pr_table_add(conn_index, entry->name, entry, sizeof(conn_entry_t *));
 
   return entry;
 }
@@ -187,7 +607,6 @@ static void _sql_check_cmd(cmd_rec *cmd, char *msg){
 static int _sql_timer_callback(CALLBACK_FRAME){
   conn_entry_t *entry = NULL;
   int cnt = 0;
-  cmd_rec *cmd = NULL;
 
   for (cnt=0; cnt < conn_cache->nelts; cnt++) {
     entry = ((conn_entry_t **) conn_cache->elts)[cnt];
@@ -195,9 +614,7 @@ static int _sql_timer_callback(CALLBACK_FRAME){
     if (entry->timer == p2) {
       sql_log(DEBUG_INFO, "%s", " timer expired for connection '%s'",
 		entry->name);
-      cmd = _sql_make_cmd( conn_pool, 2, entry->name, "1" );
-      cmd_close( cmd );
-      SQL_FREE_CMD( cmd );
+      _sql_tds_close(entry, TRUE);
       entry->timer = 0;
     }
   }
@@ -207,204 +624,4668 @@ static int _sql_timer_callback(CALLBACK_FRAME){
 
 
 /*
- * _build_error: constructs a modret_t filled with error information;
+ * _sql_trace_usecs: microseconds from 'from' to 'to'.
  */
-static modret_t *_build_error( cmd_rec *cmd, db_conn_t *conn ){
+static long _sql_trace_usecs(struct timespec *from, struct timespec *to){
+  return (to->tv_sec - from->tv_sec) * 1000000L +
+    (to->tv_nsec - from->tv_nsec) / 1000L;
+}
 
-  char num[20] = {'\0'};
-  snprintf(num, 20, "%u", 1234);
-  if (!conn){
-    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");
-  }
+/*
+ * _sql_trace_add: records a phase of the traced command that took 'us'
+ *  microseconds.
+ */
+static void _sql_trace_add(const char *phase, long us){
+  int n = 0;
 
-  return PR_ERROR_MSG(cmd, num, "An Internal Error Occured");
+  if (tds_trace.len >= sizeof(tds_trace.phases))
+    return;
+
+  n = snprintf(tds_trace.phases + tds_trace.len,
+    sizeof(tds_trace.phases) - tds_trace.len, "%s%s %ldus",
+    tds_trace.len ? ", " : "", phase, us);
+  if (n > 0)
+    tds_trace.len += (size_t) n;
 }
 
 /*
- * _build_data: both cmd_select and cmd_procedure potentially
- *  return data to mod_sql; this function builds a modret to return
- *  that data.
- *  Once we get here, we have rows to return, do it here
+ * _sql_trace_mark: ends a phase of the traced command, timing it from the
+ *  end of the one before.  A single test when tracing is off.
  */
-static modret_t *_build_data( cmd_rec *cmd, db_conn_t *conn ){
+static void _sql_trace_mark(const char *phase){
+  struct timespec now;
+
+  if (!tds_trace.on)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  _sql_trace_add(phase, _sql_trace_usecs(&tds_trace.last, &now));
+  tds_trace.last = now;
+}
 
+/*
+ * _sql_trace_cmd: runs a command handler, and if the sql.tds trace
+ *  channel is at TDS_TRACE_LEVEL or above, writes one line of phase
+ *  timings for it.  Wrapping the handlers means every return path ends
+ *  its trace.
+ */
+static modret_t *_sql_trace_cmd(cmd_rec *cmd, const char *name,
+    modret_t *(*handler)(cmd_rec *)){
+  struct timespec now;
   sql_data_t *sd = NULL;
-  char **data = NULL;
-  unsigned long cnt = 0;
-  unsigned long index = 0;
-  BYTE **row = NULL;
-  tempdata_t *td, *ptr;
-  int x, rcount = 0;
+  modret_t *mr = NULL;
 
-  sql_log(DEBUG_FUNC, "%s", " >>> tds _build_data");
+  if (pr_trace_get_level(trace_channel) < TDS_TRACE_LEVEL)
+    return handler(cmd);
+
+  memset(&tds_trace, 0, sizeof(tds_trace));
+  tds_trace.on = TRUE;
+  clock_gettime(CLOCK_MONOTONIC, &tds_trace.start);
+  tds_trace.last = tds_trace.start;
+
+  mr = handler(cmd);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  tds_trace.on = FALSE;
+
+  /* results served from a cache never went through _sql_fetch_rows */
+  if (mr && !MODRET_ERROR(mr) && mr->data && tds_trace.rows == 0) {
+    sd = (sql_data_t *) mr->data;
+    tds_trace.rows = sd->rnum;
+    tds_trace.cols = sd->fnum;
+  }
+
+  pr_trace_msg(trace_channel, TDS_TRACE_LEVEL,
+    "%s '%s': %s in %ldus [%s]; %lu rows, %lu columns, %lu bytes", name,
+    cmd->argc > 0 ? (char *) cmd->argv[0] : "",
+    mr == NULL ? "declined" : MODRET_ERROR(mr) ? "failed" : "done",
+    _sql_trace_usecs(&tds_trace.start, &now), tds_trace.phases,
+    tds_trace.rows, tds_trace.cols, tds_trace.bytes);
+
+  return mr;
+}
+
+/*
+ * _build_error: constructs a modret_t filled with error information;
+ */
+static modret_t *_build_error( cmd_rec *cmd, db_conn_t *conn ){
+
+  char num[20] = {'\0'};
   if (!conn){
     return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");
   }
-  /* create a sql_data structure to eventually hold results */
-  sd = (sql_data_t *) pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
 
-  sd->fnum = (unsigned long) dbnumcols(conn->dbproc); /* Number of columns in the result */
-  sql_log(DEBUG_INFO, "%d columns in the result ", sd->fnum);
+  if (conn->timed_out) {
+    /* make sure the server stops working on it, too */
+    if (conn->dbproc && !dbdead(conn->dbproc))
+      dbcancel(conn->dbproc);
 
-  /*create datastructure to hold the results */
-  row = (BYTE **) pcalloc(cmd->tmp_pool, sizeof(BYTE *) * sd->fnum);
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "query timed out");
+  }
 
-  /* setup the temp storage to hold all of our data here */
-  td = (tempdata_t *)pcalloc(cmd->tmp_pool, sizeof(tempdata_t));
+  if (conn->msgtext[0]) {
+    snprintf(num, 20, "%ld", (long) conn->msgno);
+    return PR_ERROR_MSG(cmd, pstrdup(cmd->tmp_pool, num),
+      pstrdup(cmd->tmp_pool, conn->msgtext));
+  }
 
-  /* make sure td points to the top of the list */
-  ptr = td;
+  snprintf(num, 20, "%u", 1234);
+  return PR_ERROR_MSG(cmd, pstrdup(cmd->tmp_pool, num), "An Internal Error Occured");
+}
 
-  ptr->data = pcalloc(cmd->tmp_pool,(sizeof(char *) * sd->fnum));
-  ptr->next = NULL;
+/*
+ * _sql_arena_init: prepares an empty result arena in the given pool.
+ */
+static void _sql_arena_init(result_arena_t *arena, pool *p){
+  memset(arena, 0, sizeof(result_arena_t));
+  arena->pool = p;
+}
 
-  /* need to bind the columns for our results */
-  for (x=0;x<sd->fnum;x++){
-    row[x] = (BYTE *)pcalloc(cmd->tmp_pool, 256);
-    dbbind(conn->dbproc, x+1, STRINGBIND, (DBINT) 0, row[x]);
-  }
+/*
+ * _sql_arena_slots: makes sure there are at least 'n' free slots (plus
+ *  the terminating NULL) in the arena's data array and returns a pointer
+ *  to the first free one.  The array doubles when it runs out of room.
+ */
+static char **_sql_arena_slots(result_arena_t *arena, unsigned long n){
+  char **data = NULL;
+  unsigned long nalloc = 0;
 
-  /* return the rows from the query and populate temp list */
-  while(dbnextrow(conn->dbproc) != NO_MORE_ROWS){
-    if(rcount > 0){
-      ptr->next = (tempdata_t *) pcalloc(cmd->tmp_pool, sizeof(tempdata_t));
-      ptr = ptr->next;
-      ptr->data = pcalloc(cmd->tmp_pool,(sizeof(char *) * sd->fnum));
-      ptr->next = NULL;
-      sql_log(DEBUG_INFO, "%s", " Created a new temp record");
+  if (arena->nused + n + 1 > arena->nalloc) {
+    nalloc = arena->nalloc ? arena->nalloc : ARENA_MIN_SLOTS;
+    while (arena->nused + n + 1 > nalloc) {
+      nalloc *= 2;
     }
 
-    /* add onto our temp record */
-    for(x=0;x<sd->fnum;x++){
-      ptr->data[x] = pstrdup(cmd->tmp_pool, (char*)row[x]);
+    data = (char **) palloc(arena->pool, sizeof(char *) * nalloc);
+    if (arena->nused > 0) {
+      memcpy(data, arena->data, sizeof(char *) * arena->nused);
     }
-    rcount++; /* done with this row -- inc to the next */
+
+    arena->data = data;
+    arena->nalloc = nalloc;
   }
 
-  sd->rnum = rcount;
-  cnt = sd->rnum * sd->fnum;
-  data = (char **) pcalloc( cmd->tmp_pool, sizeof(char *) * (cnt + 1) );
+  return arena->data + arena->nused;
+}
 
-  /* reset list ptr */
-  ptr = td;
-  while (ptr != NULL){
-    for(x=0;x<sd->fnum;x++){
-      data[index++] = pstrdup(cmd->tmp_pool, ptr->data[x]);
-      sql_log(DEBUG_INFO, "copied %s to data[%d]",ptr->data[x], (index-1));
-    }
-    ptr = ptr->next;
+/*
+ * _sql_arena_reserve: returns 'len' bytes of string storage from the
+ *  arena.  A new block is only allocated when the current one is full;
+ *  blocks double in size up to ARENA_MAX_BLOCK.
+ */
+static char *_sql_arena_reserve(result_arena_t *arena, size_t len){
+  char *ptr = NULL;
+  size_t blocksz = 0;
+
+  if (len > arena->bufleft) {
+    blocksz = arena->blocksz ? arena->blocksz * 2 : ARENA_MIN_BLOCK;
+    if (blocksz > ARENA_MAX_BLOCK)
+      blocksz = ARENA_MAX_BLOCK;
+    if (blocksz < len)
+      blocksz = len;
+
+    arena->buf = (char *) palloc(arena->pool, blocksz);
+    arena->bufleft = blocksz;
+    arena->blocksz = blocksz;
   }
-  data[index]=NULL;
 
-  sd->data = data;
-  return mod_create_data( cmd, (void *) sd );
+  ptr = arena->buf;
+  arena->buf += len;
+  arena->bufleft -= len;
+
+  return ptr;
 }
 
 /*
- * cmd_open: attempts to open a named connection to the database.
- *
- * Inputs:
- *  cmd->argv[0]: connection name
- *
- * Returns:
- *  either a properly filled error modret_t if a connection could not be
- *  opened, or a simple non-error modret_t.
- *
+ * _sql_fmt_int: formats a signed integer into buf (which must hold at
+ *  least 21 bytes) without going through the db-lib conversion routines.
+ *  Returns the number of characters written, not counting the NUL.
  */
-MODRET cmd_open(cmd_rec *cmd){
-  conn_entry_t *entry = NULL;
-  db_conn_t *conn = NULL;
-  LOGINREC *login;
+static size_t _sql_fmt_int(char *buf, long long val){
+  char tmp[24];
+  char *ptr = tmp + sizeof(tmp);
+  unsigned long long uval = 0;
+  size_t len = 0;
 
-  sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_open");
+  uval = (val < 0) ? (0ULL - (unsigned long long) val) : (unsigned long long) val;
 
-  _sql_check_cmd(cmd, "cmd_open" );
+  do {
+    *--ptr = '0' + (char) (uval % 10);
+    uval /= 10;
+  } while (uval);
 
-  if (cmd->argc < 1) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open with argc < 1");
-    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");
-  }
+  if (val < 0)
+    *--ptr = '-';
 
-  /* get the named connection */
+  len = (tmp + sizeof(tmp)) - ptr;
+  memcpy(buf, ptr, len);
+  buf[len] = '\0';
 
-  if (!(entry = _sql_get_connection( cmd->argv[0]))) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open");
-    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "Unknown Named Connection");
-  }
+  return len;
+}
 
-  conn = (db_conn_t *) entry->data;
+/*
+ * _sql_fmt_datetime: formats a TDS datetime (days since 1900-01-01 plus
+ *  1/300ths of a second since midnight) as "YYYY-MM-DD HH:MM:SS.mmm".
+ *  buf must hold at least 24 bytes.  Returns the length written.
+ */
+static size_t _sql_fmt_datetime(char *buf, long days, unsigned long ticks){
+  long z, era, doe, yoe, doy, mp, year, month, day;
+  unsigned long ms = 0;
+
+  /* civil-from-days, shifted from the 1970 epoch to 1900 */
+  z = days - 25567 + 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year = yoe + era * 400 + (month <= 2);
+
+  ms = (ticks * 10 + 1) / 3;
+
+  return (size_t) snprintf(buf, 24, "%04ld-%02ld-%02ld %02lu:%02lu:%02lu.%03lu",
+    year, month, day, ms / 3600000, (ms / 60000) % 60, (ms / 1000) % 60,
+    ms % 1000);
+}
 
-  /* if we're already open (connections > 0) increment connections 
-   * reset our timer if we have one, and return HANDLED 
-   */
-  if (entry->connections > 0){ 
-    /*FIXME: add check to see if connection still around*/
-    entry->connections++;
-    if (entry->timer) {
-      pr_timer_reset( entry->timer, &sql_tds_module );
-    }
-    sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open");
-    return PR_HANDLED(cmd);
+/*
+ * _sql_init_col: records the type and length of a column (or of a
+ *  procedure return parameter), and gives it a scratch buffer if the
+ *  type needs formatting.  That is enough for the fixed size types;
+ *  _sql_fmt_value grows it for any value that may not fit.
+ */
+static void _sql_init_col(pool *p, result_col_t *col, int type, DBINT collen){
+  col->type = type;
+  col->collen = collen;
+
+  switch (col->type) {
+    case SYBCHAR:
+    case SYBVARCHAR:
+    case SYBTEXT:
+      /* copied directly, no scratch space needed */
+      break;
+
+    default:
+      col->scratchsz = TDS_SCRATCH_MIN;
+      col->scratch = (char *) palloc(p, col->scratchsz);
+      break;
   }
+}
 
-  if(dbinit() == FAIL){
-    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION  ": failed to init database. Shutting down.");
-    sql_log(DEBUG_WARN, "%s", " failed to init tds database! Shutting down.");
-    end_login(1);
+/*
+ * _sql_bind_cols: reads the type and length of every column in the
+ *  current result set.
+ */
+static result_col_t *_sql_bind_cols(pool *p, DBPROCESS *dbproc, int ncols){
+  result_col_t *cols = NULL;
+  int x;
+
+  cols = (result_col_t *) pcalloc(p, sizeof(result_col_t) * (ncols + 1));
+
+  for (x = 0; x < ncols; x++) {
+    _sql_init_col(p, &cols[x], dbcoltype(dbproc, x+1), dbcollen(dbproc, x+1));
   }
 
-  sql_log(DEBUG_FUNC, "%s", "Attempting to call dblogin ");
-  login = dblogin();
-  DBSETLPWD(login,conn->pass);
-  DBSETLAPP(login,"proftpd");
-  DBSETLUSER(login,conn->user);
-  sql_log(DEBUG_FUNC, "Adding user %s and password %s to login", conn->user,conn->pass);
-  sql_log(DEBUG_FUNC, "%s", "calling dbopen");
+  return cols;
+}
 
- #ifdef PR_USE_NLS
-/* We actually need to set the Char encoding before we open the connection
- * according to 
- * http://manuals.sybase.com:80/onlinebooks/group-cnarc/cng1110e/dblib/@Generic__BookTextView/37135;pt=37135#X
- * The Client picks a default char and the server does conversions between the local and server sets.
- * This should override any char set, that was set in your interfaces file
+/*
+ * _sql_fmt_value: points *val at the textual form of a value of the
+ *  column's type, and returns its length.  NULL values come back as empty
+ *  strings, which is what the old STRINGBIND binding produced.
  */
-  if (pr_encode_get_encoding() != NULL){
-    DBSETLCHARSET(login,pr_encode_get_charset());
-    sql_log(DEBUG_FUNC,"Setting Client Character Set to '%s'",pr_encode_get_charset());
+static size_t _sql_fmt_value(pool *p, DBPROCESS *dbproc, result_col_t *col,
+    BYTE *data, DBINT len, const char **val){
+  DBINT res = 0;
+  DBDATETIME dt;
+  size_t need = 0;
+
+  if (data == NULL) {
+    *val = "";
+    return 0;
   }
-#endif /* !PR_USE_NLS */
 
-  conn->dbproc = dbopen(login,conn->server);
+  switch (col->type) {
+    case SYBCHAR:
+    case SYBVARCHAR:
+    case SYBTEXT:
+      *val = (const char *) data;
+      return (size_t) len;
+
+    case SYBINT1:
+      *val = col->scratch;
+      return _sql_fmt_int(col->scratch, *((DBTINYINT *) data));
+
+    case SYBBIT:
+      *val = *((DBTINYINT *) data) ? "1" : "0";
+      return 1;
+
+    case SYBINT2:
+      *val = col->scratch;
+      return _sql_fmt_int(col->scratch, *((DBSMALLINT *) data));
+
+    case SYBINT4:
+      *val = col->scratch;
+      return _sql_fmt_int(col->scratch, *((DBINT *) data));
+
+#ifdef SYBINT8
+    case SYBINT8:
+      *val = col->scratch;
+      return _sql_fmt_int(col->scratch, *((DBBIGINT *) data));
+#endif
+
+    case SYBDATETIME:
+      memcpy(&dt, data, sizeof(DBDATETIME));
+      *val = col->scratch;
+      return _sql_fmt_datetime(col->scratch, dt.dtdays, dt.dttime);
+
+    case SYBDATETIME4:
+      *val = col->scratch;
+      return _sql_fmt_datetime(col->scratch, ((DBDATETIME4 *) data)->days,
+        ((DBDATETIME4 *) data)->minutes * 18000UL);
+
+    default:
+      break;
+  }
 
-  //free the login rec.
-  dbloginfree(login);
-  sql_log(DEBUG_FUNC, "%s", "freeing our loginrec");
-  if(!conn->dbproc){
-    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": failed to Login to DB server! Shutting down.");
-    sql_log(DEBUG_WARN, "%s", " failed to Login to DB server. Shutting down.");
-    end_login(1);
+  /* everything else goes through the generic db-lib conversion, which
+   * with a destination length of -1 neither pads nor truncates, so the
+   * buffer must hold the longest text the value can turn into: two hex
+   * digits a byte for binary data, less for anything else
+   */
+  need = (size_t) len * 2 + TDS_SCRATCH_MIN;
+  if (need > col->scratchsz) {
+    if (need < col->scratchsz * 2)
+      need = col->scratchsz * 2;
+    col->scratchsz = need;
+    col->scratch = (char *) palloc(p, need);
   }
 
-  sql_log(DEBUG_FUNC, "attempting to switch to database: %s", conn->db);
-  if(dbuse(conn->dbproc, conn->db) == FAIL){
-    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": failed to use database Shutting down.");
-    sql_log(DEBUG_WARN, "%s", " failed to use database Shutting down.");
-    end_login(1);
+  res = dbconvert(dbproc, col->type, data, len, SYBCHAR,
+    (BYTE *) col->scratch, -1);
+  if (res < 0) {
+    *val = "";
+    return 0;
   }
 
+  *val = col->scratch;
+  return strlen(col->scratch);
+}
 
-  /* bump connections */
-  entry->connections++;
+/*
+ * _sql_fetch_rows: reads every row of the current result set into a
+ *  sql_data_t allocated from the given pool.  Columns are read with
+ *  dbdata()/dbdatlen() rather than bound, and rows are streamed straight
+ *  into a result arena: one reservation and one copy per row, no
+ *  intermediate lists.
+ *
+ *  Reading stops once max_rows rows or max_bytes bytes of values have
+ *  been kept (0 for no limit); the rest of the result set is discarded
+ *  and conn->truncated is set.
+ */
+static sql_data_t *_sql_fetch_rows(pool *p, db_conn_t *conn,
+    unsigned long max_rows, size_t max_bytes){
+  DBPROCESS *dbproc = conn->dbproc;
+  sql_data_t *sd = NULL;
+  result_arena_t arena;
+  result_col_t *cols = NULL;
+  const char **vals = NULL;
+  size_t *lens = NULL;
+  size_t rowlen = 0;
+  char **slot = NULL;
+  char *ptr = NULL;
+  struct timespec t0, t1;
+  long fetch_us = 0, copy_us = 0;
+  STATUS ret;
+  int x;
 
-  if(pr_sql_conn_policy == SQL_CONN_POLICY_PERSESSION){
-    if (entry->connections == 1){
-      /*if this is our first connection, bump again to make sure the connection
-       * stays open after first use,  see bug #3290) 
-       */
-      entry->connections++;
-    }
-  }else if (entry->ttl > 0) {
+  /* create a sql_data structure to eventually hold results */
+  sd = (sql_data_t *) pcalloc(p, sizeof(sql_data_t));
+
+  sd->fnum = (unsigned long) dbnumcols(dbproc); /* Number of columns in the result */
+  sql_log(DEBUG_INFO, "%d columns in the result ", sd->fnum);
+
+  /* read the column types once for the whole result set */
+  cols = _sql_bind_cols(p, dbproc, sd->fnum);
+  vals = (const char **) pcalloc(p, sizeof(char *) * (sd->fnum + 1));
+  lens = (size_t *) pcalloc(p, sizeof(size_t) * (sd->fnum + 1));
+
+  _sql_arena_init(&arena, p);
+  _sql_arena_slots(&arena, 0);
+
+  conn->fetched = 0;
+  conn->truncated = FALSE;
+
+  /* return the rows from the query, copying each one into the arena */
+  while((ret = dbnextrow(dbproc)) != NO_MORE_ROWS){
+    if (ret == FAIL) {
+      sql_log(DEBUG_WARN, "reading row %lu failed", sd->rnum + 1);
+      return NULL;
+    }
+
+    if (max_rows && sd->rnum >= max_rows) {
+      conn->truncated = TRUE;
+      break;
+    }
+
+    /* when tracing, split the time between db-lib and our own copying */
+    if (tds_trace.on) {
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      if (sd->rnum == 0)
+        _sql_trace_mark("first-row");
+      else
+        fetch_us += _sql_trace_usecs(&t1, &t0);
+    }
+
+    rowlen = 0;
+    for(x=0;x<sd->fnum;x++){
+      lens[x] = _sql_fmt_value(p, dbproc, &cols[x],
+        dbdata(dbproc, x+1), dbdatlen(dbproc, x+1), &vals[x]);
+      rowlen += lens[x] + 1;
+    }
+
+    if (max_bytes && conn->fetched + rowlen > max_bytes) {
+      conn->truncated = TRUE;
+      break;
+    }
+
+    slot = _sql_arena_slots(&arena, sd->fnum);
+    ptr = _sql_arena_reserve(&arena, rowlen);
+
+    for(x=0;x<sd->fnum;x++){
+      memcpy(ptr, vals[x], lens[x]);
+      ptr[lens[x]] = '\0';
+      slot[x] = ptr;
+      ptr += lens[x] + 1;
+    }
+
+    /* NULLs come back as "", so callers that care are told apart */
+    if (conn->nulls) {
+      for (x = 0; x < sd->fnum; x++)
+        *((unsigned char *) push_array(conn->nulls)) =
+          (dbdata(dbproc, x + 1) == NULL);
+    }
+
+    arena.nused += sd->fnum;
+    conn->fetched += rowlen;
+    sd->rnum++; /* done with this row -- inc to the next */
+
+    if (tds_trace.on) {
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      copy_us += _sql_trace_usecs(&t0, &t1);
+      tds_trace.bytes += rowlen;
+    }
+  }
+
+  if (tds_trace.on) {
+    if (sd->rnum == 0) {
+      _sql_trace_mark("fetch");
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &tds_trace.last);
+      _sql_trace_add("fetch", fetch_us + _sql_trace_usecs(&t1, &tds_trace.last));
+      _sql_trace_add("materialize", copy_us);
+    }
+
+    tds_trace.rows += sd->rnum;
+    tds_trace.cols = sd->fnum;
+  }
+
+  arena.data[arena.nused] = NULL;
+
+  /* whatever is left of the result set is read and thrown away */
+  if (conn->truncated) {
+    sql_log(DEBUG_WARN, "result set truncated at %lu rows (%lu bytes), "
+      "discarding the rest", sd->rnum, (unsigned long) conn->fetched);
+    dbcanquery(dbproc);
+  }
+
+  sql_log(DEBUG_INFO, "%lu rows in the result", sd->rnum);
+
+  sd->data = arena.data;
+  return sd;
+}
+
+/*
+ * _build_data: both cmd_select and cmd_procedure potentially
+ *  return data to mod_sql; this function builds a modret to return
+ *  that data.
+ *  Once we get here, we have rows to return, do it here
+ */
+static modret_t *_build_data( cmd_rec *cmd, db_conn_t *conn ){
+  sql_data_t *sd = NULL;
+
+  sql_log(DEBUG_FUNC, "%s", " >>> tds _build_data");
+  if (!conn){
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");
+  }
+
+  sd = _sql_fetch_rows(cmd->tmp_pool, conn, conn->max_rows, conn->max_bytes);
+  if (!sd)
+    return _build_error( cmd, conn );
+
+  return mod_create_data( cmd, (void *) sd );
+}
+
+/*
+ * _sql_hash: FNV-1a hash of a string.
+ */
+static unsigned int _sql_hash(const char *str){
+  unsigned int hash = 2166136261U;
+
+  while (*str) {
+    hash ^= (unsigned char) *str++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/*
+ * _sql_put: copies len bytes to dst, returning the end of the copy.
+ */
+static char *_sql_put(char *dst, const char *src, size_t len){
+  memcpy(dst, src, len);
+  return dst + len;
+}
+
+/*
+ * _sql_select_distinct: whether a cmd_select asks for DISTINCT, the only
+ *  one of its optional arguments that is supported.
+ */
+static int _sql_select_distinct(cmd_rec *cmd){
+  int cnt;
+
+  for (cnt = 5; cnt < cmd->argc; cnt++) {
+    if ((cmd->argv[cnt]) && !strcasecmp("DISTINCT", cmd->argv[cnt]))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * _sql_build_select: builds the query for a cmd_select called with a
+ *  table and column list,
+ *  "SELECT [DISTINCT ][TOP n ]fields FROM table[ WHERE where]".  The
+ *  query is allocated once, at its final length, and filled in one pass.
+ */
+static char *_sql_build_select(cmd_rec *cmd){
+  const char *table = cmd->argv[1], *fields = cmd->argv[2];
+  const char *where = NULL;
+  const char *limit = "";
+  size_t tlen, flen, llen, wlen = 0;
+  char *query = NULL;
+  char *ptr = NULL;
+  int distinct = FALSE;
+
+  if ((cmd->argc > 3) && (cmd->argv[3])) {
+    where = cmd->argv[3];
+    wlen = strlen(where);
+  }
+
+  if ((cmd->argc > 4) && (cmd->argv[4]))
+    limit = cmd->argv[4];
+
+  distinct = _sql_select_distinct(cmd);
+
+  tlen = strlen(table);
+  flen = strlen(fields);
+  llen = strlen(limit);
+
+  query = (char *) palloc(cmd->tmp_pool, 7 + (distinct ? 9 : 0) +
+    (llen ? 5 + llen : 0) + flen + 6 + tlen + (where ? 7 + wlen : 0) + 1);
+
+  ptr = _sql_put(query, "SELECT ", 7);
+  if (distinct)
+    ptr = _sql_put(ptr, "DISTINCT ", 9);
+  if (llen) {
+    ptr = _sql_put(ptr, "TOP ", 4);
+    ptr = _sql_put(ptr, limit, llen);
+    *ptr++ = ' ';
+  }
+  ptr = _sql_put(ptr, fields, flen);
+  ptr = _sql_put(ptr, " FROM ", 6);
+  ptr = _sql_put(ptr, table, tlen);
+  if (where) {
+    ptr = _sql_put(ptr, " WHERE ", 7);
+    ptr = _sql_put(ptr, where, wlen);
+  }
+  *ptr = '\0';
+
+  return query;
+}
+
+/*
+ * _sql_copy_data: copies a sql_data_t, and all of its values, into the
+ *  given pool using a single allocation for the values.
+ */
+static sql_data_t *_sql_copy_data(pool *p, sql_data_t *sd){
+  sql_data_t *copy = NULL;
+  unsigned long cnt = sd->rnum * sd->fnum, x;
+  size_t len = 0, *lens = NULL;
+  char *ptr = NULL;
+
+  copy = (sql_data_t *) pcalloc(p, sizeof(sql_data_t));
+  copy->rnum = sd->rnum;
+  copy->fnum = sd->fnum;
+  copy->data = (char **) palloc(p, sizeof(char *) * (cnt + 1));
+
+  lens = (size_t *) palloc(p, sizeof(size_t) * (cnt + 1));
+  for (x = 0; x < cnt; x++) {
+    lens[x] = strlen(sd->data[x]) + 1;
+    len += lens[x];
+  }
+
+  ptr = (char *) palloc(p, len + 1);
+  for (x = 0; x < cnt; x++) {
+    memcpy(ptr, sd->data[x], lens[x]);
+    copy->data[x] = ptr;
+    ptr += lens[x];
+  }
+  copy->data[cnt] = NULL;
+
+  return copy;
+}
+
+/*
+ * tds_where_struct: state for _sql_where_expr, which evaluates the WHERE
+ *  clause of a cmd_select against one prefetched row.
+ */
+struct tds_where_struct {
+  pool *pool;
+  const char *ptr;
+  char **row;           /* the row's values                            */
+  unsigned char *nulls; /* which of them are NULL                      */
+  char **cols;          /* and the column names                        */
+  unsigned long ncols;
+  int error;            /* syntax we don't handle, ask the server      */
+};
+
+typedef struct tds_where_struct tds_where_t;
+
+/* the third truth value: a comparison with NULL */
+#define TDS_WHERE_UNKNOWN  -1
+
+/*
+ * _sql_where_word: consumes the keyword kw if it comes next.
+ */
+static int _sql_where_word(tds_where_t *w, const char *kw){
+  size_t len = strlen(kw);
+
+  while (isspace((int) *w->ptr)) w->ptr++;
+
+  if (strncasecmp(w->ptr, kw, len) != 0)
+    return FALSE;
+
+  /* "=" and friends end where they end, words need a break after them */
+  if (isalpha((int) *kw) &&
+      (isalnum((int) w->ptr[len]) || w->ptr[len] == '_'))
+    return FALSE;
+
+  w->ptr += len;
+  return TRUE;
+}
+
+/*
+ * _sql_where_trimlen: the length of a value without trailing blanks,
+ *  which SQL Server ignores when comparing strings.
+ */
+static size_t _sql_where_trimlen(const char *str){
+  size_t len = strlen(str);
+
+  while (len > 0 && str[len - 1] == ' ')
+    len--;
+
+  return len;
+}
+
+/*
+ * _sql_where_ascii: whether a value is plain ASCII, for which every
+ *  collation agrees on what differs from what, case aside.
+ */
+static int _sql_where_ascii(const char *str){
+  for (; *str; str++) {
+    if ((unsigned char) *str >= 0x80)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * _sql_where_like: LIKE, with % and _ wildcards, optionally ignoring
+ *  case.
+ */
+static int _sql_where_like(const char *str, const char *pat, int nocase){
+  for (; *pat; pat++, str++) {
+    if (*pat == '%') {
+      while (*pat == '%') pat++;
+      if (*pat == '\0')
+        return TRUE;
+
+      for (; *str; str++) {
+        if (_sql_where_like(str, pat, nocase))
+          return TRUE;
+      }
+      return FALSE;
+    }
+
+    if (*str == '\0')
+      return FALSE;
+
+    if (*pat != '_' && *pat != *str &&
+        (!nocase || tolower((int) *pat) != tolower((int) *str)))
+      return FALSE;
+  }
+
+  return *str == '\0';
+}
+
+static int _sql_where_expr(tds_where_t *w);
+
+/*
+ * _sql_where_factor: NOT factor, ( expr ), or column op value, where op
+ *  is =, <>, != or LIKE and value is a quoted string or a number.  The
+ *  column's collation isn't known here, so a string comparison is only
+ *  decided locally if every collation would decide it the same way;
+ *  one that hinges on case or on non-ASCII characters is left to the
+ *  server.
+ *
+ * Returns: TRUE, FALSE or TDS_WHERE_UNKNOWN.
+ */
+static int _sql_where_factor(tds_where_t *w){
+  const char *start = NULL;
+  const char *value = NULL;
+  char *literal = NULL;
+  char *end = NULL;
+  size_t len = 0;
+  unsigned long col;
+  int op = 0;         /* 0 =, 1 <>, 2 LIKE */
+  int res = FALSE;
+  int quoted = FALSE;
+  double num = 0;
+
+  if (_sql_where_word(w, "NOT")) {
+    res = _sql_where_factor(w);
+    return res == TDS_WHERE_UNKNOWN ? res : !res;
+  }
+
+  if (_sql_where_word(w, "(")) {
+    res = _sql_where_expr(w);
+    if (!_sql_where_word(w, ")"))
+      w->error = TRUE;
+    return res;
+  }
+
+  /* column, optionally [quoted] or qualified by a table name */
+  while (TRUE) {
+    if (*w->ptr == '[') {
+      start = ++w->ptr;
+      while (*w->ptr && *w->ptr != ']') w->ptr++;
+      len = w->ptr - start;
+      if (*w->ptr == ']')
+        w->ptr++;
+
+    } else {
+      start = w->ptr;
+      while (isalnum((int) *w->ptr) || *w->ptr == '_') w->ptr++;
+      len = w->ptr - start;
+    }
+
+    if (*w->ptr != '.')
+      break;
+    w->ptr++;
+  }
+
+  for (col = 0; len > 0 && col < w->ncols; col++) {
+    if (strlen(w->cols[col]) == len &&
+        strncasecmp(w->cols[col], start, len) == 0)
+      break;
+  }
+
+  if (len == 0 || col == w->ncols) {
+    w->error = TRUE;
+    return FALSE;
+  }
+
+  if (_sql_where_word(w, "=")) {
+    op = 0;
+  } else if (_sql_where_word(w, "<>") || _sql_where_word(w, "!=")) {
+    op = 1;
+  } else if (_sql_where_word(w, "LIKE")) {
+    op = 2;
+  } else {
+    w->error = TRUE;
+    return FALSE;
+  }
+
+  while (isspace((int) *w->ptr)) w->ptr++;
+
+  if (*w->ptr == '\'') {
+    /* quoted string, '' is an escaped quote */
+    start = ++w->ptr;
+    literal = end = (char *) palloc(w->pool, strlen(start) + 1);
+
+    while (*w->ptr && !(*w->ptr == '\'' && w->ptr[1] != '\'')) {
+      if (*w->ptr == '\'')
+        w->ptr++;
+      *end++ = *w->ptr++;
+    }
+    *end = '\0';
+
+    if (*w->ptr == '\'')
+      w->ptr++;
+    else
+      w->error = TRUE;
+    quoted = TRUE;
+
+  } else {
+    num = strtod(w->ptr, &end);
+    if (end == w->ptr || op == 2) {
+      w->error = TRUE;
+      return FALSE;
+    }
+    w->ptr = end;
+  }
+
+  if (w->error)
+    return FALSE;
+
+  /* anything compared with NULL is unknown, even '' */
+  if (w->nulls && w->nulls[col])
+    return TDS_WHERE_UNKNOWN;
+
+  value = w->row[col];
+
+  if (op == 2) {
+    /* character classes, and the special treatment of trailing blanks,
+     * are left to the server
+     */
+    len = strlen(value);
+    if (strchr(literal, '[') != NULL ||
+        (len > 0 && value[len - 1] == ' ') ||
+        (*literal && literal[strlen(literal) - 1] == ' ')) {
+      w->error = TRUE;
+
+    } else if (_sql_where_like(value, literal, FALSE)) {
+      res = TRUE;
+
+    } else if (!_sql_where_ascii(value) || !_sql_where_ascii(literal) ||
+               _sql_where_like(value, literal, TRUE)) {
+      w->error = TRUE;
+    }
+
+  } else if (quoted) {
+    len = _sql_where_trimlen(value);
+    if (len == _sql_where_trimlen(literal) &&
+        memcmp(value, literal, len) == 0) {
+      res = TRUE;
+
+    } else if (!_sql_where_ascii(value) || !_sql_where_ascii(literal) ||
+               (len == _sql_where_trimlen(literal) &&
+                strncasecmp(value, literal, len) == 0)) {
+      w->error = TRUE;
+    }
+
+  } else {
+    res = (strtod(value, &end) == num);
+    if (end == value || *end != '\0')
+      w->error = TRUE;
+  }
+
+  return op == 1 ? !res : res;
+}
+
+/*
+ * _sql_where_term: factor [AND factor]...
+ */
+static int _sql_where_term(tds_where_t *w){
+  int res = _sql_where_factor(w), next;
+
+  while (!w->error && _sql_where_word(w, "AND")) {
+    next = _sql_where_factor(w);
+    if (next == FALSE)
+      res = FALSE;
+    else if (next == TDS_WHERE_UNKNOWN && res != FALSE)
+      res = TDS_WHERE_UNKNOWN;
+  }
+
+  return res;
+}
+
+/*
+ * _sql_where_expr: term [OR term]...
+ */
+static int _sql_where_expr(tds_where_t *w){
+  int res = _sql_where_term(w), next;
+
+  while (!w->error && _sql_where_word(w, "OR")) {
+    next = _sql_where_term(w);
+    if (next == TRUE)
+      res = TRUE;
+    else if (next == TDS_WHERE_UNKNOWN && res != TRUE)
+      res = TDS_WHERE_UNKNOWN;
+  }
+
+  return res;
+}
+
+/*
+ * _sql_where_norm: a WHERE clause with whitespace outside of quotes
+ *  collapsed and any parentheses around the whole of it removed, so
+ *  that the same clause always reads the same.
+ */
+static char *_sql_where_norm(pool *p, const char *str, size_t len){
+  char *norm = NULL, *dst = NULL;
+  const char *end = str + len;
+  int quoted = FALSE, depth = 0, wrapped = FALSE;
+  size_t x;
+
+  while (TRUE) {
+    while (str < end && isspace((int) *str)) str++;
+    while (end > str && isspace((int) end[-1])) end--;
+
+    if (end - str < 2 || *str != '(' || end[-1] != ')')
+      break;
+
+    /* "(a) OR (b)" starts and ends with parentheses too */
+    wrapped = TRUE;
+    for (x = 0, depth = 0; str + x < end - 1; x++) {
+      if (str[x] == '\'')
+        quoted = !quoted;
+      else if (!quoted && str[x] == '(')
+        depth++;
+      else if (!quoted && str[x] == ')' && --depth == 0) {
+        wrapped = FALSE;
+        break;
+      }
+    }
+    quoted = FALSE;
+
+    if (!wrapped)
+      break;
+    str++;
+    end--;
+  }
+
+  norm = dst = (char *) palloc(p, (end - str) + 1);
+  for (; str < end; str++) {
+    if (*str == '\'')
+      quoted = !quoted;
+
+    if (!quoted && isspace((int) *str)) {
+      if (!isspace((int) str[1]))
+        *dst++ = ' ';
+      continue;
+    }
+
+    *dst++ = *str;
+  }
+  *dst = '\0';
+
+  return norm;
+}
+
+/*
+ * _sql_where_covers: whether every row matching a WHERE clause must
+ *  also match pred, as far as can be told from the text alone: where is
+ *  pred itself, or pred ANDed with something else.
+ */
+static int _sql_where_covers(pool *p, const char *pred, const char *where){
+  const char *ptr = NULL, *start = where;
+  int quoted = FALSE, depth = 0;
+
+  if (strcmp(_sql_where_norm(p, where, strlen(where)), pred) == 0)
+    return TRUE;
+
+  for (ptr = where; ; ptr++) {
+    if (*ptr == '\'') {
+      quoted = !quoted;
+
+    } else if (*ptr == '\0' && (quoted || depth != 0)) {
+      return FALSE;
+
+    } else if (quoted) {
+      continue;
+
+    } else if (*ptr == '(') {
+      depth++;
+
+    } else if (*ptr == ')') {
+      depth--;
+
+    } else if (depth == 0 &&
+               (*ptr == '\0' || strncasecmp(ptr, "AND", 3) == 0 ||
+                strncasecmp(ptr, "OR", 2) == 0) &&
+               (ptr == where || *ptr == '\0' ||
+                (!isalnum((int) ptr[-1]) && ptr[-1] != '_'))) {
+      /* an OR at the top level means anything could match */
+      if (*ptr != '\0' && strncasecmp(ptr, "OR", 2) == 0) {
+        if (!isalnum((int) ptr[2]) && ptr[2] != '_')
+          return FALSE;
+        continue;
+      }
+
+      if (*ptr != '\0' && (isalnum((int) ptr[3]) || ptr[3] == '_'))
+        continue;
+
+      if (strcmp(_sql_where_norm(p, start, ptr - start), pred) == 0)
+        return TRUE;
+
+      if (*ptr == '\0')
+        return FALSE;
+      ptr += 2;
+      start = ptr + 1;
+    }
+  }
+}
+
+/*
+ * _sql_prefetch_clear: forgets the rows prefetched for a named connection.
+ */
+static void _sql_prefetch_clear(conn_entry_t *entry){
+  if (entry->pf_pool == NULL)
+    return;
+
+  destroy_pool(entry->pf_pool);
+  entry->pf_pool = NULL;
+  entry->pf_rows = NULL;
+  entry->pf_cols = NULL;
+  entry->pf_nulls = NULL;
+  entry->pf_pred = NULL;
+}
+
+/*
+ * _sql_prefetch_query: if cmd is the user lookup of a connection with
+ *  SQLTDSLoginPrefetch set, builds the query for the group rows that are
+ *  to come back in the same batch.  The user name is the first quoted
+ *  value in the lookup's WHERE clause, still escaped.  The group query's
+ *  own WHERE clause is left in *pred.
+ *
+ * Returns: the group query, or NULL.
+ */
+static char *_sql_prefetch_query(cmd_rec *cmd, conn_entry_t *entry,
+    char **pred){
+  const char *start = NULL;
+  const char *ptr = NULL;
+  char *user = NULL;
+  char *query = NULL;
+  char *tmpl = NULL;
+  char *pos = NULL;
+
+  if (entry->pf_users == NULL || cmd->argc < 4 || cmd->argv[3] == NULL ||
+      strcasecmp(cmd->argv[1], entry->pf_users) != 0)
+    return NULL;
+
+  if ((ptr = strchr(cmd->argv[3], '\'')) == NULL)
+    return NULL;
+
+  start = ++ptr;
+  while (*ptr && !(*ptr == '\'' && ptr[1] != '\'')) {
+    if (*ptr == '\'')
+      ptr++;
+    ptr++;
+  }
+  if (*ptr != '\'')
+    return NULL;
+  user = pstrndup(cmd->tmp_pool, start, ptr - start);
+
+  /* fill in %u */
+  *pred = "";
+  tmpl = entry->pf_where;
+  while ((pos = strstr(tmpl, "%u")) != NULL) {
+    *pred = pstrcat(cmd->tmp_pool, *pred,
+      pstrndup(cmd->tmp_pool, tmpl, pos - tmpl), user, NULL);
+    tmpl = pos + 2;
+  }
+  *pred = pstrcat(cmd->tmp_pool, *pred, tmpl, NULL);
+
+  query = pstrcat(cmd->tmp_pool, "SELECT * FROM ", entry->pf_groups,
+    " WHERE ", *pred, NULL);
+  return query;
+}
+
+/*
+ * _sql_prefetch_read: after the user lookup's rows have been read, keeps
+ *  the group rows that came back in the same batch, matching pred, and
+ *  leaves the connection clean.
+ */
+static void _sql_prefetch_read(conn_entry_t *entry, db_conn_t *conn,
+    const char *pred){
+  sql_data_t *sd = NULL;
+  RETCODE ret;
+  int x;
+
+  _sql_prefetch_clear(entry);
+
+  if ((ret = dbresults(conn->dbproc)) == SUCCEED &&
+      dbnumcols(conn->dbproc) > 0) {
+    entry->pf_pool = make_sub_pool(conn_pool);
+
+    entry->pf_cols = (char **) pcalloc(entry->pf_pool,
+      sizeof(char *) * dbnumcols(conn->dbproc));
+    for (x = 0; x < dbnumcols(conn->dbproc); x++)
+      entry->pf_cols[x] = pstrdup(entry->pf_pool,
+        dbcolname(conn->dbproc, x + 1));
+
+    /* a partial prefetch can't stand in for the server */
+    conn->nulls = make_array(entry->pf_pool, 64, sizeof(unsigned char));
+    sd = _sql_fetch_rows(entry->pf_pool, conn, conn->max_rows,
+      conn->max_bytes);
+    entry->pf_nulls = (unsigned char *) conn->nulls->elts;
+    conn->nulls = NULL;
+
+    if (sd == NULL || conn->truncated) {
+      _sql_prefetch_clear(entry);
+
+    } else {
+      entry->pf_rows = sd;
+      entry->pf_pred = _sql_where_norm(entry->pf_pool, pred, strlen(pred));
+      entry->pf_expires = time(NULL) + TDS_PREFETCH_TTL;
+      sql_log(DEBUG_INFO, "connection '%s' - prefetched %lu rows of %s",
+        entry->name, sd->rnum, entry->pf_groups);
+    }
+
+  } else if (ret == FAIL) {
+    sql_log(DEBUG_WARN, "connection '%s' - group prefetch failed",
+      entry->name);
+  }
+
+  while ((ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS && ret != FAIL)
+    dbcanquery(conn->dbproc);
+}
+
+/*
+ * _sql_prefetch_get: answers a cmd_select on the group table of a
+ *  connection with SQLTDSLoginPrefetch set from the prefetched rows, if
+ *  its column list and WHERE clause are simple enough to evaluate here.
+ *  The prefetch only holds the rows matching its own WHERE clause, so
+ *  only a lookup with that same clause, possibly narrowed with AND, is
+ *  answered from it.
+ *
+ * Returns: the result in the cmd's tmp_pool, or NULL to ask the server.
+ */
+static sql_data_t *_sql_prefetch_get(cmd_rec *cmd, conn_entry_t *entry){
+  sql_data_t *sd = NULL;
+  sql_data_t *pf = entry->pf_rows;
+  tds_where_t w;
+  array_header *fields = NULL;
+  array_header *data = NULL;
+  char *list = NULL, *field = NULL;
+  char **row = NULL;
+  unsigned long limit = 0, r, x, col;
+  int cnt = 0;
+
+  if (pf == NULL || cmd->argc < 4 || cmd->argv[3] == NULL ||
+      strcasecmp(cmd->argv[1], entry->pf_groups) != 0 ||
+      !_sql_where_covers(cmd->tmp_pool, entry->pf_pred, cmd->argv[3]))
+    return NULL;
+
+  if (entry->pf_expires < time(NULL)) {
+    _sql_prefetch_clear(entry);
+    return NULL;
+  }
+
+  for (cnt = 5; cnt < cmd->argc; cnt++) {
+    if (cmd->argv[cnt])
+      return NULL;
+  }
+
+  if ((cmd->argc > 4) && (cmd->argv[4]))
+    limit = strtoul(cmd->argv[4], NULL, 10);
+
+  /* map the column list onto the prefetched columns */
+  fields = make_array(cmd->tmp_pool, pf->fnum, sizeof(unsigned long));
+  list = pstrdup(cmd->tmp_pool, cmd->argv[2]);
+  while ((field = strsep(&list, ",")) != NULL) {
+    while (isspace((int) *field)) field++;
+    x = strlen(field);
+    while (x > 0 && isspace((int) field[x - 1])) field[--x] = '\0';
+
+    if (strcmp(field, "*") == 0) {
+      for (col = 0; col < pf->fnum; col++)
+        *((unsigned long *) push_array(fields)) = col;
+      continue;
+    }
+
+    for (col = 0; col < pf->fnum; col++) {
+      if (strcasecmp(entry->pf_cols[col], field) == 0)
+        break;
+    }
+    if (col == pf->fnum)
+      return NULL;
+
+    *((unsigned long *) push_array(fields)) = col;
+  }
+
+  memset(&w, 0, sizeof(w));
+  w.pool = cmd->tmp_pool;
+  w.cols = entry->pf_cols;
+  w.ncols = pf->fnum;
+
+  data = make_array(cmd->tmp_pool, 8, sizeof(char *));
+  sd = (sql_data_t *) pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+  sd->fnum = fields->nelts;
+
+  for (r = 0; r < pf->rnum && (limit == 0 || sd->rnum < limit); r++) {
+    row = pf->data + r * pf->fnum;
+
+    w.ptr = cmd->argv[3];
+    w.row = row;
+    w.nulls = entry->pf_nulls + r * pf->fnum;
+
+    /* only rows for which the clause is TRUE, not FALSE or unknown */
+    if (_sql_where_expr(&w) != TRUE) {
+      if (w.error)
+        return NULL;
+      continue;
+    }
+
+    while (isspace((int) *w.ptr)) w.ptr++;
+    if (w.error || *w.ptr != '\0')
+      return NULL;
+
+    for (x = 0; x < fields->nelts; x++) {
+      col = ((unsigned long *) fields->elts)[x];
+      *((char **) push_array(data)) = pstrdup(cmd->tmp_pool, row[col]);
+    }
+    sd->rnum++;
+  }
+
+  *((char **) push_array(data)) = NULL;
+  sd->data = (char **) data->elts;
+
+  sql_log(DEBUG_INFO, "%lu rows from the login prefetch", sd->rnum);
+  return sd;
+}
+
+/*
+ * _sql_cache_flush: forgets every memoized result for a named connection.
+ *  Called whenever a statement that might change data runs on it.
+ */
+static void _sql_cache_flush(conn_entry_t *entry){
+  result_cache_t *rc = NULL, *next = NULL;
+
+  if (entry->ncached > 0)
+    sql_log(DEBUG_INFO, "connection '%s' - flushing %u cached results",
+      entry->name, entry->ncached);
+
+  for (rc = entry->cache; rc; rc = next) {
+    next = rc->next;
+    destroy_pool(rc->pool);
+  }
+
+  entry->cache = NULL;
+  entry->ncached = 0;
+
+  _sql_prefetch_clear(entry);
+}
+
+/*
+ * _sql_cache_get: looks for an unexpired memoized result of query on a
+ *  named connection.
+ *
+ * Returns: a copy of the result in the cmd's tmp_pool, or NULL.
+ */
+static sql_data_t *_sql_cache_get(cmd_rec *cmd, conn_entry_t *entry,
+    const char *query){
+  result_cache_t *rc = NULL, **prev = NULL;
+  unsigned int hash = 0;
+  time_t now;
+
+  if (tds_cache_ttl <= 0 || entry->cache == NULL)
+    return NULL;
+
+  hash = _sql_hash(query);
+  now = time(NULL);
+
+  for (prev = &entry->cache; (rc = *prev) != NULL; prev = &rc->next) {
+    if (rc->hash != hash || strcmp(rc->query, query))
+      continue;
+
+    if (rc->expires <= now) {
+      *prev = rc->next;
+      destroy_pool(rc->pool);
+      entry->ncached--;
+      return NULL;
+    }
+
+    /* move to the front, so the list stays in LRU order */
+    *prev = rc->next;
+    rc->next = entry->cache;
+    entry->cache = rc;
+
+    sql_log(DEBUG_INFO, "%s", "using cached result");
+    return _sql_copy_data(cmd->tmp_pool, rc->sd);
+  }
+
+  return NULL;
+}
+
+/*
+ * _sql_cache_put: memoizes the result of query on a named connection,
+ *  dropping the least recently used result if the cache is full.
+ */
+static void _sql_cache_put(conn_entry_t *entry, const char *query,
+    sql_data_t *sd){
+  result_cache_t *rc = NULL, **prev = NULL;
+  pool *p = NULL;
+
+  if (tds_cache_ttl <= 0)
+    return;
+
+  if (entry->ncached >= tds_cache_max) {
+    for (prev = &entry->cache; (*prev)->next; prev = &(*prev)->next);
+    destroy_pool((*prev)->pool);
+    *prev = NULL;
+    entry->ncached--;
+  }
+
+  p = make_sub_pool(conn_pool);
+  rc = (result_cache_t *) pcalloc(p, sizeof(result_cache_t));
+  rc->pool = p;
+  rc->hash = _sql_hash(query);
+  rc->query = pstrdup(p, query);
+  rc->expires = time(NULL) + tds_cache_ttl;
+  rc->sd = _sql_copy_data(p, sd);
+
+  rc->next = entry->cache;
+  entry->cache = rc;
+  entry->ncached++;
+}
+
+/*
+ * _sql_shm_slot: returns slot number x of the shared cache.
+ */
+static shm_slot_t *_sql_shm_slot(unsigned int x){
+  return (shm_slot_t *) (tds_shm_cache->slots + (size_t) x * tds_shm_cache->slotsz);
+}
+
+/*
+ * _sql_shm_key: builds the shared cache key for a query.  Sessions of
+ *  different vhosts may use the same connection name for different
+ *  databases, so the key names the server and database too.
+ */
+static char *_sql_shm_key(pool *p, db_conn_t *conn, const char *query){
+  return pstrcat(p, conn->servers, "\037", conn->db, "\037", query, NULL);
+}
+
+/*
+ * _sql_shm_cacheable: only user and group lookups are shared between
+ *  sessions.  A user lookup is only shared if its columns are listed, so
+ *  the password column can be told apart.
+ */
+static int _sql_shm_cacheable(cmd_rec *cmd){
+  if (tds_shm_cache == NULL || cmd->argc < 3)
+    return FALSE;
+
+  if (tds_user_table && !strcasecmp(cmd->argv[1], tds_user_table))
+    return strchr(cmd->argv[2], '*') == NULL;
+
+  return (tds_group_table && !strcasecmp(cmd->argv[1], tds_group_table));
+}
+
+/*
+ * _sql_shm_passcol: finds mod_sql's SQLPasswordField in the column list
+ *  of a user lookup.  Password hashes never go into the shared cache,
+ *  which every session can write: the column is stored empty, and so a
+ *  lookup that includes it is only answered from the cache once the
+ *  session has logged in and no longer needs the password.
+ *
+ * Returns: the column's index, or -1 if it isn't there.
+ */
+static int _sql_shm_passcol(cmd_rec *cmd){
+  const char *ptr = NULL, *start = NULL;
+  size_t plen;
+  int col = 0;
+
+  if (tds_pass_field == NULL || tds_user_table == NULL ||
+      strcasecmp(cmd->argv[1], tds_user_table) != 0)
+    return -1;
+
+  /* any column that mentions the field, qualified or not */
+  plen = strlen(tds_pass_field);
+  for (ptr = start = cmd->argv[2]; *ptr; ptr++) {
+    if (*ptr == ',') {
+      col++;
+
+    } else if (strncasecmp(ptr, tds_pass_field, plen) == 0 &&
+        (ptr == start || !(isalnum((int) ptr[-1]) || ptr[-1] == '_')) &&
+        !(isalnum((int) ptr[plen]) || ptr[plen] == '_')) {
+      return col;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * _sql_shm_get: looks up a key in the shared cache.  Reads are lock-free:
+ *  the slot is copied out and the copy is only used if the slot's
+ *  sequence number didn't change meanwhile.  A hit that is close to
+ *  expiry is handed to exactly one session as a miss, so that session
+ *  refreshes it while everybody else keeps using the cached copy.
+ *
+ * Returns: the cached result in the given pool, or NULL.
+ */
+static sql_data_t *_sql_shm_get(pool *p, const char *key){
+  shm_slot_t *slot = NULL;
+  sql_data_t *sd = NULL;
+  unsigned int hash, keylen, set, seq, x, way;
+  unsigned long cnt = 0, rnum = 0, fnum = 0;
+  unsigned int datalen = 0;
+  time_t now, expires;
+  int ttl = 0;
+  char *data = NULL, *ptr = NULL, *end = NULL;
+
+  if (tds_shm_cache == NULL)
+    return NULL;
+
+  hash = _sql_hash(key);
+  keylen = strlen(key) + 1;
+  set = hash % tds_shm_cache->nsets;
+  now = time(NULL);
+
+  for (way = 0; way < TDS_SHM_WAYS && data == NULL; way++) {
+    slot = _sql_shm_slot(set * TDS_SHM_WAYS + way);
+
+    seq = slot->seq;
+    __sync_synchronize();
+
+    if ((seq & 1) || slot->hash != hash || slot->keylen != keylen ||
+        slot->expires <= now || memcmp(slot->buf, key, keylen))
+      continue;
+
+    datalen = slot->datalen;
+    rnum = slot->rnum;
+    fnum = slot->fnum;
+    expires = slot->expires;
+    if (keylen + datalen > tds_shm_cache->slotsz - sizeof(shm_slot_t))
+      continue;
+
+    data = (char *) palloc(p, datalen + 1);
+    memcpy(data, slot->buf + keylen, datalen);
+
+    __sync_synchronize();
+    if (slot->seq != seq) {
+      /* overwritten while we were reading it */
+      data = NULL;
+      continue;
+    }
+
+    slot->ref = 1;
+
+    /* refresh ahead: one session gets to re-run the query */
+    ttl = (rnum == 0 && tds_shm_cache->neg_ttl > 0) ?
+      tds_shm_cache->neg_ttl : tds_shm_cache->ttl;
+    if ((expires - now) * 100 < (time_t) ttl * (100 - TDS_SHM_REFRESH_PCT) &&
+        __sync_bool_compare_and_swap(&slot->refreshing, 0, 1)) {
+      __sync_fetch_and_add(&tds_shm_cache->refreshes, 1);
+      sql_log(DEBUG_INFO, "%s", "shared cache entry close to expiry, refreshing");
+      return NULL;
+    }
+  }
+
+  if (data == NULL) {
+    __sync_fetch_and_add(&tds_shm_cache->misses, 1);
+    return NULL;
+  }
+
+  /* the values are NUL terminated in place; just point at them */
+  cnt = rnum * fnum;
+  sd = (sql_data_t *) pcalloc(p, sizeof(sql_data_t));
+  sd->rnum = rnum;
+  sd->fnum = fnum;
+  sd->data = (char **) palloc(p, sizeof(char *) * (cnt + 1));
+
+  ptr = data;
+  end = data + datalen;
+  for (x = 0; x < cnt; x++) {
+    if (ptr >= end)
+      return NULL;
+    sd->data[x] = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  sd->data[cnt] = NULL;
+
+  __sync_fetch_and_add(&tds_shm_cache->hits, 1);
+  if (rnum == 0)
+    __sync_fetch_and_add(&tds_shm_cache->neg_hits, 1);
+  sql_log(DEBUG_INFO, "%s", "using shared cache result");
+  return sd;
+}
+
+/*
+ * _sql_shm_put: stores a result in the shared cache.  The slot is the
+ *  key's old slot if it has one, otherwise a free or expired slot in its
+ *  set, otherwise the CLOCK victim.  Results that don't fit in a slot,
+ *  or whose slot another session is busy writing, are simply not cached.
+ */
+static void _sql_shm_put(const char *key, sql_data_t *sd, int blank){
+  shm_slot_t *slot = NULL, *victim = NULL;
+  unsigned int hash, keylen, set, seq, way, pass;
+  unsigned long cnt = sd->rnum * sd->fnum, x;
+  size_t datalen = 0, len = 0;
+  time_t now;
+  char *ptr = NULL;
+
+  if (tds_shm_cache == NULL)
+    return;
+
+  keylen = strlen(key) + 1;
+  for (x = 0; x < cnt; x++)
+    datalen += (blank >= 0 && x % sd->fnum == (unsigned long) blank) ? 1 :
+      strlen(sd->data[x]) + 1;
+
+  if (keylen + datalen > tds_shm_cache->slotsz - sizeof(shm_slot_t))
+    return;
+
+  hash = _sql_hash(key);
+  set = hash % tds_shm_cache->nsets;
+  now = time(NULL);
+
+  for (way = 0; way < TDS_SHM_WAYS && victim == NULL; way++) {
+    slot = _sql_shm_slot(set * TDS_SHM_WAYS + way);
+    if (slot->hash == hash && slot->keylen == keylen &&
+        !memcmp(slot->buf, key, keylen))
+      victim = slot;
+  }
+
+  for (way = 0; way < TDS_SHM_WAYS && victim == NULL; way++) {
+    slot = _sql_shm_slot(set * TDS_SHM_WAYS + way);
+    if (slot->keylen == 0 || slot->expires <= now)
+      victim = slot;
+  }
+
+  for (pass = 0; pass < 2 && victim == NULL; pass++) {
+    for (way = 0; way < TDS_SHM_WAYS && victim == NULL; way++) {
+      slot = _sql_shm_slot(set * TDS_SHM_WAYS + way);
+      if (slot->ref) {
+        slot->ref = 0;
+      } else {
+        victim = slot;
+        __sync_fetch_and_add(&tds_shm_cache->evictions, 1);
+      }
+    }
+  }
+
+  if (victim == NULL)
+    return;
+
+  seq = victim->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+    return;
+
+  victim->hash = hash;
+  victim->keylen = keylen;
+  victim->datalen = (unsigned int) datalen;
+  victim->rnum = sd->rnum;
+  victim->fnum = sd->fnum;
+  /* lookups of names that don't exist are kept for less time */
+  victim->expires = now + ((sd->rnum == 0 && tds_shm_cache->neg_ttl > 0) ?
+    tds_shm_cache->neg_ttl : tds_shm_cache->ttl);
+  victim->ref = 1;
+  victim->refreshing = 0;
+
+  memcpy(victim->buf, key, keylen);
+  ptr = victim->buf + keylen;
+  for (x = 0; x < cnt; x++) {
+    if (blank >= 0 && x % sd->fnum == (unsigned long) blank) {
+      *ptr++ = '\0';
+      continue;
+    }
+
+    len = strlen(sd->data[x]) + 1;
+    memcpy(ptr, sd->data[x], len);
+    ptr += len;
+  }
+
+  __sync_synchronize();
+  victim->seq = seq + 2;
+
+  __sync_fetch_and_add(&tds_shm_cache->stores, 1);
+  if (sd->rnum == 0)
+    __sync_fetch_and_add(&tds_shm_cache->neg_stores, 1);
+}
+
+/*
+ * _sql_shm_create: maps the shared cache.  Called in the master after the
+ *  configuration is parsed, so every session inherits the mapping.
+ */
+static void _sql_shm_create(void){
+  config_rec *c = NULL;
+  unsigned int nslots = 0;
+  size_t slotsz = 0;
+  void *map = NULL;
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSSharedCache", FALSE);
+  if (c == NULL)
+    return;
+
+  nslots = *((unsigned int *) c->argv[0]);
+  slotsz = sizeof(shm_slot_t) + *((size_t *) c->argv[2]);
+  slotsz = (slotsz + sizeof(long) - 1) & ~(sizeof(long) - 1);
+
+  /* whole sets only */
+  nslots = (nslots + TDS_SHM_WAYS - 1) / TDS_SHM_WAYS * TDS_SHM_WAYS;
+
+  tds_shm_cache_len = sizeof(shm_cache_t) + (size_t) nslots * slotsz;
+  map = mmap(NULL, tds_shm_cache_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANON, -1, 0);
+  if (map == MAP_FAILED) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION
+      ": unable to map %lu bytes for the shared cache: %s",
+      (unsigned long) tds_shm_cache_len, strerror(errno));
+    tds_shm_cache_len = 0;
+    return;
+  }
+
+  tds_shm_cache = (shm_cache_t *) map;
+  tds_shm_cache->nsets = nslots / TDS_SHM_WAYS;
+  tds_shm_cache->slotsz = slotsz;
+  tds_shm_cache->ttl = *((int *) c->argv[1]);
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSNegativeCache", FALSE);
+  if (c)
+    tds_shm_cache->neg_ttl = *((int *) c->argv[0]);
+}
+
+/*
+ * _sql_shm_destroy: unmaps the shared cache in the master, logging its
+ *  counters first.
+ */
+static void _sql_shm_destroy(void){
+  if (tds_shm_cache == NULL)
+    return;
+
+  pr_log_pri(PR_LOG_INFO, MOD_SQL_TDS_VERSION
+    ": shared cache: %lu hits, %lu misses, %lu stores, %lu evictions, "
+    "%lu refreshes; %lu empty hits, %lu empty stores", tds_shm_cache->hits,
+    tds_shm_cache->misses, tds_shm_cache->stores, tds_shm_cache->evictions,
+    tds_shm_cache->refreshes, tds_shm_cache->neg_hits,
+    tds_shm_cache->neg_stores);
+
+  munmap((void *) tds_shm_cache, tds_shm_cache_len);
+  tds_shm_cache = NULL;
+  tds_shm_cache_len = 0;
+}
+
+/*
+ * _sql_filter_plain: whether a name is nothing but printable ASCII.
+ *  Only such names can be filtered: how any other name compares depends
+ *  on the column's collation (accents, width, "ss" against a sharp s),
+ *  which we can't know.
+ */
+static int _sql_filter_plain(const char *name, size_t len){
+  size_t x;
+
+  for (x = 0; x < len; x++) {
+    if ((unsigned char) name[x] < 0x20 || (unsigned char) name[x] > 0x7e)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * _sql_filter_hash: the two hashes a plain name's filter bits are
+ *  derived from.  SQL Server compares names ignoring trailing blanks,
+ *  and ASCII case under the usual case-insensitive collations, so they
+ *  are hashed that way too; under a case-sensitive collation that only
+ *  costs false positives.
+ */
+static void _sql_filter_hash(const char *name, size_t len, uint32_t *h1,
+    uint32_t *h2){
+  uint32_t a = 2166136261U, b = 5381;
+  unsigned char ch;
+  size_t x;
+
+  while (len > 0 && name[len - 1] == ' ')
+    len--;
+
+  for (x = 0; x < len; x++) {
+    ch = (unsigned char) name[x];
+    if (ch >= 'A' && ch <= 'Z')
+      ch += 'a' - 'A';
+    a = (a ^ ch) * 16777619U;
+    b = (b * 33) ^ ch;
+  }
+
+  *h1 = a;
+  *h2 = b | 1;
+}
+
+/*
+ * _sql_filter_add: sets a name's bits in one half of the filter.
+ */
+static void _sql_filter_add(unsigned char *bits, const char *name,
+    size_t len){
+  uint64_t nbits = (uint64_t) tds_filter->nbytes * 8, bit;
+  uint32_t h1, h2;
+  unsigned int x;
+
+  _sql_filter_hash(name, len, &h1, &h2);
+
+  for (x = 0; x < tds_filter->k; x++) {
+    bit = ((uint64_t) h1 + (uint64_t) x * h2) % nbits;
+    bits[bit >> 3] |= (unsigned char) (1 << (bit & 7));
+  }
+}
+
+/*
+ * _sql_filter_test: checks a name against the live half of the filter.
+ *
+ * Returns: FALSE if the name is certainly not there, TRUE if it may be.
+ */
+static int _sql_filter_test(const char *name, size_t len){
+  const unsigned char *bits = NULL;
+  uint64_t nbits = (uint64_t) tds_filter->nbytes * 8, bit;
+  uint32_t h1, h2;
+  unsigned int x;
+
+  bits = tds_filter->bits + (tds_filter->live ? tds_filter->nbytes : 0);
+  _sql_filter_hash(name, len, &h1, &h2);
+
+  for (x = 0; x < tds_filter->k; x++) {
+    bit = ((uint64_t) h1 + (uint64_t) x * h2) % nbits;
+    if (!(bits[bit >> 3] & (1 << (bit & 7))))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * _sql_filter_reject: for a user lookup by name on the connection the
+ *  filter was built from, checks the name against the filter.  Only a
+ *  WHERE clause that is nothing but mod_sql's SQLUsernameField compared
+ *  with a quoted plain name is checked; anything else could match rows
+ *  the name alone doesn't.  A filter that has gone unrefreshed for two
+ *  refresh periods is not trusted.
+ *
+ * Returns: TRUE if the user certainly doesn't exist.
+ */
+static int _sql_filter_reject(cmd_rec *cmd, conn_entry_t *entry){
+  const char *ptr = NULL;
+  char *name = NULL;
+  size_t flen, len = 0;
+
+  if (tds_filter == NULL || tds_filter->live < 0 || tds_user_field == NULL ||
+      cmd->argc < 4 || cmd->argv[3] == NULL ||
+      strcmp(entry->name, tds_filter_conn) != 0 ||
+      strcasecmp(cmd->argv[1], tds_user_table) != 0 ||
+      tds_filter->built + 2 * tds_filter->refresh < time(NULL))
+    return FALSE;
+
+  /* "field = '" */
+  ptr = _sql_where_norm(cmd->tmp_pool, cmd->argv[3], strlen(cmd->argv[3]));
+  flen = strlen(tds_user_field);
+  if (*ptr == '[')
+    ptr++;
+  if (strncasecmp(ptr, tds_user_field, flen) != 0)
+    return FALSE;
+  ptr += flen;
+  if (*ptr == ']')
+    ptr++;
+  if (*ptr == ' ')
+    ptr++;
+  if (*ptr++ != '=')
+    return FALSE;
+  if (*ptr == ' ')
+    ptr++;
+  if (*ptr != '\'')
+    return FALSE;
+
+  /* the value, with '' turned back into ', and then nothing more */
+  name = (char *) palloc(cmd->tmp_pool, strlen(ptr));
+  for (ptr++; *ptr && !(*ptr == '\'' && ptr[1] != '\''); ptr++) {
+    if (*ptr == '\'')
+      ptr++;
+    name[len++] = *ptr;
+  }
+  if (*ptr != '\'' || ptr[1] != '\0' || !_sql_filter_plain(name, len))
+    return FALSE;
+
+  __sync_fetch_and_add(&tds_filter->checks, 1);
+  if (_sql_filter_test(name, len))
+    return FALSE;
+
+  __sync_fetch_and_add(&tds_filter->rejects, 1);
+  sql_log(DEBUG_INFO, "user filter: no such user '%.*s'", (int) len, name);
+  return TRUE;
+}
+
+/*
+ * _sql_filter_login: finds the login the user filter is rebuilt with,
+ *  that of the named connection: the main server's SQLConnectInfo for
+ *  mod_sql's default connection, or its SQLNamedConnectInfo otherwise.
+ *
+ * Returns: 0, or -1 if the connection isn't configured.
+ */
+static int _sql_filter_login(const char *name){
+  config_rec *c = NULL;
+  char *at = NULL;
+  int info = 0;
+
+  if (strcmp(name, "default") == 0) {
+    c = find_config(main_server->conf, CONF_PARAM, "SQLConnectInfo", FALSE);
+    if (c == NULL || c->argc < 3)
+      return -1;
+
+  } else {
+    /* name, backend, info, user, pass */
+    c = find_config(main_server->conf, CONF_PARAM, "SQLNamedConnectInfo",
+      FALSE);
+    while (c && (c->argc < 5 || strcmp(c->argv[0], name) != 0))
+      c = find_config_next(c, c->next, CONF_PARAM, "SQLNamedConnectInfo",
+        FALSE);
+    if (c == NULL)
+      return -1;
+    info = 2;
+  }
+
+  tds_filter_login.db = pstrdup(tds_filter_pool, c->argv[info]);
+  if ((at = strchr(tds_filter_login.db, '@')) != NULL) {
+    *at = '\0';
+    tds_filter_login.servers = at + 1;
+
+  } else if ((tds_filter_login.servers = getenv("DSQUERY")) == NULL) {
+    return -1;
+  }
+
+  tds_filter_login.servers = pstrdup(tds_filter_pool,
+    tds_filter_login.servers);
+  tds_filter_login.user = pstrdup(tds_filter_pool, c->argv[info + 1]);
+  tds_filter_login.pass = pstrdup(tds_filter_pool, c->argv[info + 2]);
+  return 0;
+}
+
+/*
+ * _sql_filter_create: maps the user filter in the master, sized from
+ *  SQLTDSUserFilter.  k is chosen for the configured false positive
+ *  rate, which then holds for up to capacity names.
+ */
+static void _sql_filter_create(void){
+  config_rec *c = NULL;
+  size_t nbytes = 0;
+  double rate = 0, fp;
+  void *map = NULL;
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSUserFilter", FALSE);
+  if (c == NULL)
+    return;
+
+  tds_filter_pool = make_sub_pool(permanent_pool);
+  if (_sql_filter_login(c->argv[0]) < 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+      ": no connection info for SQLTDSUserFilter connection '%s', ignoring",
+      (char *) c->argv[0]);
+    destroy_pool(tds_filter_pool);
+    tds_filter_pool = NULL;
+    return;
+  }
+
+  nbytes = *((size_t *) c->argv[1]);
+  rate = *((double *) c->argv[2]);
+
+  tds_filter_len = sizeof(shm_filter_t) + 2 * nbytes;
+  map = mmap(NULL, tds_filter_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANON, -1, 0);
+  if (map == MAP_FAILED) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION
+      ": unable to map %lu bytes for the user filter: %s",
+      (unsigned long) tds_filter_len, strerror(errno));
+    tds_filter_len = 0;
+    destroy_pool(tds_filter_pool);
+    tds_filter_pool = NULL;
+    return;
+  }
+
+  tds_filter = (shm_filter_t *) map;
+  tds_filter->nbytes = nbytes;
+  /* k = ceil(-log2 rate), and the filter holds m ln2 / k names at that
+   * rate; worked out without libm */
+  for (tds_filter->k = 0, fp = 1; fp > rate; fp /= 2)
+    tds_filter->k++;
+  tds_filter->capacity = (unsigned long) (nbytes * 8 * 0.693147 /
+    tds_filter->k);
+  tds_filter->refresh = *((int *) c->argv[3]);
+  tds_filter->live = -1;
+}
+
+/*
+ * _sql_filter_destroy: unmaps the user filter in the master, logging its
+ *  counters first.
+ */
+static void _sql_filter_destroy(void){
+  if (tds_filter == NULL)
+    return;
+
+  pr_log_pri(PR_LOG_INFO, MOD_SQL_TDS_VERSION
+    ": user filter: %lu names, %lu checks, %lu rejected",
+    tds_filter->nnames, tds_filter->checks, tds_filter->rejects);
+
+  munmap((void *) tds_filter, tds_filter_len);
+  tds_filter = NULL;
+  tds_filter_len = 0;
+
+  destroy_pool(tds_filter_pool);
+  tds_filter_pool = NULL;
+}
+
+/*
+ * _sql_health_create: maps the server health table.  Like the shared
+ *  cache, this happens in the master so every session inherits it.
+ */
+static void _sql_health_create(void){
+  void *map = NULL;
+
+  map = mmap(NULL, sizeof(shm_health_t) * TDS_HEALTH_SLOTS,
+    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  if (map == MAP_FAILED) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+      ": unable to map the server health table: %s", strerror(errno));
+    return;
+  }
+
+  tds_health = (shm_health_t *) map;
+}
+
+static void _sql_health_destroy(void){
+  if (tds_health == NULL)
+    return;
+
+  munmap((void *) tds_health, sizeof(shm_health_t) * TDS_HEALTH_SLOTS);
+  tds_health = NULL;
+}
+
+/*
+ * _sql_health_get: finds a server's health slot, claiming a free one the
+ *  first time the server is seen.  A claimed slot is only published as
+ *  READY once its name has been written, and a search that meets a slot
+ *  still being written waits for it rather than passing it by, so two
+ *  sessions can never end up with a slot each for the same server.
+ *
+ * Returns: the slot, or NULL if there is no table, it is full, or a slot
+ *  in the way never became ready.
+ */
+static shm_health_t *_sql_health_get(const char *server){
+  shm_health_t *h = NULL;
+  unsigned int hash = _sql_hash(server), x = 0, spins;
+
+  if (tds_health == NULL || strlen(server) >= TDS_HEALTH_NAMELEN)
+    return NULL;
+
+  for (x = 0; x < TDS_HEALTH_SLOTS; x++) {
+    h = &tds_health[(hash + x) % TDS_HEALTH_SLOTS];
+
+    if (h->state == TDS_HEALTH_FREE &&
+        __sync_bool_compare_and_swap(&h->state, TDS_HEALTH_FREE,
+          TDS_HEALTH_CLAIMED)) {
+      h->hash = hash;
+      sstrncpy(h->name, server, TDS_HEALTH_NAMELEN);
+      __sync_synchronize();
+      h->state = TDS_HEALTH_READY;
+      return h;
+    }
+
+    for (spins = 0; h->state == TDS_HEALTH_CLAIMED; spins++) {
+      if (spins == TDS_HEALTH_SPINS)
+        return NULL;
+      sched_yield();
+    }
+    __sync_synchronize();
+
+    if (h->hash == hash && strcmp(h->name, server) == 0)
+      return h;
+  }
+
+  return NULL;
+}
+
+/*
+ * _sql_health_sample: folds a latency sample into an EWMA with a weight
+ *  of 1/8, and clears the server's failure count.
+ */
+static void _sql_health_sample(shm_health_t *h, int login,
+    struct timeval *start){
+  volatile unsigned int *ewma = NULL;
+  struct timeval now;
+  long us = 0;
+
+  if (h == NULL)
+    return;
+
+  ewma = login ? &h->login_us : &h->query_us;
+
+  gettimeofday(&now, NULL);
+  us = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+  if (us < 1)
+    us = 1;
+
+  if (*ewma == 0)
+    *ewma = (unsigned int) us;
+  else
+    *ewma = (unsigned int) ((long) *ewma + (us - (long) *ewma) / 8);
+
+  h->failures = 0;
+}
+
+static void _sql_health_fail(shm_health_t *h){
+  if (h == NULL)
+    return;
+
+  __sync_fetch_and_add(&h->failures, 1);
+  h->failed_at = time(NULL);
+}
+
+/*
+ * _sql_health_avoid: whether a server failed recently enough to be
+ *  tried only after every other.  The time it is avoided for doubles
+ *  with each consecutive failure, up to TDS_HEALTH_MAX_BACKOFF seconds.
+ */
+static int _sql_health_avoid(shm_health_t *h, time_t now){
+  time_t backoff = TDS_HEALTH_MAX_BACKOFF;
+
+  if (h == NULL || h->failures == 0)
+    return FALSE;
+
+  if (h->failures < 6)
+    backoff = (time_t) 1 << h->failures;
+
+  return now - h->failed_at < backoff;
+}
+
+/*
+ * _sql_health_down: whether every one of a connection's servers is being
+ *  avoided, so that trying them now would most likely just wait out the
+ *  login timeout.
+ */
+static int _sql_health_down(db_conn_t *conn){
+  time_t now = time(NULL);
+  int x;
+
+  for (x = 0; x < conn->serverc; x++) {
+    if (!_sql_health_avoid(_sql_health_get(conn->serverv[x]), now))
+      return FALSE;
+  }
+
+  return conn->serverc > 0;
+}
+
+/*
+ * _sql_health_order: sorts a connection's servers healthiest first.
+ *  Servers that are being avoided go last, fewest failures first; the
+ *  rest are ordered by query latency, with the much rarer login latency
+ *  weighted in at 1/8.  Ties keep the configured order.
+ *
+ * Returns: the number of entries filled in order[].
+ */
+static int _sql_health_order(db_conn_t *conn, int *order){
+  unsigned long score[TDS_MAX_SERVERS], sc = 0;
+  shm_health_t *h = NULL;
+  time_t now = time(NULL);
+  int x = 0, y = 0;
+
+  for (x = 0; x < conn->serverc; x++) {
+    h = _sql_health_get(conn->serverv[x]);
+
+    if (h == NULL)
+      sc = 0;
+    else if (_sql_health_avoid(h, now))
+      sc = ~0UL - TDS_HEALTH_MAX_BACKOFF +
+        (h->failures < TDS_HEALTH_MAX_BACKOFF ? h->failures : TDS_HEALTH_MAX_BACKOFF);
+    else
+      sc = (unsigned long) h->query_us + h->login_us / 8;
+
+    /* insertion sort; the lists are a handful of servers long */
+    for (y = x; y > 0 && score[y - 1] > sc; y--) {
+      score[y] = score[y - 1];
+      order[y] = order[y - 1];
+    }
+    score[y] = sc;
+    order[y] = x;
+  }
+
+  return conn->serverc;
+}
+
+/*
+ * _sql_tds_set_servers: sets a connection's server list from a
+ *  comma-separated list of server names, as given after the '@' in
+ *  SQLConnectInfo.
+ */
+static void _sql_tds_set_servers(pool *p, db_conn_t *conn, const char *servers){
+  char *list = NULL, *name = NULL, *next = NULL;
+
+  conn->servers = pstrdup(p, servers);
+  conn->serverv = (char **) pcalloc(p, sizeof(char *) * TDS_MAX_SERVERS);
+  conn->serverc = 0;
+
+  list = pstrdup(p, servers);
+  for (name = list; name; name = next) {
+    if ((next = strchr(name, ',')) != NULL)
+      *next++ = '\0';
+
+    while (isspace((int) *name))
+      name++;
+    if (*name == '\0')
+      continue;
+
+    if (conn->serverc == TDS_MAX_SERVERS) {
+      sql_log(DEBUG_WARN, "ignoring servers after the first %d in '%s'",
+        TDS_MAX_SERVERS, servers);
+      break;
+    }
+
+    conn->serverv[conn->serverc++] = name;
+  }
+
+  if (conn->serverc == 0)
+    conn->serverv[conn->serverc++] = conn->servers;
+
+  conn->server = conn->serverv[0];
+}
+
+/*
+ * _sql_tds_read_config: picks up the module's directives for the current
+ *  server.  mod_sql may define connections before or after our own
+ *  session init runs, so this is called from both places and only does
+ *  the work once.
+ */
+static void _sql_tds_read_config(void){
+  config_rec *c = NULL;
+  void *ptr = NULL;
+
+  if (tds_config_read)
+    return;
+
+  ptr = get_param_ptr(main_server->conf, "SQLTDSPingInterval", FALSE);
+  tds_ping_interval = ptr ? *((int *) ptr) : 0;
+
+  tds_broker_path = get_param_ptr(main_server->conf, "SQLTDSBroker", FALSE);
+
+  ptr = get_param_ptr(main_server->conf, "SQLTDSAuthTimeout", FALSE);
+  tds_auth_timeout = ptr ? *((int *) ptr) : 0;
+
+  /* mod_sql's own user and group tables, for the shared cache */
+  tds_user_table = get_param_ptr(main_server->conf, "SQLUserTable", FALSE);
+  tds_group_table = get_param_ptr(main_server->conf, "SQLGroupTable", FALSE);
+  tds_user_field = get_param_ptr(main_server->conf, "SQLUsernameField", FALSE);
+  tds_pass_field = get_param_ptr(main_server->conf, "SQLPasswordField", FALSE);
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSUserFilter", FALSE);
+  if (c)
+    tds_filter_conn = c->argv[0];
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSQueryCache", FALSE);
+  if (c) {
+    tds_cache_ttl = *((int *) c->argv[0]);
+    tds_cache_max = *((unsigned int *) c->argv[1]);
+  }
+
+  tds_config_read = TRUE;
+}
+
+/*
+ * _sql_tds_conn_config: applies the per-connection directives, which name
+ *  the connection they belong to in their first argument.
+ */
+static void _sql_tds_conn_config(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  db_conn_t *rconn = NULL;
+  config_rec *c = NULL;
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSWriteBehind", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      entry->wb_max_count = *((unsigned int *) c->argv[1]);
+      entry->wb_max_bytes = *((size_t *) c->argv[2]);
+      entry->wb_interval = *((int *) c->argv[3]);
+      entry->wb_tables = c->argv[4];
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSWriteBehind", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSBulkCopy", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      entry->bcp_table = c->argv[1];
+      entry->bcp_batch = *((unsigned int *) c->argv[2]);
+      entry->bcp_interval = *((int *) c->argv[3]);
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSBulkCopy", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSDeferResults", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      entry->defer = TRUE;
+      entry->defer_interval = *((int *) c->argv[1]);
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSDeferResults", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSParameterize", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0)
+      entry->param = TRUE;
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSParameterize", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSTimeouts", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      conn->query_timeout = *((int *) c->argv[1]);
+      conn->login_timeout = *((int *) c->argv[2]);
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSTimeouts", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSResultLimit", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      conn->max_rows = *((unsigned long *) c->argv[1]);
+      conn->max_bytes = *((size_t *) c->argv[2]);
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSResultLimit", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSLoginPrefetch", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      entry->pf_users = c->argv[1];
+      entry->pf_groups = c->argv[2];
+      entry->pf_where = c->argv[3];
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSLoginPrefetch", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSPageSize", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      entry->page_rows = *((unsigned long *) c->argv[1]);
+      entry->page_key = c->argv[2];
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSPageSize", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSReadServers", FALSE);
+  while (c) {
+    if (strcmp(c->argv[0], entry->name) == 0) {
+      /* the read servers get an entry of their own, which never goes in
+       * the connection cache.
+       */
+      rconn = (db_conn_t *) pcalloc(conn_pool, sizeof(db_conn_t));
+      rconn->user = conn->user;
+      rconn->pass = conn->pass;
+      rconn->db = conn->db;
+      rconn->query_timeout = conn->query_timeout;
+      rconn->login_timeout = conn->login_timeout;
+      rconn->max_rows = conn->max_rows;
+      rconn->max_bytes = conn->max_bytes;
+      rconn->read_intent = TRUE;
+      _sql_tds_set_servers(conn_pool, rconn, c->argv[1]);
+
+      entry->read_entry = (conn_entry_t *) pcalloc(conn_pool,
+        sizeof(conn_entry_t));
+      entry->read_entry->name = entry->name;
+      entry->read_entry->data = rconn;
+      entry->read_pin = *((int *) c->argv[2]);
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "SQLTDSReadServers", FALSE);
+  }
+}
+
+/*
+ * _sql_tds_err_handler: db-lib error handler.  A statement that runs past
+ *  its timeout is cancelled, which also tells the server to stop working
+ *  on it, and the timeout is remembered for _build_error.  The generic
+ *  "server message" error leaves the server's own message number alone.
+ *  This can run on the early login thread, so it only touches
+ *  connections that have been handed to it with dbsetuserdata.
+ */
+static int _sql_tds_err_handler(DBPROCESS *dbproc, int severity, int dberr,
+    int oserr, char *dberrstr, char *oserrstr){
+  db_conn_t *conn = dbproc ? (db_conn_t *) dbgetuserdata(dbproc) : NULL;
+
+  if (conn) {
+    if (dberr == SYBETIME) {
+      conn->timed_out = TRUE;
+
+    } else if (dberrstr && (dberr != SYBESMSG || conn->msgno == 0)) {
+      conn->msgno = dberr;
+      sstrncpy(conn->msgtext, dberrstr, sizeof(conn->msgtext));
+    }
+  }
+
+  return INT_CANCEL;
+}
+
+/*
+ * _sql_tds_msg_handler: db-lib server message handler.  Keeps the last
+ *  real error; anything at severity 10 or below (such as "changed
+ *  database context") is informational.
+ */
+static int _sql_tds_msg_handler(DBPROCESS *dbproc, DBINT msgno, int msgstate,
+    int severity, char *msgtext, char *srvname, char *procname, int line){
+  db_conn_t *conn = dbproc ? (db_conn_t *) dbgetuserdata(dbproc) : NULL;
+
+  if (conn && severity > 10 && msgtext) {
+    conn->msgno = msgno;
+    sstrncpy(conn->msgtext, msgtext, sizeof(conn->msgtext));
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_tds_arm: clears a connection's error state and sets its timeout
+ *  for the next statement.  That is the SQLTDSTimeouts query timeout,
+ *  cut short by whatever is left of the SQLTDSAuthTimeout deadline.
+ *
+ * Returns: 0, or -1 if the authentication deadline has already passed.
+ */
+static int _sql_tds_arm(db_conn_t *conn){
+  char secs[20] = {'\0'};
+  int timeout = conn->query_timeout;
+  time_t now;
+
+  conn->timed_out = FALSE;
+  conn->msgno = 0;
+  conn->msgtext[0] = '\0';
+
+  if (tds_auth_deadline) {
+    now = time(NULL);
+    if (now >= tds_auth_deadline) {
+      sql_log(DEBUG_WARN, "%s", "authentication deadline passed");
+      conn->timed_out = TRUE;
+      return -1;
+    }
+
+    if (timeout == 0 || tds_auth_deadline - now < timeout)
+      timeout = (int) (tds_auth_deadline - now);
+  }
+
+  if (timeout != conn->armed && conn->dbproc) {
+    snprintf(secs, sizeof(secs), "%d", timeout);
+    dbsetopt(conn->dbproc, DBSETTIME, secs, 0);
+    conn->armed = timeout;
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_tds_loginrec: builds the LOGINREC for a named connection.  Bulk
+ *  copy needs its own login option, so the caller says which kind of
+ *  connection it wants.
+ */
+static LOGINREC *_sql_tds_loginrec(db_conn_t *conn, int bulk){
+  LOGINREC *login;
+
+  if(dbinit() == FAIL){
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION  ": failed to init database.");
+    sql_log(DEBUG_WARN, "%s", " failed to init tds database!");
+    return NULL;
+  }
+
+  dberrhandle(_sql_tds_err_handler);
+  dbmsghandle(_sql_tds_msg_handler);
+
+  /* db-lib only has a process-wide login timeout */
+  if (conn->login_timeout > 0)
+    dbsetlogintime(conn->login_timeout);
+
+  sql_log(DEBUG_FUNC, "%s", "Attempting to call dblogin ");
+  login = dblogin();
+  DBSETLPWD(login,conn->pass);
+  DBSETLAPP(login,"proftpd");
+  DBSETLUSER(login,conn->user);
+  if (bulk)
+    BCP_SETL(login, TRUE);
+#ifdef DBSETLDBNAME
+  /* pick the database in the login itself, rather than with a dbuse()
+   * round trip afterwards
+   */
+  DBSETLDBNAME(login, conn->db);
+#endif
+#ifdef DBSETLREADONLY
+  /* lets an availability group route us to a readable secondary */
+  if (conn->read_intent)
+    DBSETLREADONLY(login, TRUE);
+#endif
+  sql_log(DEBUG_FUNC, "Adding user %s and password %s to login", conn->user,conn->pass);
+
+ #ifdef PR_USE_NLS
+/* We actually need to set the Char encoding before we open the connection
+ * according to 
+ * http://manuals.sybase.com:80/onlinebooks/group-cnarc/cng1110e/dblib/@Generic__BookTextView/37135;pt=37135#X
+ * The Client picks a default char and the server does conversions between the local and server sets.
+ * This should override any char set, that was set in your interfaces file
+ */
+  if (pr_encode_get_encoding() != NULL){
+    DBSETLCHARSET(login,pr_encode_get_charset());
+    sql_log(DEBUG_FUNC,"Setting Client Character Set to '%s'",pr_encode_get_charset());
+  }
+#endif /* !PR_USE_NLS */
+
+  return login;
+}
+
+/*
+ * _sql_tds_login: logs into a named connection's server and switches to
+ *  its database.
+ *
+ * Returns: the new DBPROCESS, or NULL if the connection could not be made.
+ */
+static DBPROCESS *_sql_tds_login(db_conn_t *conn, int bulk){
+  DBPROCESS *dbproc = NULL;
+  LOGINREC *login;
+
+  if ((login = _sql_tds_loginrec(conn, bulk)) == NULL)
+    return NULL;
+
+  sql_log(DEBUG_FUNC, "%s", "calling dbopen");
+  dbproc = dbopen(login,conn->server);
+  _sql_trace_mark("dbopen");
+
+  //free the login rec.
+  dbloginfree(login);
+  sql_log(DEBUG_FUNC, "%s", "freeing our loginrec");
+  if(!dbproc){
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": failed to Login to DB server '%s'", conn->server);
+    sql_log(DEBUG_WARN, " failed to Login to DB server '%s'", conn->server);
+    return NULL;
+  }
+
+#ifndef DBSETLDBNAME
+  sql_log(DEBUG_FUNC, "attempting to switch to database: %s", conn->db);
+  if(dbuse(dbproc, conn->db) == FAIL){
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": failed to use database '%s'", conn->db);
+    sql_log(DEBUG_WARN, " failed to use database '%s'", conn->db);
+    dbclose(dbproc);
+    return NULL;
+  }
+  _sql_trace_mark("dbuse");
+#endif
+
+  return dbproc;
+}
+
+/*
+ * _sql_tds_login_thread: does the blocking part of an early login.  It
+ *  runs alongside the session, so it must not touch pools, logs or
+ *  anything else of ProFTPD's; the outcome is left in the entry for
+ *  _sql_tds_login_wait.
+ */
+static void *_sql_tds_login_thread(void *arg){
+  conn_entry_t *entry = (conn_entry_t *) arg;
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  DBPROCESS *dbproc = NULL;
+
+  dbproc = dbopen(entry->login_rec, conn->server);
+  dbloginfree(entry->login_rec);
+  entry->login_rec = NULL;
+
+  if (dbproc == NULL) {
+    entry->login_error = "failed to Login to DB server";
+
+#ifndef DBSETLDBNAME
+  } else if (dbuse(dbproc, conn->db) == FAIL) {
+    entry->login_error = "failed to use database";
+    dbclose(dbproc);
+    dbproc = NULL;
+#endif
+  }
+
+  entry->login_dbproc = dbproc;
+  return NULL;
+}
+
+/*
+ * _sql_tds_login_start: starts logging into a named connection in the
+ *  background, so that the handshake overlaps with the FTP greeting and
+ *  USER instead of holding them up.  The thread is joined before PASS
+ *  is handled, and cmd_open picks up the result.
+ */
+static void _sql_tds_login_start(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  int order[TDS_MAX_SERVERS];
+  sigset_t all, saved;
+  int res = 0;
+
+  _sql_health_order(conn, order);
+  conn->server = conn->serverv[order[0]];
+
+  if ((entry->login_rec = _sql_tds_loginrec(conn, FALSE)) == NULL)
+    return;
+
+  entry->login_dbproc = NULL;
+  entry->login_error = NULL;
+
+  /* ProFTPD's signal handlers belong to the session's own thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  res = pthread_create(&entry->login_thread, NULL, _sql_tds_login_thread,
+    entry);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (res != 0) {
+    sql_log(DEBUG_WARN, "unable to start early login: %s", strerror(res));
+    dbloginfree(entry->login_rec);
+    entry->login_rec = NULL;
+    return;
+  }
+
+  entry->login_started = TRUE;
+  sql_log(DEBUG_INFO, "connection '%s' - early login started", entry->name);
+}
+
+/*
+ * _sql_tds_login_join: waits for an early login's thread to finish,
+ *  leaving its outcome for _sql_tds_login_wait.
+ */
+static void _sql_tds_login_join(conn_entry_t *entry){
+  if (!entry->login_started)
+    return;
+
+  pthread_join(entry->login_thread, NULL);
+  entry->login_started = FALSE;
+  entry->login_joined = TRUE;
+}
+
+/*
+ * _sql_tds_login_wait: waits for whatever is left of an early login.
+ *
+ * Returns: the DBPROCESS it opened, or NULL if there was none or it failed.
+ */
+static DBPROCESS *_sql_tds_login_wait(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  DBPROCESS *dbproc = NULL;
+
+  _sql_tds_login_join(entry);
+  if (!entry->login_joined)
+    return NULL;
+  entry->login_joined = FALSE;
+
+  dbproc = entry->login_dbproc;
+  entry->login_dbproc = NULL;
+
+  if (dbproc == NULL) {
+    sql_log(DEBUG_WARN, "early login to '%s' failed: %s", conn->server,
+      entry->login_error);
+    _sql_health_fail(_sql_health_get(conn->server));
+  } else
+    sql_log(DEBUG_INFO, "connection '%s' - early login complete", entry->name);
+
+  return dbproc;
+}
+
+/*
+ * _sql_tds_connect: logs into the server and switches to the configured
+ *  database for a named connection.  With more than one server
+ *  configured, they are tried in _sql_health_order's order.
+ *
+ * Returns: 0 on success, -1 if the connection could not be made.  In the
+ *  latter case conn->dbproc is left NULL.
+ */
+static int _sql_tds_connect(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  int order[TDS_MAX_SERVERS];
+  shm_health_t *h = NULL;
+  struct timeval start;
+  int n = 0, x = 0;
+
+  /* an early login that failed is retried here, so its error is logged */
+  conn->dbproc = _sql_tds_login_wait(entry);
+
+  /* otherwise try the servers healthiest first, failing over in turn */
+  n = _sql_health_order(conn, order);
+  for (x = 0; x < n && !conn->dbproc; x++) {
+    conn->server = conn->serverv[order[x]];
+    h = _sql_health_get(conn->server);
+
+    gettimeofday(&start, NULL);
+    conn->dbproc = _sql_tds_login(conn, FALSE);
+
+    if (conn->dbproc) {
+      _sql_health_sample(h, TRUE, &start);
+    } else {
+      _sql_health_fail(h);
+      if (x + 1 < n)
+        sql_log(DEBUG_WARN, "connection '%s' - failing over to '%s'",
+          entry->name, conn->serverv[order[x + 1]]);
+    }
+  }
+
+  if (!conn->dbproc)
+    return -1;
+
+  dbsetuserdata(conn->dbproc, (BYTE *) conn);
+  conn->armed = 0;
+
+  conn->last_used = time(NULL);
+  return 0;
+}
+
+/*
+ * _sql_tds_reconnect: throws away the named connection's DBPROCESS and
+ *  opens a new one, without touching the connection count or timers.
+ */
+static int _sql_tds_reconnect(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+
+  sql_log(DEBUG_WARN, "connection '%s' is dead, reconnecting", entry->name);
+  _sql_health_fail(_sql_health_get(conn->server));
+
+  if (conn->dbproc) {
+    dbclose(conn->dbproc);
+    conn->dbproc = NULL;
+  }
+
+  return _sql_tds_connect(entry);
+}
+
+/*
+ * _sql_tds_alive: cheap liveness check for an open connection.  dbdead()
+ *  only knows about failures db-lib has already seen, so if the
+ *  connection has been idle for longer than SQLTDSPingInterval we also
+ *  send a trivial batch to flush out sockets killed by failovers or
+ *  idle firewall timeouts.
+ */
+static int _sql_tds_alive(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  time_t now;
+  RETCODE ret;
+
+  if (!conn->dbproc || dbdead(conn->dbproc))
+    return FALSE;
+
+  if (tds_ping_interval <= 0)
+    return TRUE;
+
+  now = time(NULL);
+  if (now - conn->last_used < tds_ping_interval)
+    return TRUE;
+
+  sql_log(DEBUG_INFO, "connection '%s' idle for %lu seconds, pinging",
+    entry->name, (unsigned long) (now - conn->last_used));
+
+  if (_sql_tds_arm(conn) < 0 ||
+      dbcmd(conn->dbproc, "SELECT 1") == FAIL ||
+      dbsqlexec(conn->dbproc) == FAIL)
+    return FALSE;
+
+  while ((ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS) {
+    if (ret == FAIL)
+      return FALSE;
+    dbcanquery(conn->dbproc);
+  }
+
+  conn->last_used = now;
+  return TRUE;
+}
+
+/*
+ * _sql_is_readonly: makes a conservative guess at whether a free-form
+ *  query only reads data -- a SELECT that isn't a SELECT ... INTO.
+ */
+static int _sql_is_readonly(const char *query){
+  const char *ptr = query;
+
+  while (isspace((int) *ptr) || *ptr == '(') ptr++;
+
+  if (strncasecmp(ptr, "SELECT", 6) || !(isspace((int) ptr[6]) || ptr[6] == '\0'))
+    return FALSE;
+
+  for (ptr += 6; *ptr; ptr++) {
+    if (isspace((int) ptr[0]) && !strncasecmp(ptr + 1, "INTO", 4) &&
+        (isspace((int) ptr[5]) || ptr[5] == '\0'))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * _sql_tds_exec: sends a query batch on a named connection and waits for
+ *  the server to accept it.  If that fails because the connection died
+ *  underneath us and the statement is idempotent, the connection is
+ *  reopened and the statement retried once.
+ *
+ * Returns: the result of dbsqlexec().
+ */
+static RETCODE _sql_tds_exec(conn_entry_t *entry, const char *query,
+    int idempotent){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  struct timeval start;
+  RETCODE ret;
+
+  if (_sql_tds_arm(conn) < 0)
+    return FAIL;
+
+  gettimeofday(&start, NULL);
+  dbcmd(conn->dbproc, query);
+  _sql_trace_mark("send");
+  ret = dbsqlexec(conn->dbproc);
+  _sql_trace_mark("exec");
+
+  if (ret != SUCCEED && idempotent && dbdead(conn->dbproc)) {
+    if (_sql_tds_reconnect(entry) < 0 || _sql_tds_arm(conn) < 0)
+      return FAIL;
+
+    sql_log(DEBUG_INFO, "%s", "retrying query on new connection");
+    gettimeofday(&start, NULL);
+    dbcmd(conn->dbproc, query);
+    _sql_trace_mark("send");
+    ret = dbsqlexec(conn->dbproc);
+    _sql_trace_mark("exec");
+  }
+
+  if (ret == SUCCEED) {
+    conn->last_used = time(NULL);
+    _sql_health_sample(_sql_health_get(conn->server), FALSE, &start);
+
+  } else if (dbdead(conn->dbproc)) {
+    _sql_health_fail(_sql_health_get(conn->server));
+  }
+
+  return ret;
+}
+
+/*
+ * _sql_param_forget: drops the noted values once a statement has been
+ *  parameterized with them, so they can't match literals in later,
+ *  unrelated statements.
+ */
+static void _sql_param_forget(conn_entry_t *entry){
+  if (entry->param_pool == NULL)
+    return;
+
+  destroy_pool(entry->param_pool);
+  entry->param_pool = NULL;
+  entry->param_vals = NULL;
+}
+
+/*
+ * _sql_param_note: remembers a value escaped by cmd_escapestring, so that
+ *  _sql_parameterize can recognize it once mod_sql has quoted it into a
+ *  statement.
+ */
+static void _sql_param_note(conn_entry_t *entry, const char *escaped){
+  if (strlen(escaped) > TDS_MAX_PARAMLEN)
+    return;
+
+  /* the list only has to cover the statement being put together */
+  if (entry->param_vals && entry->param_vals->nelts >= TDS_MAX_PARAMVALS)
+    _sql_param_forget(entry);
+
+  if (entry->param_pool == NULL) {
+    entry->param_pool = make_sub_pool(conn_pool);
+    entry->param_vals = make_array(entry->param_pool, 8, sizeof(char *));
+  }
+
+  *((char **) push_array(entry->param_vals)) = pstrdup(entry->param_pool,
+    escaped);
+}
+
+/*
+ * _sql_parameterize: rewrites a statement for sp_executesql, replacing
+ *  each quoted literal that cmd_escapestring produced with @p1, @p2...
+ *  Other literals are part of the statement's shape and stay as they
+ *  are.  Parameter values are the literals with '' turned back into ',
+ *  which is what the server would have seen.
+ *
+ * Returns: the number of parameters, with the statement, its parameter
+ *  declarations and values filled in.
+ */
+static int _sql_parameterize(pool *p, conn_entry_t *entry, const char *query,
+    char **stmt, char **decl, char ***vals){
+  const char *ptr = query;
+  const char *start = NULL;
+  char *out = NULL;
+  char *value = NULL;
+  size_t len = 0;
+  char name[16];
+  int nquotes = 0;
+  int nparams = 0;
+  int x;
+
+  if (entry->param_vals == NULL || entry->param_vals->nelts == 0)
+    return 0;
+
+  for (start = query; *start; start++)
+    if (*start == '\'')
+      nquotes++;
+
+  /* @pN can be longer than the literal it replaces ('' or 'x' from the
+   * tenth parameter on), so leave room for the longest name per literal
+   */
+  out = *stmt = (char *) palloc(p, strlen(query) +
+    (nquotes / 2) * (strlen("@p") + 10) + 1);
+  *decl = "";
+  *vals = (char **) palloc(p, sizeof(char *) * (nquotes / 2 + 1));
+
+  while (*ptr) {
+    if (*ptr != '\'') {
+      *out++ = *ptr++;
+      continue;
+    }
+
+    /* find the end of the literal */
+    start = ++ptr;
+    while (*ptr && !(*ptr == '\'' && ptr[1] != '\'')) {
+      if (*ptr == '\'')
+        ptr++;
+      ptr++;
+    }
+    len = ptr - start;
+
+    for (x = 0; x < entry->param_vals->nelts; x++) {
+      value = ((char **) entry->param_vals->elts)[x];
+      if (strlen(value) == len && strncmp(value, start, len) == 0)
+        break;
+    }
+
+    /* unicode N'' literals and unterminated ones are left alone */
+    if (x == entry->param_vals->nelts || *ptr == '\0' ||
+        (start - 1 > query && (start[-2] == 'N' || start[-2] == 'n'))) {
+      /* not one of ours, copy it through */
+      *out++ = '\'';
+      memcpy(out, start, len);
+      out += len;
+      if (*ptr)
+        *out++ = *ptr++;
+      continue;
+    }
+
+    if (*ptr)
+      ptr++;
+
+    nparams++;
+    snprintf(name, sizeof(name), "@p%d", nparams);
+    out = _sql_put(out, name, strlen(name));
+    *decl = pstrcat(p, *decl, nparams > 1 ? ", " : "", name,
+      " varchar(8000)", NULL);
+
+    (*vals)[nparams - 1] = value = (char *) palloc(p, len + 1);
+    for (x = 0; x < len; x++) {
+      *value++ = start[x];
+      if (start[x] == '\'')
+        x++;
+    }
+    *value = '\0';
+  }
+  *out = '\0';
+
+  return nparams;
+}
+
+/*
+ * _sql_tds_refused: whether a server error means a parameterized
+ *  statement could not be compiled or bound, so that nothing in it ran:
+ *  syntax errors, undeclared variables, parameter type clashes and
+ *  sp_executesql's own parameter errors.
+ */
+static int _sql_tds_refused(DBINT msgno){
+  switch (msgno) {
+    case 102:   /* incorrect syntax */
+    case 105:   /* unclosed quotation mark */
+    case 137:   /* must declare the scalar variable */
+    case 156:   /* incorrect syntax near keyword */
+    case 170:   /* incorrect syntax (line) */
+    case 201:   /* procedure expects parameter */
+    case 206:   /* operand type clash */
+    case 214:   /* procedure expects parameter of type ntext */
+    case 257:   /* implicit conversion not allowed */
+    case 1046:  /* subqueries are not allowed in this context */
+    case 8144:  /* too many arguments */
+    case 8178:  /* parameterized query expects a parameter */
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * _sql_tds_exec_params: runs a statement built by mod_sql like
+ *  _sql_tds_exec, but with SQLTDSParameterize set the values quoted into
+ *  it by cmd_escapestring are sent as sp_executesql parameters, so every
+ *  user shares one cached plan per statement shape.  A new shape the
+ *  server cannot compile or bind is remembered and sent as plain SQL from
+ *  then on; the statement itself is only rerun that way if it is
+ *  idempotent.  The notes and shapes belong to entry, the statement runs
+ *  on target.
+ *
+ * Returns: like _sql_tds_exec, the statement's dbsqlok()/dbsqlexec().
+ */
+static RETCODE _sql_tds_exec_params(pool *p, conn_entry_t *entry,
+    conn_entry_t *target, const char *query, int idempotent){
+  db_conn_t *conn = (db_conn_t *) target->data;
+  struct timeval start;
+  char *stmt = NULL, *decl = NULL, **vals = NULL;
+  const int *shape = NULL;
+  int *state = NULL;
+  char name[16];
+  RETCODE ret;
+  int nparams, x;
+
+  if (!entry->param || conn->dbproc == NULL)
+    return _sql_tds_exec(target, query, idempotent);
+
+  nparams = _sql_parameterize(p, entry, query, &stmt, &decl, &vals);
+  _sql_param_forget(entry);
+  if (nparams == 0)
+    return _sql_tds_exec(target, query, idempotent);
+
+  if (entry->param_shapes == NULL)
+    entry->param_shapes = pr_table_alloc(conn_pool, 0);
+
+  shape = (const int *) pr_table_get(entry->param_shapes, stmt, NULL);
+  if (shape && *shape == TDS_SHAPE_LITERAL)
+    return _sql_tds_exec(target, query, idempotent);
+
+  if (_sql_tds_arm(conn) < 0)
+    return FAIL;
+
+  sql_log(DEBUG_INFO, "parameterized \"%s\" (%d parameters)", stmt, nparams);
+
+  gettimeofday(&start, NULL);
+  ret = dbrpcinit(conn->dbproc, "sp_executesql", 0);
+  if (ret == SUCCEED)
+    ret = dbrpcparam(conn->dbproc, NULL, 0, TDS_RPC_NTEXT, -1,
+      (DBINT) strlen(stmt), (BYTE *) stmt);
+  if (ret == SUCCEED)
+    ret = dbrpcparam(conn->dbproc, NULL, 0, TDS_RPC_NTEXT, -1,
+      (DBINT) strlen(decl), (BYTE *) decl);
+  for (x = 0; x < nparams && ret == SUCCEED; x++) {
+    snprintf(name, sizeof(name), "@p%d", x + 1);
+    ret = dbrpcparam(conn->dbproc, name, 0, SYBVARCHAR, -1,
+      (DBINT) strlen(vals[x]), (BYTE *) vals[x]);
+  }
+  if (ret == SUCCEED)
+    ret = dbrpcsend(conn->dbproc);
+  _sql_trace_mark("send");
+  if (ret == SUCCEED)
+    ret = dbsqlok(conn->dbproc);
+  _sql_trace_mark("exec");
+
+  if (ret == SUCCEED) {
+    conn->last_used = time(NULL);
+    _sql_health_sample(_sql_health_get(conn->server), FALSE, &start);
+
+    if (shape == NULL && pr_table_count(entry->param_shapes) < TDS_MAX_SHAPES) {
+      state = (int *) palloc(conn_pool, sizeof(int));
+      *state = TDS_SHAPE_PARAMS;
+      pr_table_add(entry->param_shapes, pstrdup(conn_pool, stmt), state,
+        sizeof(int));
+    }
+
+    return ret;
+  }
+
+  /* a dead connection is _sql_tds_exec's to reopen and retry, if it may */
+  if (dbdead(conn->dbproc)) {
+    _sql_health_fail(_sql_health_get(conn->server));
+    if (!idempotent)
+      return ret;
+
+    return _sql_tds_exec(target, query, idempotent);
+  }
+
+  dbcancel(conn->dbproc);
+
+  /* a shape that has worked before just hit an error of its own, and
+   * anything but a compile or parameter error may be transient
+   */
+  if (shape != NULL || !_sql_tds_refused(conn->msgno))
+    return ret;
+
+  sql_log(DEBUG_WARN, "server refused parameterized \"%s\" (%ld), sending "
+    "this statement as it is from now on", stmt, (long) conn->msgno);
+
+  if (pr_table_count(entry->param_shapes) < TDS_MAX_SHAPES) {
+    state = (int *) palloc(conn_pool, sizeof(int));
+    *state = TDS_SHAPE_LITERAL;
+    pr_table_add(entry->param_shapes, pstrdup(conn_pool, stmt), state,
+      sizeof(int));
+  }
+
+  if (!idempotent)
+    return ret;
+
+  return _sql_tds_exec(target, query, idempotent);
+}
+
+/*
+ * _sql_read_entry: picks where a read on a named connection should run:
+ *  its read servers if it has them, unless the session wrote through the
+ *  connection within the last SQLTDSReadServers pin seconds, or none of
+ *  the read servers can be reached.  The read connection is opened on
+ *  first use and kept for the rest of the session.  While every read
+ *  server is in its failure backoff, reads go straight to the primary
+ *  without trying to connect.
+ */
+static conn_entry_t *_sql_read_entry(conn_entry_t *entry){
+  conn_entry_t *rentry = entry->read_entry;
+  db_conn_t *rconn = NULL;
+
+  /* brokered sessions hold no connections of their own */
+  if (rentry == NULL || tds_broker_fd >= 0)
+    return entry;
+
+  if (entry->read_pin > 0 && time(NULL) - entry->last_write < entry->read_pin) {
+    sql_log(DEBUG_INFO, "connection '%s' - reading from the primary after "
+      "a write", entry->name);
+    return entry;
+  }
+
+  rconn = (db_conn_t *) rentry->data;
+  if ((rconn->dbproc == NULL || dbdead(rconn->dbproc)) &&
+      _sql_health_down(rconn)) {
+    sql_log(DEBUG_INFO, "connection '%s' - read servers recently failed, "
+      "reading from the primary", entry->name);
+    return entry;
+  }
+
+  if (rconn->dbproc ?
+      (!_sql_tds_alive(rentry) && _sql_tds_reconnect(rentry) < 0) :
+      (_sql_tds_connect(rentry) < 0)) {
+    sql_log(DEBUG_WARN, "connection '%s' - no read server available, "
+      "reading from the primary", entry->name);
+    return entry;
+  }
+
+  return rentry;
+}
+
+/*
+ * Broker mode.
+ *
+ * With SQLTDSBroker configured, the master forks a fixed pool of broker
+ * workers at startup.  Every worker accepts session connections on a
+ * shared Unix socket and serves their statements over one DBPROCESS of
+ * its own, so thousands of FTP sessions share a handful of logins.
+ *
+ * Each session keeps a single connection to the broker, opened before
+ * any chroot.  The socket belongs to the daemon's User and Group, and
+ * the workers run as them too.  Frames are a fixed header followed by a
+ * payload of length-prefixed, NUL-terminated strings (all integers in
+ * network order):
+ *
+ *  request: u32 magic, u8 op, u32 login, u32 payload length,
+ *           string query
+ *  reply:   u8 status, u32 payload length, then either
+ *           nothing (OK), u32 rnum, u32 fnum and rnum*fnum strings
+ *           (DATA), or one error string (ERROR)
+ *
+ * login is an index into tds_broker_logins, the logins configured with
+ * SQLConnectInfo; connections using any other login don't go through the
+ * broker.  A worker keeps its DBPROCESS for as long as requests keep
+ * naming the same login.
+ */
+
+/*
+ * _sql_broker_io: reads or writes exactly len bytes.  On a non-blocking
+ *  socket it waits for the peer, but for no longer than
+ *  TDS_BROKER_REQ_TIMEOUT in all.
+ */
+static int _sql_broker_io(int fd, void *buf, size_t len, int writing){
+  char *ptr = (char *) buf;
+  time_t deadline = time(NULL) + TDS_BROKER_REQ_TIMEOUT, now;
+  struct pollfd pfd;
+  ssize_t res = 0;
+
+  while (len > 0) {
+    res = writing ? write(fd, ptr, len) : read(fd, ptr, len);
+    if (res < 0 && errno == EINTR)
+      continue;
+
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      now = time(NULL);
+      pfd.fd = fd;
+      pfd.events = writing ? POLLOUT : POLLIN;
+      if (now < deadline &&
+          poll(&pfd, 1, (int) (deadline - now) * 1000) >= 0)
+        continue;
+      return -1;
+    }
+
+    if (res <= 0)
+      return -1;
+
+    ptr += res;
+    len -= res;
+  }
+
+  return 0;
+}
+
+static char *_sql_broker_put_u32(char *ptr, uint32_t val){
+  val = htonl(val);
+  memcpy(ptr, &val, sizeof(uint32_t));
+  return ptr + sizeof(uint32_t);
+}
+
+static char *_sql_broker_put_str(char *ptr, const char *str, size_t len){
+  ptr = _sql_broker_put_u32(ptr, (uint32_t) len);
+  memcpy(ptr, str, len);
+  ptr[len] = '\0';
+  return ptr + len + 1;
+}
+
+static int _sql_broker_get_u32(char **ptr, char *end, uint32_t *val){
+  if (end - *ptr < (long) sizeof(uint32_t))
+    return -1;
+
+  memcpy(val, *ptr, sizeof(uint32_t));
+  *val = ntohl(*val);
+  *ptr += sizeof(uint32_t);
+  return 0;
+}
+
+/*
+ * _sql_broker_get_str: returns a pointer to the next string in a frame,
+ *  in place; the frame already carries the terminating NUL.
+ */
+static char *_sql_broker_get_str(char **ptr, char *end){
+  uint32_t len = 0;
+  char *str = NULL;
+
+  if (_sql_broker_get_u32(ptr, end, &len) < 0 ||
+      (unsigned long) (end - *ptr) < (unsigned long) len + 1 ||
+      (*ptr)[len] != '\0')
+    return NULL;
+
+  str = *ptr;
+  *ptr += len + 1;
+  return str;
+}
+
+/*
+ * _sql_broker_read_frame: reads a frame header of hdrlen bytes (whose
+ *  last four bytes are the payload length) and the payload that follows
+ *  it into memory allocated from the given pool.
+ */
+static char *_sql_broker_read_frame(pool *p, int fd, char *hdr, size_t hdrlen,
+    uint32_t *len){
+  char *payload = NULL;
+
+  if (_sql_broker_io(fd, hdr, hdrlen, FALSE) < 0)
+    return NULL;
+
+  memcpy(len, hdr + hdrlen - sizeof(uint32_t), sizeof(uint32_t));
+  *len = ntohl(*len);
+  if (*len > TDS_BROKER_MAX_FRAME)
+    return NULL;
+
+  payload = (char *) palloc(p, *len + 1);
+  if (_sql_broker_io(fd, payload, *len, FALSE) < 0)
+    return NULL;
+
+  return payload;
+}
+
+/*
+ * _sql_broker_reply: sends a reply frame to a session.  sd is only used
+ *  for TDS_BROKER_DATA replies, msg only for TDS_BROKER_ERROR ones.
+ */
+static int _sql_broker_reply(pool *p, int fd, unsigned char status,
+    sql_data_t *sd, const char *msg){
+  char *buf = NULL, *ptr = NULL;
+  size_t len = 0;
+  unsigned long cnt = 0, x;
+
+  if (status == TDS_BROKER_DATA) {
+    cnt = sd->rnum * sd->fnum;
+    len = 2 * sizeof(uint32_t);
+    for (x = 0; x < cnt; x++)
+      len += sizeof(uint32_t) + strlen(sd->data[x]) + 1;
+
+  } else if (status == TDS_BROKER_ERROR) {
+    len = sizeof(uint32_t) + strlen(msg) + 1;
+  }
+
+  buf = (char *) palloc(p, 1 + sizeof(uint32_t) + len);
+  buf[0] = (char) status;
+  ptr = _sql_broker_put_u32(buf + 1, (uint32_t) len);
+
+  if (status == TDS_BROKER_DATA) {
+    ptr = _sql_broker_put_u32(ptr, (uint32_t) sd->rnum);
+    ptr = _sql_broker_put_u32(ptr, (uint32_t) sd->fnum);
+    for (x = 0; x < cnt; x++)
+      ptr = _sql_broker_put_str(ptr, sd->data[x], strlen(sd->data[x]));
+
+  } else if (status == TDS_BROKER_ERROR) {
+    ptr = _sql_broker_put_str(ptr, msg, strlen(msg));
+  }
+
+  return _sql_broker_io(fd, buf, ptr - buf, TRUE);
+}
+
+/*
+ * _sql_broker_login: finds the configured broker login that a named
+ *  connection uses.
+ *
+ * Returns: its index in tds_broker_logins, or -1 if it has none.
+ */
+static int _sql_broker_login(db_conn_t *conn){
+  broker_login_t *logins = NULL;
+  int x;
+
+  if (tds_broker_logins == NULL)
+    return -1;
+
+  logins = (broker_login_t *) tds_broker_logins->elts;
+  for (x = 0; x < tds_broker_logins->nelts; x++) {
+    if (strcmp(logins[x].servers, conn->servers) == 0 &&
+        strcmp(logins[x].user, conn->user) == 0 &&
+        strcmp(logins[x].pass, conn->pass) == 0 &&
+        strcmp(logins[x].db, conn->db) == 0)
+      return x;
+  }
+
+  return -1;
+}
+
+/*
+ * _sql_broker_recv: worker side.  Reads whatever has arrived of a
+ *  session's next request, without blocking.
+ *
+ * Returns: 1 once the request is complete, 0 if more is to come, or -1
+ *  if the session went away or sent garbage.
+ */
+static int _sql_broker_recv(broker_client_t *client, int fd){
+  uint32_t magic = 0;
+  ssize_t res = 0;
+
+  if (client->pool == NULL) {
+    client->pool = make_sub_pool(permanent_pool);
+    client->payload = NULL;
+    client->have = 0;
+    client->deadline = time(NULL) + TDS_BROKER_REQ_TIMEOUT;
+  }
+
+  if (client->have < TDS_BROKER_REQ_HDRLEN) {
+    res = read(fd, client->hdr + client->have,
+      TDS_BROKER_REQ_HDRLEN - client->have);
+
+  } else {
+    res = read(fd, client->payload + (client->have - TDS_BROKER_REQ_HDRLEN),
+      client->len - (client->have - TDS_BROKER_REQ_HDRLEN));
+  }
+
+  if (res < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (res <= 0)
+    return -1;
+
+  client->have += res;
+
+  if (client->payload == NULL) {
+    if (client->have < TDS_BROKER_REQ_HDRLEN)
+      return 0;
+
+    memcpy(&magic, client->hdr, sizeof(uint32_t));
+    memcpy(&client->len, client->hdr + 1 + 2 * sizeof(uint32_t),
+      sizeof(uint32_t));
+    client->len = ntohl(client->len);
+    if (ntohl(magic) != TDS_BROKER_MAGIC ||
+        client->len > TDS_BROKER_MAX_FRAME)
+      return -1;
+
+    client->payload = (char *) palloc(client->pool, client->len + 1);
+  }
+
+  return client->have == TDS_BROKER_REQ_HDRLEN + client->len ? 1 : 0;
+}
+
+/*
+ * _sql_broker_serve: worker side.  Runs a session's complete request on
+ *  the worker's connection and sends back the reply.  The statement is
+ *  cancelled if it runs past TDS_BROKER_REQ_TIMEOUT.
+ *
+ * Returns: -1 if the session went away or sent garbage, 0 otherwise.
+ */
+static int _sql_broker_serve(conn_entry_t *entry, pool **credpool,
+    int *login, broker_client_t *client, int fd){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  broker_login_t *logins = (broker_login_t *) tds_broker_logins->elts;
+  pool *p = client->pool;
+  char *ptr = NULL, *end = NULL, *query = NULL;
+  uint32_t want = 0;
+  unsigned char op = 0;
+  sql_data_t *sd = NULL;
+  RETCODE ret = FAIL;
+
+  op = (unsigned char) client->hdr[sizeof(uint32_t)];
+  memcpy(&want, client->hdr + 1 + sizeof(uint32_t), sizeof(uint32_t));
+  want = ntohl(want);
+
+  ptr = client->payload;
+  end = client->payload + client->len;
+  if (want >= (uint32_t) tds_broker_logins->nelts ||
+      !(query = _sql_broker_get_str(&ptr, end)))
+    return -1;
+
+  /* a different login: drop our connection and take up the new one */
+  if ((int) want != *login) {
+    if (conn->dbproc) {
+      dbclose(conn->dbproc);
+      conn->dbproc = NULL;
+    }
+
+    destroy_pool(*credpool);
+    *credpool = make_sub_pool(permanent_pool);
+
+    _sql_tds_set_servers(*credpool, conn, logins[want].servers);
+    conn->user = logins[want].user;
+    conn->pass = logins[want].pass;
+    conn->db = logins[want].db;
+    *login = (int) want;
+  }
+
+  if (!_sql_tds_alive(entry) && _sql_tds_reconnect(entry) < 0)
+    return _sql_broker_reply(p, fd, TDS_BROKER_ERROR, NULL,
+      "broker unable to connect to database");
+
+  ret = _sql_tds_exec(entry, query, op == TDS_BROKER_OP_SELECT ||
+    (op == TDS_BROKER_OP_QUERY && _sql_is_readonly(query)));
+
+  if ((ret != SUCCEED && op == TDS_BROKER_OP_SELECT) ||
+      dbresults(conn->dbproc) != SUCCEED) {
+    dbcancel(conn->dbproc);
+    return _sql_broker_reply(p, fd, TDS_BROKER_ERROR, NULL,
+      conn->timed_out ? "query timed out" : "An Internal Error Occured");
+  }
+
+  if (op == TDS_BROKER_OP_SELECT ||
+      (op == TDS_BROKER_OP_QUERY && dbnumcols(conn->dbproc) > 0)) {
+    sd = _sql_fetch_rows(p, conn, conn->max_rows, conn->max_bytes);
+    if (sd == NULL) {
+      dbcancel(conn->dbproc);
+      return _sql_broker_reply(p, fd, TDS_BROKER_ERROR, NULL,
+        conn->timed_out ? "query timed out" : "An Internal Error Occured");
+    }
+  }
+
+  /* leave the connection clean for the next session */
+  while ((ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS && ret != FAIL)
+    dbcanquery(conn->dbproc);
+
+  return _sql_broker_reply(p, fd, sd ? TDS_BROKER_DATA : TDS_BROKER_OK, sd,
+    NULL);
+}
+
+/*
+ * _sql_child_privs: in a child of the master that talks to the database
+ *  on its own, gives up root for good in favour of the daemon's User and
+ *  Group.  Exits if it can't.
+ */
+static void _sql_child_privs(const char *what){
+  PRIVS_ROOT
+  if (setgroups(1, &daemon_gid) < 0 || setgid(daemon_gid) < 0 ||
+      setuid(daemon_uid) < 0) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION
+      ": %s unable to switch to UID %lu, GID %lu: %s", what,
+      (unsigned long) daemon_uid, (unsigned long) daemon_gid,
+      strerror(errno));
+    _exit(1);
+  }
+}
+
+/*
+ * _sql_broker_worker: main loop of a broker worker process.  Multiplexes
+ *  any number of session connections over one DBPROCESS; never returns.
+ */
+static void _sql_broker_worker(int listenfd){
+  conn_entry_t entry;
+  db_conn_t conn;
+  pool *credpool = NULL, *fdpool = NULL;
+  struct pollfd *fds = NULL, *newfds = NULL;
+  broker_client_t *clients = NULL, *newclients = NULL;
+  unsigned int nfds = 1, nalloc = 64, x;
+  int fd = -1, login = -1, timeout, wait, res;
+  time_t now;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGALRM, SIG_IGN);
+
+  /* a worker needs no more than the daemon's own privileges */
+  _sql_child_privs("broker");
+
+  memset(&entry, 0, sizeof(entry));
+  memset(&conn, 0, sizeof(conn));
+  entry.name = "broker";
+  entry.data = &conn;
+  conn.query_timeout = TDS_BROKER_REQ_TIMEOUT;
+  conn.login_timeout = TDS_BROKER_REQ_TIMEOUT;
+
+  credpool = make_sub_pool(permanent_pool);
+  fdpool = make_sub_pool(permanent_pool);
+
+  fds = (struct pollfd *) pcalloc(fdpool, sizeof(struct pollfd) * nalloc);
+  clients = (broker_client_t *) pcalloc(fdpool,
+    sizeof(broker_client_t) * nalloc);
+  fds[0].fd = listenfd;
+  fds[0].events = POLLIN;
+
+  while (TRUE) {
+    /* wake up in time to drop sessions stalled half way through a
+     * request
+     */
+    now = time(NULL);
+    timeout = -1;
+    for (x = 1; x < nfds; x++) {
+      if (clients[x].pool == NULL)
+        continue;
+
+      wait = clients[x].deadline > now ?
+        (int) (clients[x].deadline - now) * 1000 : 0;
+      if (timeout < 0 || wait < timeout)
+        timeout = wait;
+    }
+
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": broker poll failed: %s",
+        strerror(errno));
+      _exit(1);
+    }
+
+    now = time(NULL);
+    for (x = nfds - 1; x > 0; x--) {
+      if (clients[x].pool && clients[x].deadline <= now) {
+        res = -1;
+
+      } else if (!fds[x].revents) {
+        continue;
+
+      } else if ((fds[x].revents & (POLLERR|POLLHUP|POLLNVAL)) &&
+                 !(fds[x].revents & POLLIN)) {
+        res = -1;
+
+      } else if ((res = _sql_broker_recv(&clients[x], fds[x].fd)) > 0) {
+        res = _sql_broker_serve(&entry, &credpool, &login, &clients[x],
+          fds[x].fd);
+        destroy_pool(clients[x].pool);
+        clients[x].pool = NULL;
+      }
+
+      if (res < 0) {
+        if (clients[x].pool)
+          destroy_pool(clients[x].pool);
+        close(fds[x].fd);
+        fds[x] = fds[--nfds];
+        clients[x] = clients[nfds];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      fd = accept(listenfd, NULL, NULL);
+      if (fd < 0)
+        continue;
+
+      (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+      if (nfds == nalloc) {
+        newfds = (struct pollfd *) pcalloc(fdpool, sizeof(struct pollfd) * nalloc * 2);
+        memcpy(newfds, fds, sizeof(struct pollfd) * nalloc);
+        fds = newfds;
+        newclients = (broker_client_t *) pcalloc(fdpool,
+          sizeof(broker_client_t) * nalloc * 2);
+        memcpy(newclients, clients, sizeof(broker_client_t) * nalloc);
+        clients = newclients;
+        nalloc *= 2;
+      }
+
+      fds[nfds].fd = fd;
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      clients[nfds].pool = NULL;
+      nfds++;
+    }
+  }
+}
+
+/*
+ * _sql_child_reap: notes which of our children, the broker workers and
+ *  the user filter rebuild, have exited.  Only waits for our own, and
+ *  only ever with WNOHANG, so it is safe to call from a signal handler.
+ *  A pid we didn't reap ourselves (ECHILD) is no longer ours to signal
+ *  either way.
+ */
+static void _sql_child_reap(void){
+  int x;
+
+  for (x = 0; x < tds_broker_nworkers; x++) {
+    if (tds_broker_pids[x] > 0 &&
+        waitpid(tds_broker_pids[x], NULL, WNOHANG) != 0)
+      tds_broker_pids[x] = 0;
+  }
+
+  if (tds_filter_pid > 0 && waitpid(tds_filter_pid, NULL, WNOHANG) != 0)
+    tds_filter_pid = 0;
+}
+
+/*
+ * _sql_child_sigchld: SIGCHLD handler in the master.  Reaps dead
+ *  children of ours before the core's handler, which reaps any child at
+ *  all, can get to them, then passes the signal on.
+ */
+static void _sql_child_sigchld(int signo){
+  int saved_errno = errno;
+
+  _sql_child_reap();
+  errno = saved_errno;
+
+  if (tds_child_chld != NULL && tds_child_chld != SIG_DFL &&
+      tds_child_chld != SIG_IGN)
+    tds_child_chld(signo);
+}
+
+/*
+ * _sql_child_hook: installs _sql_child_sigchld in the master, once.
+ */
+static void _sql_child_hook(void){
+  void (*prev)(int) = NULL;
+
+  if (tds_child_hooked)
+    return;
+
+  prev = signal(SIGCHLD, _sql_child_sigchld);
+  if (prev != _sql_child_sigchld)
+    tds_child_chld = prev;
+  tds_child_hooked = TRUE;
+}
+
+/*
+ * _sql_child_unhook: puts back the SIGCHLD handler we chained to,
+ *  unless someone has replaced ours in the meantime.
+ */
+static void _sql_child_unhook(void){
+  void (*cur)(int) = NULL;
+
+  if (!tds_child_hooked)
+    return;
+
+  cur = signal(SIGCHLD, tds_child_chld ? tds_child_chld : SIG_DFL);
+  if (cur != _sql_child_sigchld)
+    signal(SIGCHLD, cur);
+
+  tds_child_chld = NULL;
+  tds_child_hooked = FALSE;
+}
+
+/*
+ * _sql_broker_spawn: forks worker x.
+ *
+ * Returns: 0, or -1 if the fork failed.
+ */
+static int _sql_broker_spawn(int x){
+  pid_t pid;
+
+  pid = fork();
+  if (pid < 0) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": unable to fork broker: %s",
+      strerror(errno));
+    return -1;
+  }
+
+  if (pid == 0) {
+    _sql_broker_worker(tds_broker_listenfd);
+    _exit(0);
+  }
+
+  tds_broker_pids[x] = pid;
+  return 0;
+}
+
+/*
+ * _sql_broker_timer_callback: replaces any workers that have died since
+ *  the last check.  Runs in the master, outside of signal context.
+ */
+static int _sql_broker_timer_callback(CALLBACK_FRAME){
+  sigset_t chld, prev;
+  int x;
+
+  if (getpid() != mpid)
+    return 0;
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &prev);
+
+  _sql_child_reap();
+  for (x = 0; x < tds_broker_nworkers; x++) {
+    if (tds_broker_pids[x] == 0 && _sql_broker_spawn(x) == 0)
+      pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+        ": broker worker %d died, restarted as pid %lu", x,
+        (unsigned long) tds_broker_pids[x]);
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  return 1;
+}
+
+/*
+ * _sql_broker_logins: builds tds_broker_logins from the SQLConnectInfo
+ *  of every server, parsed the way cmd_defineconnection parses it.
+ */
+static void _sql_broker_logins(void){
+  server_rec *s = NULL;
+  config_rec *c = NULL;
+  broker_login_t login, *logins = NULL;
+  char *at = NULL;
+  int x;
+
+  tds_broker_logins = make_array(tds_broker_pool, 4, sizeof(broker_login_t));
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    c = find_config(s->conf, CONF_PARAM, "SQLConnectInfo", FALSE);
+    if (c == NULL || c->argc < 3)
+      continue;
+
+    login.db = pstrdup(tds_broker_pool, c->argv[0]);
+    if ((at = strchr(login.db, '@')) != NULL) {
+      *at = '\0';
+      login.servers = at + 1;
+
+    } else if ((login.servers = getenv("DSQUERY")) == NULL) {
+      continue;
+    }
+
+    login.servers = pstrdup(tds_broker_pool, login.servers);
+    login.user = pstrdup(tds_broker_pool, c->argv[1]);
+    login.pass = pstrdup(tds_broker_pool, c->argv[2]);
+
+    logins = (broker_login_t *) tds_broker_logins->elts;
+    for (x = 0; x < tds_broker_logins->nelts; x++) {
+      if (!strcmp(logins[x].servers, login.servers) &&
+          !strcmp(logins[x].user, login.user) &&
+          !strcmp(logins[x].pass, login.pass) &&
+          !strcmp(logins[x].db, login.db))
+        break;
+    }
+
+    if (x == tds_broker_logins->nelts)
+      *((broker_login_t *) push_array(tds_broker_logins)) = login;
+  }
+}
+
+/*
+ * _sql_broker_start: called in the master once the configuration has been
+ *  parsed.  Opens the broker socket and forks the worker pool.
+ */
+static void _sql_broker_start(void){
+  config_rec *c = NULL;
+  struct sockaddr_un sun;
+  char *path = NULL;
+  int nworkers = 0, x;
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSBroker", FALSE);
+  if (c == NULL)
+    return;
+
+  if (ServerType == SERVER_INETD) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+      ": SQLTDSBroker is not supported in inetd mode, ignoring");
+    return;
+  }
+
+  path = c->argv[0];
+  nworkers = *((int *) c->argv[1]);
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": broker socket path '%s' too long",
+      path);
+    return;
+  }
+  sstrncpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+  tds_broker_pool = make_sub_pool(permanent_pool);
+  _sql_broker_logins();
+  if (tds_broker_logins->nelts == 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+      ": no SQLConnectInfo for SQLTDSBroker to use, ignoring");
+    destroy_pool(tds_broker_pool);
+    tds_broker_pool = NULL;
+    tds_broker_logins = NULL;
+    return;
+  }
+
+  (void) unlink(path);
+
+  tds_broker_listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (tds_broker_listenfd < 0 ||
+      bind(tds_broker_listenfd, (struct sockaddr *) &sun, sizeof(sun)) < 0 ||
+      listen(tds_broker_listenfd, 128) < 0) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION ": unable to listen on '%s': %s",
+      path, strerror(errno));
+    if (tds_broker_listenfd >= 0)
+      close(tds_broker_listenfd);
+    tds_broker_listenfd = -1;
+    return;
+  }
+
+  /* sessions connect as the daemon's User, before logging anyone in; no
+   * one else may
+   */
+  if (chown(path, daemon_uid, daemon_gid) < 0 || chmod(path, 0600) < 0) {
+    pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION
+      ": unable to restrict access to '%s': %s", path, strerror(errno));
+    close(tds_broker_listenfd);
+    tds_broker_listenfd = -1;
+    (void) unlink(path);
+    return;
+  }
+  (void) fcntl(tds_broker_listenfd, F_SETFD, FD_CLOEXEC);
+
+  _sql_child_hook();
+
+  for (x = 0; x < nworkers; x++) {
+    tds_broker_pids[x] = 0;
+    tds_broker_nworkers++;
+    if (_sql_broker_spawn(x) < 0)
+      break;
+  }
+
+  tds_broker_timerno = pr_timer_add(TDS_BROKER_CHECK_SECS, -1,
+    &sql_tds_module, _sql_broker_timer_callback, "TDS broker workers");
+
+  pr_log_pri(PR_LOG_INFO, MOD_SQL_TDS_VERSION ": started %d broker workers on '%s'",
+    tds_broker_nworkers, path);
+}
+
+/*
+ * _sql_broker_stop: called in the master on shutdown and restart.  Only
+ *  workers not yet reaped are signalled, so a pid that has since been
+ *  reused is never touched.
+ */
+static void _sql_broker_stop(void){
+  sigset_t chld, prev;
+  pid_t pid;
+  int x;
+
+  if (tds_broker_timerno > 0) {
+    pr_timer_remove(tds_broker_timerno, &sql_tds_module);
+    tds_broker_timerno = -1;
+  }
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &prev);
+
+  _sql_child_reap();
+  for (x = 0; x < tds_broker_nworkers; x++) {
+    if ((pid = tds_broker_pids[x]) > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      tds_broker_pids[x] = 0;
+    }
+  }
+  tds_broker_nworkers = 0;
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+
+  if (tds_broker_listenfd >= 0) {
+    close(tds_broker_listenfd);
+    tds_broker_listenfd = -1;
+  }
+
+  if (tds_broker_pool) {
+    destroy_pool(tds_broker_pool);
+    tds_broker_pool = NULL;
+    tds_broker_logins = NULL;
+  }
+}
+
+/*
+ * _sql_broker_connect: session side.  Opens the session's connection to
+ *  the broker if it isn't open already.
+ */
+static int _sql_broker_connect(void){
+  struct sockaddr_un sun;
+
+  if (tds_broker_fd >= 0)
+    return 0;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  sstrncpy(sun.sun_path, tds_broker_path, sizeof(sun.sun_path));
+
+  tds_broker_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (tds_broker_fd < 0)
+    return -1;
+
+  if (connect(tds_broker_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+    sql_log(DEBUG_WARN, "unable to connect to broker '%s': %s", tds_broker_path,
+      strerror(errno));
+    close(tds_broker_fd);
+    tds_broker_fd = -1;
+    return -1;
+  }
+
+  (void) fcntl(tds_broker_fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+/*
+ * _sql_broker_call: session side.  Sends a statement to the broker and
+ *  turns its reply into a modret_t.
+ *
+ * Returns: NULL if the broker could not be reached, or doesn't know the
+ *  connection's login, in which case the caller should fall back to its
+ *  own connection.
+ */
+static modret_t *_sql_broker_call(cmd_rec *cmd, db_conn_t *conn,
+    unsigned char op, const char *query){
+  char *buf = NULL, *ptr = NULL, *end = NULL, *payload = NULL;
+  char hdr[1 + sizeof(uint32_t)];
+  size_t len = 0;
+  uint32_t magic = htonl(TDS_BROKER_MAGIC), plen = 0, rnum = 0, fnum = 0;
+  sql_data_t *sd = NULL;
+  unsigned long cnt = 0, x;
+  int attempt, login;
+
+  if ((login = _sql_broker_login(conn)) < 0)
+    return NULL;
+
+  len = sizeof(uint32_t) + strlen(query) + 1;
+  buf = (char *) palloc(cmd->tmp_pool, TDS_BROKER_REQ_HDRLEN + len);
+  memcpy(buf, &magic, sizeof(uint32_t));
+  buf[sizeof(uint32_t)] = (char) op;
+  ptr = _sql_broker_put_u32(buf + sizeof(uint32_t) + 1, (uint32_t) login);
+  ptr = _sql_broker_put_u32(ptr, (uint32_t) len);
+  ptr = _sql_broker_put_str(ptr, query, strlen(query));
+
+  /* a broker worker may have been restarted; try a fresh socket once */
+  for (attempt = 0; attempt < 2; attempt++) {
+    if (_sql_broker_connect() < 0)
+      return NULL;
+
+    if (_sql_broker_io(tds_broker_fd, buf, ptr - buf, TRUE) == 0 &&
+        (payload = _sql_broker_read_frame(cmd->tmp_pool, tds_broker_fd, hdr,
+          sizeof(hdr), &plen)) != NULL)
+      break;
+
+    close(tds_broker_fd);
+    tds_broker_fd = -1;
+
+    /* never resend a write that may already have been executed */
+    if (op == TDS_BROKER_OP_EXEC)
+      return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "lost connection to broker");
+  }
+
+  if (payload == NULL)
+    return NULL;
+
+  ptr = payload;
+  end = payload + plen;
+
+  switch ((unsigned char) hdr[0]) {
+    case TDS_BROKER_OK:
+      return PR_HANDLED(cmd);
+
+    case TDS_BROKER_DATA:
+      if (_sql_broker_get_u32(&ptr, end, &rnum) < 0 ||
+          _sql_broker_get_u32(&ptr, end, &fnum) < 0)
+        break;
+
+      sd = (sql_data_t *) pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+      sd->rnum = rnum;
+      sd->fnum = fnum;
+      cnt = (unsigned long) rnum * fnum;
+      if (cnt > plen)
+        break;
+
+      sd->data = (char **) palloc(cmd->tmp_pool, sizeof(char *) * (cnt + 1));
+      for (x = 0; x < cnt; x++) {
+        if (!(sd->data[x] = _sql_broker_get_str(&ptr, end)))
+          break;
+      }
+      if (x < cnt)
+        break;
+      sd->data[cnt] = NULL;
+
+      return mod_create_data(cmd, (void *) sd);
+
+    case TDS_BROKER_ERROR:
+      if ((ptr = _sql_broker_get_str(&ptr, end)) != NULL)
+        return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, ptr);
+      break;
+  }
+
+  return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "malformed reply from broker");
+}
+
+/*
+ * _sql_broker_route: for a connection opened in broker mode (so without a
+ *  DBPROCESS of its own), sends the statement to the broker.  If the
+ *  broker can't be reached, a direct connection is opened instead.
+ *
+ * Returns: the broker's result, an error if neither path works, or NULL
+ *  if the caller should run the statement on conn->dbproc itself.
+ */
+static modret_t *_sql_broker_route(cmd_rec *cmd, conn_entry_t *entry,
+    unsigned char op, const char *query){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  modret_t *mr = NULL;
+
+  if (conn->dbproc)
+    return NULL;
+
+  if (tds_broker_path &&
+      (mr = _sql_broker_call(cmd, conn, op, query)) != NULL) {
+    _sql_trace_mark("broker");
+    return mr;
+  }
+
+  sql_log(DEBUG_WARN, "%s", "broker unavailable, using a direct connection");
+  if (_sql_tds_connect(entry) < 0)
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "unable to connect to database");
+
+  return NULL;
+}
+
+/*
+ * _sql_wb_each: runs queued statements one at a time, so that one
+ *  statement's failure can't take any other with it.
+ */
+static void _sql_wb_each(cmd_rec *cmd, conn_entry_t *entry, char **stmts,
+    unsigned int nstmts){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  modret_t *mr = NULL;
+  unsigned int x;
+  RETCODE ret;
+
+  for (x = 0; x < nstmts; x++) {
+    if ((mr = _sql_broker_route(cmd, entry, TDS_BROKER_OP_EXEC,
+        stmts[x])) != NULL) {
+      if (MODRET_ERROR(mr))
+        sql_log(DEBUG_WARN, "queued statement %u of %u failed: \"%s\"",
+          x + 1, nstmts, stmts[x]);
+      continue;
+    }
+
+    if (_sql_tds_exec(entry, stmts[x], FALSE) != SUCCEED) {
+      sql_log(DEBUG_WARN, "queued statement %u of %u failed: \"%s\"",
+        x + 1, nstmts, stmts[x]);
+      if (conn->dbproc && !dbdead(conn->dbproc))
+        dbcancel(conn->dbproc);
+      continue;
+    }
+
+    while (!dbdead(conn->dbproc) &&
+           (ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS) {
+      if (ret == FAIL) {
+        sql_log(DEBUG_WARN, "queued statement %u of %u failed: \"%s\"",
+          x + 1, nstmts, stmts[x]);
+        break;
+      }
+      dbcanquery(conn->dbproc);
+    }
+  }
+}
+
+/*
+ * _sql_wb_flush: sends every statement queued on a named connection as
+ *  a single batch.  A batch the server refuses to compile runs none of
+ *  its statements, so they are then sent one at a time; any other error
+ *  belongs to one statement, and the rest of the batch still runs.
+ *  Statements going through the broker are always sent one at a time,
+ *  since its one error reply can't tell a refused batch from a partly
+ *  applied one.  Failures can no longer be returned
+ *  to mod_sql, so each failed statement is logged instead.
+ */
+static void _sql_wb_flush(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  cmd_rec *cmd = NULL;
+  char **stmts = NULL;
+  char *batch = NULL, *ptr = NULL;
+  unsigned int nstmts = 0, x = 0;
+  size_t len = 0;
+  RETCODE ret;
+
+  if (entry->wb_queue == NULL || entry->wb_queue->nelts == 0)
+    return;
+
+  if (entry->wb_timer) {
+    pr_timer_remove(entry->wb_timer, &sql_tds_module);
+    entry->wb_timer = 0;
+  }
+
+  stmts = (char **) entry->wb_queue->elts;
+  nstmts = entry->wb_queue->nelts;
+
+  cmd = _sql_make_cmd(entry->wb_pool, 1, entry->name);
+
+  batch = ptr = (char *) palloc(cmd->tmp_pool, entry->wb_bytes + nstmts + 1);
+  for (x = 0; x < nstmts; x++) {
+    len = strlen(stmts[x]);
+    memcpy(ptr, stmts[x], len);
+    ptr += len;
+    *ptr++ = '\n';
+  }
+  *ptr = '\0';
+
+  sql_log(DEBUG_INFO, "connection '%s' - flushing %u queued statements",
+    entry->name, nstmts);
+
+  if (_sql_tds_open(cmd, entry) != NULL) {
+    for (x = 0; x < nstmts; x++)
+      sql_log(DEBUG_WARN, "unable to connect, dropping queued statement \"%s\"",
+        stmts[x]);
+
+  } else if (conn->dbproc == NULL) {
+    _sql_wb_each(cmd, entry, stmts, nstmts);
+    _sql_tds_close(entry, FALSE);
+
+  } else {
+    /* the server carries on after most statement errors, and reports
+     * each statement's outcome in turn; dbsqlexec() failing only says
+     * the first one failed, unless the whole batch was refused.
+     */
+    x = 0;
+    if (_sql_tds_exec(entry, batch, FALSE) != SUCCEED) {
+      if (dbdead(conn->dbproc)) {
+        for (x = 0; x < nstmts; x++)
+          sql_log(DEBUG_WARN, "connection lost, queued statement may not "
+            "have run: \"%s\"", stmts[x]);
+
+      } else if (_sql_tds_refused(conn->msgno)) {
+        sql_log(DEBUG_WARN, "queued batch of %u statements refused (%ld), "
+          "sending them one at a time", nstmts, (long) conn->msgno);
+        dbcancel(conn->dbproc);
+        _sql_wb_each(cmd, entry, stmts, nstmts);
+        x = nstmts;
+
+      } else {
+        sql_log(DEBUG_WARN, "queued statement 1 of %u failed: \"%s\"",
+          nstmts, stmts[0]);
+        x = 1;
+      }
+    }
+
+    while (x < nstmts && !dbdead(conn->dbproc) &&
+           (ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS) {
+      if (ret == FAIL)
+        sql_log(DEBUG_WARN, "queued statement %u of %u failed: \"%s\"",
+          x + 1, nstmts, stmts[x]);
+      else
+        dbcanquery(conn->dbproc);
+      x++;
+    }
+
+    for (; x < nstmts; x++)
+      sql_log(DEBUG_WARN, "no outcome reported, queued statement may not "
+        "have run: \"%s\"", stmts[x]);
+
+    _sql_tds_close(entry, FALSE);
+  }
+
+  destroy_pool(entry->wb_pool);
+  entry->wb_pool = NULL;
+  entry->wb_queue = NULL;
+  entry->wb_bytes = 0;
+}
+
+/*
+ * _sql_wb_timer_callback: flushes a connection's write-behind queue once
+ *  its oldest statement has waited long enough.
+ */
+static int _sql_wb_timer_callback(CALLBACK_FRAME){
+  conn_entry_t *entry = NULL;
+  int cnt = 0;
+
+  for (cnt=0; cnt < conn_cache->nelts; cnt++) {
+    entry = ((conn_entry_t **) conn_cache->elts)[cnt];
+
+    if (entry->wb_timer == p2) {
+      entry->wb_timer = 0;
+      _sql_wb_flush(entry);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_wb_name: finds the table name at the start of str, without its
+ *  schema or [] quoting.
+ *
+ * Returns: the start of the name, with its length in *len.
+ */
+static const char *_sql_wb_name(const char *str, size_t *len){
+  const char *start = NULL, *end = NULL;
+
+  for (end = str; isspace((int) *end); end++);
+  start = end;
+  while (*end && !isspace((int) *end) && *end != '(' && *end != ',') {
+    if (*end == '.')
+      start = end + 1;
+    end++;
+  }
+
+  if (*start == '[')
+    start++;
+  if (end > start && end[-1] == ']')
+    end--;
+
+  *len = end - start;
+  return start;
+}
+
+/*
+ * _sql_wb_wanted: whether a write to table, the start of the text that
+ *  follows INSERT INTO or UPDATE, is to be queued: whether the table is
+ *  one of the connection's SQLTDSWriteBehind tables.
+ */
+static int _sql_wb_wanted(conn_entry_t *entry, const char *table){
+  const char *name = NULL, *want = NULL;
+  size_t len = 0, wantlen = 0;
+
+  if (entry->wb_max_count == 0 || entry->wb_tables == NULL)
+    return FALSE;
+
+  name = _sql_wb_name(table, &len);
+  for (want = entry->wb_tables; *want; want++) {
+    want = _sql_wb_name(want, &wantlen);
+    if (wantlen == len && len > 0 && strncasecmp(want, name, len) == 0)
+      return TRUE;
+
+    want = strchr(want, ',');
+    if (want == NULL)
+      break;
+  }
+
+  return FALSE;
+}
+
+/*
+ * _sql_wb_skip_into: skips the INTO of a free-form INSERT's text.
+ */
+static const char *_sql_wb_skip_into(const char *str){
+  while (isspace((int) *str)) str++;
+
+  if (strncasecmp(str, "INTO", 4) == 0 && isspace((int) str[4]))
+    str += 4;
+
+  return str;
+}
+
+/*
+ * _sql_wb_queue: queues a write on a named connection, flushing the queue
+ *  when it reaches its statement or byte limit.  The first statement
+ *  queued starts the flush timer, if there is one.
+ */
+static void _sql_wb_queue(conn_entry_t *entry, const char *query){
+  if (entry->wb_queue == NULL) {
+    entry->wb_pool = make_sub_pool(conn_pool);
+    entry->wb_queue = make_array(entry->wb_pool, entry->wb_max_count,
+      sizeof(char *));
+    entry->wb_bytes = 0;
+
+    if (entry->wb_interval > 0) {
+      entry->wb_timer = pr_timer_add(entry->wb_interval, -1, &sql_tds_module,
+        _sql_wb_timer_callback, "TDS write-behind flush");
+    }
+  }
+
+  *((char **) push_array(entry->wb_queue)) = pstrdup(entry->wb_pool, query);
+  entry->wb_bytes += strlen(query);
+
+  if (entry->wb_queue->nelts >= entry->wb_max_count ||
+      (entry->wb_max_bytes > 0 && entry->wb_bytes >= entry->wb_max_bytes)) {
+    _sql_wb_flush(entry);
+  }
+}
+
+/*
+ * _sql_bcp_ident: strips whitespace and [] or "" quoting from a column
+ *  name, in place.
+ */
+static char *_sql_bcp_ident(char *name){
+  char *end = NULL;
+
+  while (isspace((int) *name))
+    name++;
+
+  end = name + strlen(name);
+  while (end > name && isspace((int) end[-1]))
+    *--end = '\0';
+
+  if (end - name >= 2 &&
+      ((*name == '[' && end[-1] == ']') || (*name == '"' && end[-1] == '"'))) {
+    end[-1] = '\0';
+    name++;
+  }
+
+  return name;
+}
+
+/*
+ * _sql_bcp_values: splits the text of a VALUES list into nvals literal
+ *  values.  Only quoted strings, numbers and NULL can be bulk copied;
+ *  anything else (functions, expressions, variables) has to go through
+ *  the server's parser.  Empty strings are refused as well, since bulk
+ *  copy cannot tell a zero-length value from NULL.
+ *
+ * Returns: 0 on success, with vals[] pointing into pool (NULL for NULL),
+ *  or -1 if the row cannot be bulk copied.
+ */
+static int _sql_bcp_values(pool *p, const char *str, unsigned int nvals,
+    char **vals, DBINT *lens){
+  const char *ptr = str;
+  char *out = NULL;
+  unsigned int n = 0;
+  size_t len = 0;
+
+  for (n = 0; n < nvals; n++) {
+    while (isspace((int) *ptr))
+      ptr++;
+
+    if (*ptr == 'N' && ptr[1] == '\'')
+      ptr++;
+
+    if (*ptr == '\'') {
+      out = vals[n] = palloc(p, strlen(ptr));
+      len = 0;
+
+      for (ptr++; *ptr; ptr++) {
+        if (*ptr == '\'') {
+          if (ptr[1] != '\'')
+            break;
+          ptr++;
+        }
+        out[len++] = *ptr;
+      }
+
+      if (*ptr++ != '\'' || len == 0)
+        return -1;
+
+      out[len] = '\0';
+      lens[n] = (DBINT) len;
+
+    } else if (strncasecmp(ptr, "NULL", 4) == 0 && !isalnum((int) ptr[4])) {
+      vals[n] = NULL;
+      lens[n] = 0;
+      ptr += 4;
+
+    } else {
+      len = strspn(ptr, "+-0123456789.eE");
+      if (len == 0 || !isdigit((int) ptr[len - 1]))
+        return -1;
+
+      vals[n] = pstrndup(p, ptr, len);
+      lens[n] = (DBINT) len;
+      ptr += len;
+    }
+
+    while (isspace((int) *ptr))
+      ptr++;
+
+    if (*ptr != (n + 1 < nvals ? ',' : '\0'))
+      return -1;
+    ptr++;
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_bcp_commit: commits the rows sent since the last batch.
+ */
+static void _sql_bcp_commit(conn_entry_t *entry){
+  DBINT n = 0;
+
+  if (entry->bcp_timer) {
+    pr_timer_remove(entry->bcp_timer, &sql_tds_module);
+    entry->bcp_timer = 0;
+  }
+
+  if (entry->bcp_dbproc == NULL || entry->bcp_rows == 0)
+    return;
+
+  n = bcp_batch(entry->bcp_dbproc);
+  if (n < 0)
+    sql_log(DEBUG_WARN, "bulk copy into '%s' failed, %u rows lost",
+      entry->bcp_table, entry->bcp_rows);
+  else
+    sql_log(DEBUG_INFO, "bulk copy into '%s' committed %ld rows",
+      entry->bcp_table, (long) n);
+
+  entry->bcp_rows = 0;
+}
+
+/*
+ * _sql_bcp_done: commits any open batch and closes the bulk copy
+ *  connection.
+ */
+static void _sql_bcp_done(conn_entry_t *entry){
+  DBINT n = 0;
+
+  if (entry->bcp_timer) {
+    pr_timer_remove(entry->bcp_timer, &sql_tds_module);
+    entry->bcp_timer = 0;
+  }
+
+  if (entry->bcp_dbproc == NULL)
+    return;
+
+  n = bcp_done(entry->bcp_dbproc);
+  if (n < 0 && entry->bcp_rows > 0)
+    sql_log(DEBUG_WARN, "bulk copy into '%s' failed, %u rows lost",
+      entry->bcp_table, entry->bcp_rows);
+
+  dbclose(entry->bcp_dbproc);
+  destroy_pool(entry->bcp_pool);
+
+  entry->bcp_dbproc = NULL;
+  entry->bcp_pool = NULL;
+  entry->bcp_cols = NULL;
+  entry->bcp_ordinals = NULL;
+  entry->bcp_rows = 0;
+}
+
+/*
+ * _sql_bcp_timer_callback: commits a bulk copy batch that has been open
+ *  for SQLTDSBulkCopy's seconds, so a quiet session does not hold its
+ *  rows (and their locks) until it ends.
+ */
+static int _sql_bcp_timer_callback(CALLBACK_FRAME){
+  conn_entry_t *entry = NULL;
+  int cnt = 0;
+
+  for (cnt=0; cnt < conn_cache->nelts; cnt++) {
+    entry = ((conn_entry_t **) conn_cache->elts)[cnt];
+
+    if (entry->bcp_timer == p2) {
+      entry->bcp_timer = 0;
+      _sql_bcp_commit(entry);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_bcp_start: opens a bulk copy connection for the named connection's
+ *  table and binds the columns of an INSERT column list to it.  Table
+ *  columns the list does not name are sent as NULL, so the server
+ *  applies their defaults.
+ *
+ * Returns: 0 on success, -1 if bulk copy cannot be used.
+ */
+static int _sql_bcp_start(conn_entry_t *entry, const char *cols){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  array_header *tablecols = NULL;
+  char *names = NULL, *name = NULL, *next = NULL, *query = NULL;
+  int ncols = 0, ord = 0;
+
+  entry->bcp_pool = make_sub_pool(conn_pool);
+
+  entry->bcp_dbproc = _sql_tds_login(conn, TRUE);
+  if (entry->bcp_dbproc == NULL) {
+    destroy_pool(entry->bcp_pool);
+    entry->bcp_pool = NULL;
+    return -1;
+  }
+
+  /* bcp_bind wants table ordinals, so learn the table's column order
+   * from an empty result set first.
+   */
+  query = pstrcat(entry->bcp_pool, "SELECT * FROM ", entry->bcp_table,
+    " WHERE 1 = 0", NULL);
+
+  if (dbcmd(entry->bcp_dbproc, query) == FAIL ||
+      dbsqlexec(entry->bcp_dbproc) == FAIL ||
+      dbresults(entry->bcp_dbproc) != SUCCEED) {
+    sql_log(DEBUG_WARN, "unable to read the columns of '%s'", entry->bcp_table);
+    _sql_bcp_done(entry);
+    return -1;
+  }
+
+  ncols = dbnumcols(entry->bcp_dbproc);
+  tablecols = make_array(entry->bcp_pool, ncols, sizeof(char *));
+  for (ord = 1; ord <= ncols; ord++)
+    *((char **) push_array(tablecols)) = pstrdup(entry->bcp_pool,
+      dbcolname(entry->bcp_dbproc, ord));
+
+  dbcanquery(entry->bcp_dbproc);
+  while (dbresults(entry->bcp_dbproc) == SUCCEED)
+    dbcanquery(entry->bcp_dbproc);
+
+  if (bcp_init(entry->bcp_dbproc, entry->bcp_table, NULL, NULL, DB_IN) == FAIL) {
+    sql_log(DEBUG_WARN, "server refused bulk copy into '%s'", entry->bcp_table);
+    _sql_bcp_done(entry);
+    return -1;
+  }
+
+  entry->bcp_cols = pstrdup(entry->bcp_pool, cols);
+  entry->bcp_ordinals = make_array(entry->bcp_pool, ncols, sizeof(int));
+
+  names = pstrdup(entry->bcp_pool, cols);
+  for (name = names; name; name = next) {
+    if ((next = strchr(name, ',')) != NULL)
+      *next++ = '\0';
+    name = _sql_bcp_ident(name);
+
+    for (ord = 0; ord < ncols; ord++) {
+      if (strcasecmp(name, ((char **) tablecols->elts)[ord]) == 0)
+        break;
+    }
+
+    if (ord == ncols) {
+      sql_log(DEBUG_WARN, "'%s' has no column '%s'", entry->bcp_table, name);
+      _sql_bcp_done(entry);
+      return -1;
+    }
+
+    /* the data pointer and length are set per row by _sql_bcp_insert */
+    if (bcp_bind(entry->bcp_dbproc, (BYTE *) "", 0, 0, NULL, 0, SYBCHAR,
+        ord + 1) == FAIL) {
+      _sql_bcp_done(entry);
+      return -1;
+    }
+
+    *((int *) push_array(entry->bcp_ordinals)) = ord + 1;
+  }
+
+  sql_log(DEBUG_INFO, "bulk copying into '%s' (%s)", entry->bcp_table, cols);
+  return 0;
+}
+
+/*
+ * _sql_bcp_insert: sends an INSERT's row to the named connection's bulk
+ *  copy table, if it is one.  Rows are committed every SQLTDSBulkCopy
+ *  rows, and when the batch timer fires or the session ends.
+ *
+ * Returns: 0 if the row was sent, or -1 if the caller should run the
+ *  INSERT itself.
+ */
+static int _sql_bcp_insert(pool *p, conn_entry_t *entry, const char *table,
+    const char *cols, const char *values){
+  char **vals = NULL;
+  DBINT *lens = NULL;
+  int *ords = NULL;
+  unsigned int nvals = 0, x = 0;
+
+  /* brokered sessions hold no connections of their own */
+  if (entry->bcp_table == NULL || entry->bcp_disabled || tds_broker_fd >= 0)
+    return -1;
+
+  if (strcasecmp(_sql_bcp_ident(pstrdup(p, table)), entry->bcp_table) != 0)
+    return -1;
+
+  if (entry->bcp_dbproc && strcmp(cols, entry->bcp_cols) != 0) {
+    /* a different column list needs a fresh binding */
+    _sql_bcp_done(entry);
+  }
+
+  if (entry->bcp_dbproc == NULL && _sql_bcp_start(entry, cols) < 0) {
+    sql_log(DEBUG_WARN, "bulk copy into '%s' unavailable, using INSERT",
+      entry->bcp_table);
+    entry->bcp_disabled = TRUE;
+    return -1;
+  }
+
+  nvals = entry->bcp_ordinals->nelts;
+  ords = (int *) entry->bcp_ordinals->elts;
+  vals = (char **) palloc(p, nvals * sizeof(char *));
+  lens = (DBINT *) palloc(p, nvals * sizeof(DBINT));
+
+  if (_sql_bcp_values(p, values, nvals, vals, lens) < 0)
+    return -1;
+
+  for (x = 0; x < nvals; x++) {
+    bcp_colptr(entry->bcp_dbproc, (BYTE *) (vals[x] ? vals[x] : ""), ords[x]);
+    bcp_collen(entry->bcp_dbproc, lens[x], ords[x]);
+  }
+
+  if (bcp_sendrow(entry->bcp_dbproc) == FAIL) {
+    sql_log(DEBUG_WARN, "bulk copy of row into '%s' failed, using INSERT",
+      entry->bcp_table);
+
+    if (dbdead(entry->bcp_dbproc))
+      _sql_bcp_done(entry);
+    return -1;
+  }
+
+  if (entry->bcp_rows++ == 0 && entry->bcp_interval > 0) {
+    entry->bcp_timer = pr_timer_add(entry->bcp_interval, -1, &sql_tds_module,
+      _sql_bcp_timer_callback, "TDS bulk copy batch");
+  }
+
+  if (entry->bcp_rows >= entry->bcp_batch)
+    _sql_bcp_commit(entry);
+
+  return 0;
+}
+
+/*
+ * _sql_tds_drain: reads the results of a statement sent by _sql_tds_send,
+ *  logging any errors, and releases the connection reference it held.
+ */
+static void _sql_tds_drain(conn_entry_t *entry){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  RETCODE ret;
+
+  if (entry->defer_query == NULL)
+    return;
+
+  if (entry->defer_timer) {
+    pr_timer_remove(entry->defer_timer, &sql_tds_module);
+    entry->defer_timer = 0;
+  }
+
+  ret = (conn->dbproc && dbsqlok(conn->dbproc) == SUCCEED) ? SUCCEED : FAIL;
+  while (ret != FAIL && (ret = dbresults(conn->dbproc)) == SUCCEED)
+    dbcanquery(conn->dbproc);
+
+  if (ret == FAIL) {
+    sql_log(DEBUG_WARN, "deferred statement failed: \"%s\"",
+      entry->defer_query);
+
+    if (conn->dbproc && !dbdead(conn->dbproc))
+      dbcancel(conn->dbproc);
+  }
+
+  destroy_pool(entry->defer_pool);
+  entry->defer_pool = NULL;
+  entry->defer_query = NULL;
+
+  _sql_tds_close(entry, FALSE);
+}
+
+/*
+ * _sql_tds_drain_timer_callback: drains deferred results once the session
+ *  has been idle for SQLTDSDeferResults' seconds.
+ */
+static int _sql_tds_drain_timer_callback(CALLBACK_FRAME){
+  conn_entry_t *entry = NULL;
+  int cnt = 0;
+
+  for (cnt=0; cnt < conn_cache->nelts; cnt++) {
+    entry = ((conn_entry_t **) conn_cache->elts)[cnt];
+
+    if (entry->defer_timer == p2) {
+      entry->defer_timer = 0;
+      _sql_tds_drain(entry);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * _sql_tds_send: sends a write on a connection with SQLTDSDeferResults
+ *  set without waiting for the server to answer.  The caller's reference
+ *  to the open connection is kept until the results are drained, which
+ *  happens before the connection is next used, when it is closed, or
+ *  when the drain timer fires.
+ *
+ * Returns: NULL if the caller should run the statement itself, otherwise
+ *  the modret_t to return.
+ */
+static modret_t *_sql_tds_send(cmd_rec *cmd, conn_entry_t *entry,
+    const char *query){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+  modret_t *mr = NULL;
+
+  if (!entry->defer || conn->dbproc == NULL)
+    return NULL;
+
+  if (_sql_tds_arm(conn) < 0 ||
+      dbcmd(conn->dbproc, query) == FAIL || dbsqlsend(conn->dbproc) == FAIL) {
+    mr = _build_error(cmd, conn);
+
+    _sql_tds_close(entry, FALSE);
+    return mr;
+  }
+
+  entry->defer_pool = make_sub_pool(conn_pool);
+  entry->defer_query = pstrdup(entry->defer_pool, query);
+
+  if (entry->defer_interval > 0) {
+    entry->defer_timer = pr_timer_add(entry->defer_interval, -1,
+      &sql_tds_module, _sql_tds_drain_timer_callback, "TDS deferred results");
+  }
+
+  return PR_HANDLED(cmd);
+}
+
+/*
+ * _sql_tds_open: does the work of cmd_open for callers that already hold
+ *  the connection entry, so the handlers don't build a cmd_rec and search
+ *  the cache a second time just to open the connection they looked up.
+ *
+ * Returns: NULL on success, or a properly filled error modret_t.
+ */
+static modret_t *_sql_tds_open(cmd_rec *cmd, conn_entry_t *entry){
+  int brokered = FALSE;
+
+  /* results still owed by the last deferred statement come first */
+  _sql_tds_drain(entry);
+
+  /* if we're already open (connections > 0) make sure the connection is
+   * still usable, increment connections, reset our timer if we have one,
+   * and return HANDLED 
+   */
+  /* in broker mode there is no login of our own to do */
+  brokered = (tds_broker_path &&
+    _sql_broker_login((db_conn_t *) entry->data) >= 0 &&
+    _sql_broker_connect() == 0);
+
+  if (entry->connections > 0){ 
+    if (!brokered && !_sql_tds_alive(entry) && _sql_tds_reconnect(entry) < 0) {
+      sql_log(DEBUG_INFO, "connection '%s' - reconnect failed", entry->name);
+      return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "unable to reconnect to database");
+    }
+
+    entry->connections++;
+    if (entry->timer) {
+      pr_timer_reset( entry->timer, &sql_tds_module );
+    }
+    sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
+    return NULL;
+  }
+
+  if (!brokered && _sql_tds_connect(entry) < 0) {
+    sql_log(DEBUG_INFO, "connection '%s' - connect failed", entry->name);
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "unable to connect to database");
+  }
+
+  /* bump connections */
+  entry->connections++;
+
+  if(pr_sql_conn_policy == SQL_CONN_POLICY_PERSESSION){
+    if (entry->connections == 1){
+      /*if this is our first connection, bump again to make sure the connection
+       * stays open after first use,  see bug #3290) 
+       */
+      entry->connections++;
+    }
+  }else if (entry->ttl > 0) {
     /* set up our timer if necessary */
     entry->timer = pr_timer_add(entry->ttl, -1,
         &sql_tds_module, 
@@ -419,11 +5300,92 @@ MODRET cmd_open(cmd_rec *cmd){
     entry->connections++;
   }
 
-  /* return HANDLED */
-
   sql_log(DEBUG_INFO, "connection '%s' opened count is now %d", entry->name, entry->connections);
-  sql_log(DEBUG_FUNC, "%s", " <<< tds cmd_open");
-  return PR_HANDLED(cmd);
+  return NULL;
+}
+
+/*
+ * _sql_tds_close: does the work of cmd_close for callers that already hold
+ *  the connection entry.  If force is set the connection is closed and the
+ *  count reset to 0 regardless of how many users it has.
+ */
+static void _sql_tds_close(conn_entry_t *entry, int force){
+  db_conn_t *conn = (db_conn_t *) entry->data;
+
+  /* don't throw away results we still owe the log */
+  if (force)
+    _sql_tds_drain(entry);
+
+  /* if we're closed already (connections == 0) there's nothing to do */
+  if (entry->connections == 0) {
+    sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
+    return;
+  }
+
+  /* decrement connections. If our count is 0 or we were asked to force it
+   * close the connection, explicitly set the counter to 0, and remove any
+   * timers.
+   */
+  if (((--entry->connections) == 0 ) || force) {
+    /* need to close connection here */
+    if (conn->dbproc) {
+      dbclose(conn->dbproc);
+      conn->dbproc = NULL;
+    }
+    entry->connections = 0;
+
+    if (entry->timer) {
+      pr_timer_remove( entry->timer, &sql_tds_module );
+      entry->timer = 0;
+      sql_log(DEBUG_INFO, "connection '%s' - timer stopped",
+          entry->name );
+    }
+
+    sql_log(DEBUG_INFO, "connection '%s' closed", entry->name);
+  }
+
+  sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
+  _sql_trace_mark("close");
+}
+
+/*
+ * cmd_open: attempts to open a named connection to the database.
+ *
+ * Inputs:
+ *  cmd->argv[0]: connection name
+ *
+ * Returns:
+ *  either a properly filled error modret_t if a connection could not be
+ *  opened, or a simple non-error modret_t.
+ *
+ * Notes:
+ *  an already open connection is checked with _sql_tds_alive first, and
+ *  transparently reopened if it has died.
+ */
+MODRET cmd_open(cmd_rec *cmd){
+  conn_entry_t *entry = NULL;
+  modret_t *mr = NULL;
+
+  sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_open");
+
+  _sql_check_cmd(cmd, "cmd_open" );
+
+  if (cmd->argc < 1) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open with argc < 1");
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");
+  }
+
+  /* get the named connection */
+
+  if (!(entry = _sql_get_connection( cmd->argv[0]))) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open");
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "Unknown Named Connection");
+  }
+
+  mr = _sql_tds_open(cmd, entry);
+
+  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_open");
+  return mr ? mr : PR_HANDLED(cmd);
 }
 
 /*
@@ -445,7 +5407,6 @@ MODRET cmd_open(cmd_rec *cmd){
  */
 MODRET cmd_close(cmd_rec *cmd){
   conn_entry_t *entry = NULL;
-  db_conn_t *conn = NULL;
 
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_close");
 
@@ -462,39 +5423,9 @@ MODRET cmd_close(cmd_rec *cmd){
     return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "Unknown Named Connection");
   }
 
-  conn = (db_conn_t *) entry->data;
-
-  /* if we're closed already (connections == 0) return HANDLED */
-  if (entry->connections == 0) {
-    sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_close - connections = 0");
-
-    return PR_HANDLED(cmd);
-  }
-
-  /* decrement connections. If our count is 0 or we received a second arg
-   * close the connection, explicitly set the counter to 0, and remove any
-   * timers.
-   */
-  if (((--entry->connections) == 0 ) || ((cmd->argc == 2) && (cmd->argv[1]))) {
-    /* need to close connection here */
-    dbclose(conn->dbproc);
-    conn->dbproc = NULL;
-    entry->connections = 0;
-
-    if (entry->timer) {
-      pr_timer_remove( entry->timer, &sql_tds_module );
-      entry->timer = 0;
-      sql_log(DEBUG_INFO, "connection '%s' - timer stopped",
-          entry->name );
-    }
-
-    sql_log(DEBUG_INFO, "connection '%s' closed", entry->name);
-  }
-
-  sql_log(DEBUG_INFO, "connection '%s' count is now %d", entry->name, entry->connections);
-  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_close");
+  _sql_tds_close(entry, (cmd->argc == 2) && (cmd->argv[1]));
 
+  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_close");
   return PR_HANDLED(cmd);
 }
 
@@ -554,7 +5485,9 @@ MODRET cmd_defineconnection(cmd_rec *cmd){
     return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "uninitialized module");
   }
 
-  conn = (db_conn_t *) palloc(conn_pool, sizeof(db_conn_t));
+  _sql_tds_read_config();
+
+  conn = (db_conn_t *) pcalloc(conn_pool, sizeof(db_conn_t));
 
   name = pstrdup(conn_pool, cmd->argv[0]);
   conn->user = pstrdup(conn_pool, cmd->argv[1]);
@@ -582,7 +5515,7 @@ MODRET cmd_defineconnection(cmd_rec *cmd){
     }
   }
 
-  conn->server = pstrdup(conn_pool, server);
+  _sql_tds_set_servers(conn_pool, conn, server);
   conn->db   = pstrdup(conn_pool, db);
 
   /* insert the new conn_info into the connection hash */
@@ -599,21 +5532,222 @@ MODRET cmd_defineconnection(cmd_rec *cmd){
   entry->timer = 0;
   entry->connections = 0;
 
+  _sql_tds_conn_config(entry);
+
+  /* a per-session connection will be opened soon anyway, so start now */
+  if (pr_sql_conn_policy == SQL_CONN_POLICY_PERSESSION && !tds_broker_path)
+    _sql_tds_login_start(entry);
+
   sql_log(DEBUG_INFO, "    name: '%s'", entry->name);
   sql_log(DEBUG_INFO, "    user: '%s'", conn->user);
-  sql_log(DEBUG_INFO, "  server: '%s'", conn->server);
+  sql_log(DEBUG_INFO, "  server: '%s'", conn->servers);
   sql_log(DEBUG_INFO, "      db: '%s'", conn->db);
   sql_log(DEBUG_INFO, "     ttl: '%d'", entry->ttl);
+  if (entry->wb_max_count > 0)
+    sql_log(DEBUG_INFO, "   queue: %u statements, %lu bytes, %d seconds",
+      entry->wb_max_count, (unsigned long) entry->wb_max_bytes,
+      entry->wb_interval);
   sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_defineconnection");
   return PR_HANDLED(cmd);
 }
 
+/*
+ * _sql_filter_rebuild: body of the child that rebuilds the user filter,
+ *  with the filter connection's own login, into the half of the filter
+ *  that isn't live.  The user names are streamed straight into the
+ *  filter, never materialized.  A table holding a name that isn't plain
+ *  ASCII leaves the filter unusable, since such a name may compare equal
+ *  to a plain one under the column's collation.  Never returns.
+ */
+static void _sql_filter_rebuild(void){
+  conn_entry_t entry;
+  db_conn_t conn;
+  pool *p = NULL;
+  unsigned char *bits = NULL;
+  unsigned long nnames = 0, nother = 0;
+  BYTE *data = NULL;
+  char *query = NULL;
+  DBINT len;
+  RETCODE ret;
+  int half = 0;
+  int failed = FALSE;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGALRM, SIG_IGN);
+
+  _sql_child_privs("user filter");
+
+  p = make_sub_pool(permanent_pool);
+  memset(&entry, 0, sizeof(entry));
+  memset(&conn, 0, sizeof(conn));
+  entry.name = tds_filter_conn;
+  entry.data = &conn;
+  _sql_tds_set_servers(p, &conn, tds_filter_login.servers);
+  conn.user = tds_filter_login.user;
+  conn.pass = tds_filter_login.pass;
+  conn.db = tds_filter_login.db;
+  conn.login_timeout = TDS_BROKER_REQ_TIMEOUT;
+  conn.query_timeout = TDS_FILTER_BUILD_TIMEOUT;
+
+  half = tds_filter->live == 0 ? 1 : 0;
+  bits = tds_filter->bits + (half ? tds_filter->nbytes : 0);
+  memset(bits, 0, tds_filter->nbytes);
+
+  query = pstrcat(p, "SELECT ", tds_user_field, " FROM ", tds_user_table,
+    NULL);
+
+  if (_sql_tds_connect(&entry) < 0 ||
+      _sql_tds_exec(&entry, query, TRUE) != SUCCEED ||
+      dbresults(conn.dbproc) != SUCCEED) {
+    failed = TRUE;
+
+  } else {
+    while ((ret = dbnextrow(conn.dbproc)) != NO_MORE_ROWS) {
+      if (ret == FAIL) {
+        failed = TRUE;
+        break;
+      }
+
+      if ((data = dbdata(conn.dbproc, 1)) == NULL)
+        continue;
+
+      len = dbdatlen(conn.dbproc, 1);
+      if (_sql_filter_plain((char *) data, (size_t) len))
+        _sql_filter_add(bits, (char *) data, (size_t) len);
+      else
+        nother++;
+      nnames++;
+    }
+  }
+
+  if (failed) {
+    pr_log_pri(PR_LOG_WARNING, MOD_SQL_TDS_VERSION
+      ": rebuilding user filter failed, keeping the old one: %s",
+      conn.msgtext[0] ? conn.msgtext : "unable to connect");
+    _exit(1);
+  }
+
+  if (nother > 0) {
+    pr_log_pri(PR_LOG_WARNING, MOD_SQL_TDS_VERSION
+      ": %lu names in %s are not plain ASCII, user filter disabled",
+      nother, tds_user_table);
+    tds_filter->live = -1;
+    _exit(1);
+  }
+
+  __sync_synchronize();
+  tds_filter->nnames = nnames;
+  tds_filter->built = time(NULL);
+  tds_filter->live = half;
+
+  pr_log_pri(PR_LOG_INFO, MOD_SQL_TDS_VERSION
+    ": user filter rebuilt with %lu names", nnames);
+  if (nnames > tds_filter->capacity)
+    pr_log_pri(PR_LOG_WARNING, MOD_SQL_TDS_VERSION
+      ": user filter holds %lu names, more than the %lu its size allows at "
+      "the configured false positive rate", nnames, tds_filter->capacity);
+
+  _exit(0);
+}
+
+/*
+ * _sql_filter_timer_callback: starts a rebuild of the user filter in a
+ *  child of the master, unless the last one is still running.  No
+ *  session ever waits on it.
+ */
+static int _sql_filter_timer_callback(CALLBACK_FRAME){
+  sigset_t chld, prev;
+  pid_t pid;
+
+  if (getpid() != mpid)
+    return 0;
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &prev);
+
+  _sql_child_reap();
+  if (tds_filter_pid == 0) {
+    pid = fork();
+    if (pid == 0)
+      _sql_filter_rebuild();
+
+    if (pid < 0)
+      pr_log_pri(PR_LOG_ERR, MOD_SQL_TDS_VERSION
+        ": unable to fork user filter rebuild: %s", strerror(errno));
+    else
+      tds_filter_pid = pid;
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+  return 1;
+}
+
+/*
+ * _sql_filter_start: called in the master once the configuration has
+ *  been parsed.  Builds the user filter now and every refresh period.
+ */
+static void _sql_filter_start(void){
+  config_rec *c = NULL;
+
+  if (tds_filter == NULL)
+    return;
+
+  c = find_config(main_server->conf, CONF_PARAM, "SQLTDSUserFilter", FALSE);
+  tds_filter_conn = c->argv[0];
+  tds_user_table = get_param_ptr(main_server->conf, "SQLUserTable", FALSE);
+  tds_user_field = get_param_ptr(main_server->conf, "SQLUsernameField", FALSE);
+  if (tds_user_table == NULL || tds_user_field == NULL) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_SQL_TDS_VERSION
+      ": SQLTDSUserFilter needs SQLUserInfo, ignoring");
+    return;
+  }
+
+  _sql_child_hook();
+  (void) _sql_filter_timer_callback(0, 0, 0, NULL);
+  tds_filter_timerno = pr_timer_add(tds_filter->refresh, -1,
+    &sql_tds_module, _sql_filter_timer_callback, "TDS user filter");
+}
+
+/*
+ * _sql_filter_stop: called in the master on shutdown and restart.  A
+ *  rebuild still running is only signalled if we haven't reaped it, so
+ *  a pid that has since been reused is never touched.
+ */
+static void _sql_filter_stop(void){
+  sigset_t chld, prev;
+  pid_t pid;
+
+  if (tds_filter_timerno > 0) {
+    pr_timer_remove(tds_filter_timerno, &sql_tds_module);
+    tds_filter_timerno = -1;
+  }
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &prev);
+
+  _sql_child_reap();
+  if ((pid = tds_filter_pid) > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    tds_filter_pid = 0;
+  }
+
+  sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
 /*
  * cmd_exit: walks the connection cache and closes every
  *  open connection, resetting their connection counts to 0.
  */
 static modret_t *cmd_exit(cmd_rec *cmd) {
   register unsigned int cnt = 0;
+  DBPROCESS *dbproc = NULL;
+  db_conn_t *rconn = NULL;
 
   sql_log(DEBUG_FUNC,"%s",">>> tds cmd_exit");
   conn_entry_t *entry = NULL;
@@ -621,17 +5755,199 @@ static modret_t *cmd_exit(cmd_rec *cmd) {
   for (cnt=0; cnt < conn_cache->nelts; cnt++) {
     entry = ((conn_entry_t **) conn_cache->elts)[cnt];
 
+    /* queued writes go out before the session does */
+    _sql_wb_flush(entry);
+    _sql_bcp_done(entry);
+
+    rconn = entry->read_entry ? (db_conn_t *) entry->read_entry->data : NULL;
+    if (rconn && rconn->dbproc) {
+      dbclose(rconn->dbproc);
+      rconn->dbproc = NULL;
+    }
+
+    /* an early login nobody used */
+    if ((dbproc = _sql_tds_login_wait(entry)) != NULL)
+      dbclose(dbproc);
+
     if (entry->connections > 0) {
-      cmd = _sql_make_cmd( conn_pool, 2, entry->name, "1" );
-      cmd_close( cmd );
-      SQL_FREE_CMD( cmd );
+      _sql_tds_close(entry, TRUE);
     }
   }
+  if (tds_shm_cache) {
+    sql_log(DEBUG_INFO, "shared cache: %lu hits, %lu misses, %lu stores, "
+      "%lu evictions, %lu refreshes; %lu empty hits, %lu empty stores",
+      tds_shm_cache->hits, tds_shm_cache->misses, tds_shm_cache->stores,
+      tds_shm_cache->evictions, tds_shm_cache->refreshes,
+      tds_shm_cache->neg_hits, tds_shm_cache->neg_stores);
+  }
+  if (tds_filter) {
+    sql_log(DEBUG_INFO, "user filter: %lu names, %lu checks, %lu rejected",
+      tds_filter->nnames, tds_filter->checks, tds_filter->rejects);
+  }
+
   dbexit();  /* magic cleanup routine will clean up any remaining dbprocess that we might have missed */
   sql_log(DEBUG_FUNC,"%s","<<< tds cmd_exit");
   return PR_HANDLED(cmd);
 }
 
+/*
+ * _sql_fetch_pages: runs a SELECT built by cmd_select as a series of
+ *  queries of SQLTDSPageSize rows each, so the server never streams more
+ *  than a page past the result limit.  Pages are read by key: each one
+ *  asks for the rows after the last key of the one before, in key order,
+ *  so rows can be neither skipped nor repeated between pages.  The key
+ *  is fetched as an extra last column and left out of the result.
+ *  Paging stops at the first short page, or once the limit is reached.
+ *
+ * Returns: the rows of every page, or NULL if a page failed.
+ */
+static sql_data_t *_sql_fetch_pages(cmd_rec *cmd, conn_entry_t *entry,
+    conn_entry_t *target){
+  db_conn_t *conn = (db_conn_t *) target->data;
+  pool *p = cmd->tmp_pool;
+  array_header *pages = NULL;
+  sql_data_t *sd = NULL;
+  sql_data_t *page = NULL;
+  unsigned long want = 0, row, last;
+  size_t nbytes = 0;
+  char **ptr = NULL;
+  char *query = NULL, *after = NULL, *ch = NULL;
+  char next[24];
+  int x;
+
+  pages = make_array(p, 4, sizeof(sql_data_t *));
+  sd = (sql_data_t *) pcalloc(p, sizeof(sql_data_t));
+
+  while (TRUE) {
+    want = entry->page_rows;
+    if (conn->max_rows && conn->max_rows - sd->rnum < want)
+      want = conn->max_rows - sd->rnum;
+    snprintf(next, sizeof(next), "%lu", want);
+
+    query = pstrcat(p, "SELECT TOP (", next, ") ", cmd->argv[2], ", ",
+      entry->page_key, " FROM ", cmd->argv[1], NULL);
+    if (cmd->argc > 3 && cmd->argv[3])
+      query = pstrcat(p, query, " WHERE (", cmd->argv[3], ")", NULL);
+    if (after)
+      query = pstrcat(p, query, (cmd->argc > 3 && cmd->argv[3]) ? " AND " :
+        " WHERE ", entry->page_key, " > '", after, "'", NULL);
+    query = pstrcat(p, query, " ORDER BY ", entry->page_key, NULL);
+
+    if (_sql_tds_exec(target, query, TRUE) != SUCCEED ||
+        dbresults(conn->dbproc) == FAIL)
+      return NULL;
+
+    conn->nulls = make_array(p, 64, sizeof(unsigned char));
+    page = _sql_fetch_rows(p, conn, 0,
+      conn->max_bytes ? conn->max_bytes - nbytes : 0);
+    if (page == NULL) {
+      conn->nulls = NULL;
+      return NULL;
+    }
+
+    /* leave the connection ready for the next page */
+    while (dbresults(conn->dbproc) == SUCCEED)
+      dbcanquery(conn->dbproc);
+
+    *((sql_data_t **) push_array(pages)) = page;
+    sd->fnum = page->fnum - 1;
+    sd->rnum += page->rnum;
+    nbytes += conn->fetched;
+
+    /* the next page starts after this one's last key, quoted for SQL */
+    if (page->rnum > 0) {
+      last = page->rnum * page->fnum - 1;
+      if (((unsigned char *) conn->nulls->elts)[last]) {
+        conn->nulls = NULL;
+        sql_log(DEBUG_WARN, "paging key %s is NULL, unable to page",
+          entry->page_key);
+        return NULL;
+      }
+
+      after = ch = (char *) palloc(p, strlen(page->data[last]) * 2 + 1);
+      for (x = 0; page->data[last][x]; x++) {
+        if ((*ch++ = page->data[last][x]) == '\'')
+          *ch++ = '\'';
+      }
+      *ch = '\0';
+    }
+    conn->nulls = NULL;
+
+    if (conn->truncated || page->rnum < want)
+      break;
+
+    if ((conn->max_rows && sd->rnum >= conn->max_rows) ||
+        (conn->max_bytes && nbytes >= conn->max_bytes)) {
+      sql_log(DEBUG_WARN, "result set limit reached at %lu rows, not "
+        "fetching further pages", sd->rnum);
+      break;
+    }
+  }
+
+  sql_log(DEBUG_INFO, "%lu rows in %d pages", sd->rnum, pages->nelts);
+
+  /* the values stay where the pages put them, only the pointers move,
+   * leaving out each row's key
+   */
+  ptr = sd->data = (char **) palloc(p,
+    sizeof(char *) * (sd->rnum * sd->fnum + 1));
+  for (x = 0; x < pages->nelts; x++) {
+    page = ((sql_data_t **) pages->elts)[x];
+    for (row = 0; row < page->rnum; row++) {
+      memcpy(ptr, page->data + row * page->fnum, sizeof(char *) * sd->fnum);
+      ptr += sd->fnum;
+    }
+  }
+  *ptr = NULL;
+
+  return sd;
+}
+
+/*
+ * _sql_fetch_results: reads every result of the batch just executed on
+ *  conn, until dbresults() says there are no more, so nothing is left
+ *  unread on the connection.  Only the first result set with columns is
+ *  kept; a statement that fails after the first is logged.
+ *
+ * Returns: 0 with *sd set to that result set, or NULL if there was none;
+ *  -1 if the first statement or reading rows failed.
+ */
+static int _sql_fetch_results(pool *p, db_conn_t *conn, sql_data_t **sd){
+  unsigned int nresults = 0;
+  RETCODE ret;
+
+  *sd = NULL;
+
+  while ((ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS) {
+    nresults++;
+
+    if (ret == FAIL) {
+      if (nresults == 1)
+        return -1;
+
+      sql_log(DEBUG_WARN, "statement %u of the batch failed", nresults);
+      if (dbdead(conn->dbproc))
+        break;
+      continue;
+    }
+
+    if (nresults == 1)
+      _sql_trace_mark("results");
+
+    if (*sd == NULL && dbnumcols(conn->dbproc) > 0) {
+      *sd = _sql_fetch_rows(p, conn, conn->max_rows, conn->max_bytes);
+      if (*sd == NULL)
+        return -1;
+
+    } else {
+      dbcanquery(conn->dbproc);
+    }
+  }
+
+  sql_log(DEBUG_INFO, "%u results in the batch", nresults);
+  return 0;
+}
+
 /*
  * cmd_select: executes a SELECT query. properly constructing the query
  *  based on the inputs.  See mod_sql.h for the definition of the _sql_data
@@ -674,12 +5990,16 @@ static modret_t *cmd_exit(cmd_rec *cmd) {
  */
 MODRET cmd_select(cmd_rec *cmd){
   conn_entry_t *entry = NULL;
+  conn_entry_t *target = NULL;
   db_conn_t *conn = NULL;
   modret_t *cmr = NULL;
   modret_t *dmr = NULL;
+  sql_data_t *sd = NULL;
   char *query = NULL;
-  int cnt = 0;
-  cmd_rec *close_cmd;
+  char *shmkey = NULL;
+  char *pfquery = NULL, *pfpred = NULL;
+  int passcol = -1;
+  RETCODE ret;
 
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_select");
 
@@ -699,52 +6019,130 @@ MODRET cmd_select(cmd_rec *cmd){
   
   conn = (db_conn_t *) entry->data;
 
-  cmr = cmd_open(cmd);
-  if (MODRET_ERROR(cmr)) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select - error in cmd_open");
-    return cmr;
-  }
-
   /* construct the query string */
   if (cmd->argc == 2) {
     query = pstrcat(cmd->tmp_pool, "SELECT ", cmd->argv[1], NULL);
   } else {
-    query = pstrcat( cmd->tmp_pool, cmd->argv[2], " FROM ", 
-        cmd->argv[1], NULL );
-    if ((cmd->argc > 3) && (cmd->argv[3]))
-      query = pstrcat( cmd->tmp_pool, query, " WHERE ", cmd->argv[3], NULL );
-    if ((cmd->argc > 4) && (cmd->argv[4]))
-      query = pstrcat( cmd->tmp_pool, "TOP ", cmd->argv[4], " ",  query,  NULL );
-    if (cmd->argc > 5) {
-
-      /* handle the optional arguments -- they're rare, so in this case
-       * we'll play with the already constructed query string, but in 
-       * general we should probably take optional arguments into account 
-       * and put the query string together later once we know what they are.
-       */
+    query = _sql_build_select(cmd);
+  }
+  _sql_trace_mark("build");
 
-      for (cnt=5; cnt < cmd->argc; cnt++) {
-        if ((cmd->argv[cnt]) && !strcasecmp("DISTINCT",cmd->argv[cnt])) {
-          query = pstrcat( cmd->tmp_pool, "DISTINCT ", query, NULL);
-        }
-      }
+  /* log the query string */
+  sql_log( DEBUG_INFO, "query \"%s\"", query);
+
+  /* a memoized result doesn't need the connection at all */
+  if ((sd = _sql_cache_get(cmd, entry, query)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (cached)");
+    return mod_create_data(cmd, (void *) sd);
+  }
+
+  /* names the user filter has never seen don't exist */
+  if (_sql_filter_reject(cmd, entry)) {
+    sd = (sql_data_t *) pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+    sd->data = (char **) pcalloc(cmd->tmp_pool, sizeof(char *));
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (user filter)");
+    return mod_create_data(cmd, (void *) sd);
+  }
+
+  /* nor do group lookups the login prefetch has covered */
+  if ((sd = _sql_prefetch_get(cmd, entry)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (prefetched)");
+    return mod_create_data(cmd, (void *) sd);
+  }
+
+  /* user and group lookups may have been done by another session */
+  if (_sql_shm_cacheable(cmd)) {
+    shmkey = _sql_shm_key(cmd->tmp_pool, conn, query);
+    passcol = _sql_shm_passcol(cmd);
+
+    if ((passcol < 0 || session.user != NULL) &&
+        (sd = _sql_shm_get(cmd->tmp_pool, shmkey)) != NULL) {
+      _sql_cache_put(entry, query, sd);
+
+      sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (shared cache)");
+      return mod_create_data(cmd, (void *) sd);
     }
+  }
+
+  /* reads must see any writes still queued on this connection */
+  _sql_wb_flush(entry);
 
-    query = pstrcat( cmd->tmp_pool, "SELECT ", query, NULL);
+  cmr = _sql_tds_open(cmd, entry);
+  _sql_trace_mark("open");
+  if (cmr != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select - error in cmd_open");
+    return cmr;
   }
 
-  /* log the query string */
-  sql_log( DEBUG_INFO, "query \"%s\"", query);
+  /* in broker mode the statement is run by a broker worker */
+  if ((dmr = _sql_broker_route(cmd, entry, TDS_BROKER_OP_SELECT, query)) != NULL) {
+    if (!MODRET_ERROR(dmr)) {
+      _sql_cache_put(entry, query, (sql_data_t *) dmr->data);
+      if (shmkey)
+        _sql_shm_put(shmkey, (sql_data_t *) dmr->data, passcol);
+    }
+
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (broker)");
+    return dmr;
+  }
 
   /* perform the query.  if it doesn't work, log the error, close the
    * connection then return the error from the query processing.
    */
-  dbcmd(conn->dbproc, query);
-  if(dbsqlexec(conn->dbproc) != SUCCEED){
+  /* reads go to a read server when there is one */
+  target = _sql_read_entry(entry);
+  conn = (db_conn_t *) target->data;
+
+  /* big structured selects are fetched a page at a time; a DISTINCT
+   * one can't carry the key along
+   */
+  if (entry->page_rows > 0 && cmd->argc > 2 &&
+      !((cmd->argc > 4) && (cmd->argv[4])) && !_sql_select_distinct(cmd)) {
+    if ((sd = _sql_fetch_pages(cmd, entry, target)) == NULL) {
+      dmr = _build_error( cmd, conn );
+      _sql_tds_close(entry, FALSE);
+
+      sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (paged) - error");
+      return dmr;
+    }
+
+    dmr = mod_create_data(cmd, (void *) sd);
+    _sql_cache_put(entry, query, sd);
+    if (shmkey)
+      _sql_shm_put(shmkey, sd, passcol);
+
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (paged)");
+    return dmr;
+  }
+
+  /* the user lookup brings the login's group rows along with it */
+  if ((pfquery = _sql_prefetch_query(cmd, entry, &pfpred)) != NULL) {
+    sql_log(DEBUG_INFO, "prefetch \"%s\"", pfquery);
+    ret = _sql_tds_exec(target, pstrcat(cmd->tmp_pool, query, ";\n",
+      pfquery, NULL), TRUE);
+  } else {
+    ret = _sql_tds_exec_params(cmd->tmp_pool, entry, target, query, TRUE);
+  }
+
+  /* a prefetch the server won't take mustn't cost anyone their login */
+  if (ret != SUCCEED && pfquery && conn->dbproc && !dbdead(conn->dbproc)) {
+    sql_log(DEBUG_WARN, "connection '%s' - login prefetch failed, turning "
+      "it off", entry->name);
+    dbcancel(conn->dbproc);
+    entry->pf_users = NULL;
+    pfquery = NULL;
+
+    ret = _sql_tds_exec_params(cmd->tmp_pool, entry, target, query, TRUE);
+  }
+
+  if(ret != SUCCEED){
     dmr = _build_error( cmd, conn );
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select DBSQLEXEC != SUCCEED");
     return dmr;
@@ -752,14 +6150,14 @@ MODRET cmd_select(cmd_rec *cmd){
 
   if(dbresults(conn->dbproc) == FAIL){
     dmr = _build_error( cmd, conn );
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select DBRESULTS == FAIL");
     return dmr;
   }
 
+  _sql_trace_mark("results");
+
   /* get the data. if it doesn't work, log the error, close the
    * connection then return the error from the data processing.
    */
@@ -767,17 +6165,20 @@ MODRET cmd_select(cmd_rec *cmd){
   if (MODRET_ERROR(dmr)) {
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select");
 
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     return dmr;
   }
 
+  if (pfquery)
+    _sql_prefetch_read(entry, conn, pfpred);
+
+  _sql_cache_put(entry, query, (sql_data_t *) dmr->data);
+  if (shmkey)
+    _sql_shm_put(shmkey, (sql_data_t *) dmr->data, passcol);
+
   /* close the connection, return the data. */
-  close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-  cmd_close(close_cmd);
-  SQL_FREE_CMD( close_cmd );
+  _sql_tds_close(entry, FALSE);
 
   sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_select (normal)");
   return dmr;
@@ -820,7 +6221,6 @@ MODRET cmd_insert(cmd_rec *cmd){
   modret_t *cmr = NULL;
   modret_t *dmr = NULL;
   char *query = NULL;
-  cmd_rec *close_cmd;
 
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_insert");
 
@@ -840,11 +6240,9 @@ MODRET cmd_insert(cmd_rec *cmd){
 
   conn = (db_conn_t *) entry->data;
 
-  cmr = cmd_open(cmd);
-  if (MODRET_ERROR(cmr)) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert");
-    return cmr;
-  }
+  /* anything we have memoized for this connection may now be stale */
+  _sql_cache_flush(entry);
+  entry->last_write = time(NULL);
 
   /* construct the query string */
   if (cmd->argc == 2) {
@@ -858,27 +6256,61 @@ MODRET cmd_insert(cmd_rec *cmd){
   /* log the query string */
   sql_log( DEBUG_INFO, "query \"%s\"", query);
 
+  /* rows for the bulk copy table never reach the server's parser */
+  if (cmd->argc == 4 && _sql_bcp_insert(cmd->tmp_pool, entry, cmd->argv[1],
+      cmd->argv[2], cmd->argv[3]) == 0) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert (bulk copy)");
+    return PR_HANDLED(cmd);
+  }
+
+  /* write-behind statements are batched up and sent later */
+  if (_sql_wb_wanted(entry, cmd->argc == 4 ? cmd->argv[1] :
+      _sql_wb_skip_into(cmd->argv[1]))) {
+    _sql_wb_queue(entry, query);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert (queued)");
+    return PR_HANDLED(cmd);
+  }
+
+  cmr = _sql_tds_open(cmd, entry);
+  _sql_trace_mark("open");
+  if (cmr != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert");
+    return cmr;
+  }
+
+  /* in broker mode the statement is run by a broker worker */
+  if ((dmr = _sql_broker_route(cmd, entry, TDS_BROKER_OP_EXEC, query)) != NULL) {
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert (broker)");
+    return dmr;
+  }
+
+  /* logging writes may go out without waiting for the reply */
+  if ((dmr = _sql_tds_send(cmd, entry, query)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert (deferred)");
+    return dmr;
+  }
+
   /* perform the query.  if it doesn't work, log the error, close the
    * connection (and log any errors there, too) then return the error
    * from the query processing.
    */
-  dbcmd(conn->dbproc, query);
-  dbsqlexec(conn->dbproc);
-  if(dbresults(conn->dbproc) != SUCCEED){
+  if (_sql_tds_exec(entry, query, FALSE) != SUCCEED ||
+      dbresults(conn->dbproc) != SUCCEED) {
     dmr = _build_error( cmd, conn );
 
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert");
     return dmr;
   }
 
+  _sql_trace_mark("results");
+
   /* close the connection and return HANDLED. */
-  close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-  cmd_close(close_cmd);
-  SQL_FREE_CMD( close_cmd );
+  _sql_tds_close(entry, FALSE);
 
   sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_insert");
   return PR_HANDLED(cmd);
@@ -910,7 +6342,6 @@ MODRET cmd_update(cmd_rec *cmd){
   modret_t *cmr = NULL;
   modret_t *dmr = NULL;
   char *query = NULL;
-  cmd_rec *close_cmd;
 
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_update");
 
@@ -929,11 +6360,9 @@ MODRET cmd_update(cmd_rec *cmd){
 
   conn = (db_conn_t *) entry->data;
 
-  cmr = cmd_open(cmd);
-  if (MODRET_ERROR(cmr)) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update");
-    return cmr;
-  }
+  /* anything we have memoized for this connection may now be stale */
+  _sql_cache_flush(entry);
+  entry->last_write = time(NULL);
 
   if (cmd->argc == 2) {
     query = pstrcat(cmd->tmp_pool, "UPDATE ", cmd->argv[1], NULL);
@@ -949,31 +6378,241 @@ MODRET cmd_update(cmd_rec *cmd){
   /* log the query string */
   sql_log( DEBUG_INFO, "query \"%s\"", query);
 
+  /* write-behind statements are batched up and sent later */
+  if (_sql_wb_wanted(entry, cmd->argv[1])) {
+    _sql_wb_queue(entry, query);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update (queued)");
+    return PR_HANDLED(cmd);
+  }
+
+  cmr = _sql_tds_open(cmd, entry);
+  _sql_trace_mark("open");
+  if (cmr != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update");
+    return cmr;
+  }
+
+  /* in broker mode the statement is run by a broker worker */
+  if ((dmr = _sql_broker_route(cmd, entry, TDS_BROKER_OP_EXEC, query)) != NULL) {
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update (broker)");
+    return dmr;
+  }
+
+  /* logging writes may go out without waiting for the reply */
+  if ((dmr = _sql_tds_send(cmd, entry, query)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update (deferred)");
+    return dmr;
+  }
+
   /* perform the query.  if it doesn't work close the connection, then
    * return the error from the query processing.
    */
-  dbcmd(conn->dbproc, query);
-  dbsqlexec(conn->dbproc);
-  if(dbresults(conn->dbproc) != SUCCEED){
+  if (_sql_tds_exec_params(cmd->tmp_pool, entry, entry, query, FALSE) != SUCCEED ||
+      dbresults(conn->dbproc) != SUCCEED) {
     dmr = _build_error( cmd, conn );
 
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update");
     return dmr;
   }
 
+  _sql_trace_mark("results");
+
   /* close the connection, return HANDLED.  */
-  close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-  cmd_close(close_cmd);
-  SQL_FREE_CMD( close_cmd );
+  _sql_tds_close(entry, FALSE);
 
   sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_update");
   return PR_HANDLED(cmd);
 }
 
+/*
+ * _sql_rpc_params: parses a procedure parameter string and adds each
+ *  parameter to the pending RPC with dbrpcparam().  Parameters are
+ *  separated by commas and may be named:
+ *
+ *   'alice', 42, NULL
+ *   @user='alice', @uid=42, @home='' OUTPUT
+ *
+ *  Quoted values ('' doubles a quote, an N prefix is accepted) are sent
+ *  as varchar, integers as int, and NULL as a NULL varchar.  Anything
+ *  else is sent as varchar text.  A trailing OUTPUT (or OUT) marks a
+ *  return parameter.
+ *
+ * Returns: the number of parameters added, or -1 on a parse or db-lib
+ *  error.
+ */
+static int _sql_rpc_params(pool *p, DBPROCESS *dbproc, const char *str){
+  const char *ptr = str;
+  const char *start = NULL;
+  char *name = NULL;
+  char *value = NULL;
+  char *end = NULL;
+  BYTE status = 0;
+  int type = 0;
+  DBINT maxlen = 0, datalen = 0;
+  BYTE *data = NULL;
+  DBINT *intval = NULL;
+  long long llval = 0;
+  size_t len = 0;
+  int nparams = 0;
+
+  while (*ptr) {
+    while (isspace((int) *ptr)) ptr++;
+    if (*ptr == '\0')
+      break;
+
+    name = NULL;
+    status = 0;
+
+    /* optional "@name =" */
+    if (*ptr == '@') {
+      start = ptr;
+      while (*ptr && *ptr != '=' && !isspace((int) *ptr)) ptr++;
+      name = pstrndup(p, start, ptr - start);
+
+      while (isspace((int) *ptr)) ptr++;
+      if (*ptr != '=')
+        return -1;
+      ptr++;
+      while (isspace((int) *ptr)) ptr++;
+    }
+
+    if ((*ptr == 'N' || *ptr == 'n') && ptr[1] == '\'')
+      ptr++;
+
+    if (*ptr == '\'') {
+      /* quoted string, '' is an escaped quote */
+      ptr++;
+      value = (char *) palloc(p, strlen(ptr) + 1);
+      len = 0;
+      while (*ptr) {
+        if (*ptr == '\'') {
+          if (ptr[1] != '\'')
+            break;
+          ptr++;
+        }
+        value[len++] = *ptr++;
+      }
+      if (*ptr != '\'')
+        return -1;
+      ptr++;
+      value[len] = '\0';
+
+      type = SYBVARCHAR;
+      data = (BYTE *) value;
+      datalen = (DBINT) len;
+
+    } else {
+      start = ptr;
+      while (*ptr && *ptr != ',' && !isspace((int) *ptr)) ptr++;
+      if (ptr == start)
+        return -1;
+      value = pstrndup(p, start, ptr - start);
+
+      errno = 0;
+      llval = strtoll(value, &end, 10);
+
+      if (!strcasecmp(value, "NULL")) {
+        type = SYBVARCHAR;
+        data = NULL;
+        datalen = 0;
+
+      } else if (*end == '\0' && errno == 0 &&
+                 llval >= -2147483647LL - 1 && llval <= 2147483647LL) {
+        intval = (DBINT *) palloc(p, sizeof(DBINT));
+        *intval = (DBINT) llval;
+
+        type = SYBINT4;
+        data = (BYTE *) intval;
+        datalen = -1;
+
+      } else {
+        type = SYBVARCHAR;
+        data = (BYTE *) value;
+        datalen = (DBINT) strlen(value);
+      }
+    }
+
+    while (isspace((int) *ptr)) ptr++;
+
+    /* optional OUTPUT/OUT marker */
+    if (!strncasecmp(ptr, "OUTPUT", 6) &&
+        (ptr[6] == '\0' || ptr[6] == ',' || isspace((int) ptr[6]))) {
+      status = DBRPCRETURN;
+      ptr += 6;
+    } else if (!strncasecmp(ptr, "OUT", 3) &&
+        (ptr[3] == '\0' || ptr[3] == ',' || isspace((int) ptr[3]))) {
+      status = DBRPCRETURN;
+      ptr += 3;
+    }
+
+    while (isspace((int) *ptr)) ptr++;
+    if (*ptr == ',') {
+      ptr++;
+    } else if (*ptr != '\0') {
+      return -1;
+    }
+
+    /* fixed length types, and values that aren't returned, have no maxlen */
+    maxlen = (status == DBRPCRETURN && type == SYBVARCHAR) ? 255 : -1;
+
+    if (dbrpcparam(dbproc, name, status, type, maxlen, datalen, data) == FAIL)
+      return -1;
+
+    sql_log(DEBUG_INFO, "procedure parameter %d: %s%s%s%s", nparams + 1,
+      name ? name : "", name ? "=" : "", data ? value : "NULL",
+      status == DBRPCRETURN ? " OUTPUT" : "");
+    nparams++;
+  }
+
+  return nparams;
+}
+
+/*
+ * _build_retdata: builds the single row returned by a procedure which
+ *  produced no result rows: its return status, followed by the value of
+ *  each output parameter.
+ */
+static modret_t *_build_retdata( cmd_rec *cmd, db_conn_t *conn ){
+  sql_data_t *sd = NULL;
+  result_col_t col;
+  const char *val = NULL;
+  size_t len = 0;
+  int nrets, x;
+
+  nrets = dbnumrets(conn->dbproc);
+
+  sd = (sql_data_t *) pcalloc(cmd->tmp_pool, sizeof(sql_data_t));
+  sd->rnum = 1;
+  sd->fnum = nrets + 1;
+  sd->data = (char **) pcalloc(cmd->tmp_pool, sizeof(char *) * (sd->fnum + 1));
+
+  memset(&col, 0, sizeof(col));
+  col.scratch = (char *) palloc(cmd->tmp_pool, 24);
+  len = _sql_fmt_int(col.scratch,
+    dbhasretstat(conn->dbproc) ? dbretstatus(conn->dbproc) : 0);
+  sd->data[0] = pstrndup(cmd->tmp_pool, col.scratch, len);
+  sql_log(DEBUG_INFO, "procedure return status: %s", sd->data[0]);
+
+  for (x = 1; x <= nrets; x++) {
+    memset(&col, 0, sizeof(col));
+    _sql_init_col(cmd->tmp_pool, &col, dbrettype(conn->dbproc, x),
+      dbretlen(conn->dbproc, x));
+    len = _sql_fmt_value(cmd->tmp_pool, conn->dbproc, &col,
+      dbretdata(conn->dbproc, x), dbretlen(conn->dbproc, x), &val);
+
+    sd->data[x] = pstrndup(cmd->tmp_pool, val, len);
+    sql_log(DEBUG_INFO, "procedure output %s: %s", dbretname(conn->dbproc, x),
+      sd->data[x]);
+  }
+
+  return mod_create_data(cmd, (void *) sd);
+}
+
 /*
  * cmd_procedure: executes a stored procedure.
  *
@@ -988,25 +6627,111 @@ MODRET cmd_update(cmd_rec *cmd){
  *  returns data, it should be returned in the same way as cmd_select.
  *
  * Notes:
- *  not every backend will support stored procedures.  Backends which do
- *  not support stored procedures should return an error with a descriptive
- *  error message (something like 'backend does not support procedures').
+ *  The procedure is executed as a TDS RPC, not a textual EXEC batch, so
+ *  the server never parses the call and parameters travel in their
+ *  binary form.  See _sql_rpc_params for the parameter string format.
+ *
+ *  If the procedure returns no rows, a single row is returned instead:
+ *  the procedure's return status, followed by the value of each OUTPUT
+ *  parameter in the order they were declared.
  */
 MODRET cmd_procedure(cmd_rec *cmd)
 {
+  conn_entry_t *entry = NULL;
+  db_conn_t *conn = NULL;
+  modret_t *cmr = NULL;
+  modret_t *dmr = NULL;
+  RETCODE ret = FAIL;
+
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_procedure");
 
   _sql_check_cmd(cmd, "cmd_procedure");
 
-  if (cmd->argc != 3) {
+  if (cmd->argc != 3) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");  }
+
+  /* get the named connection */
+  entry = _sql_get_connection( cmd->argv[0] );
+  if (!entry) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "Unknown Named Connection");
+  }
+
+  conn = (db_conn_t *) entry->data;
+
+  /* anything we have memoized for this connection may now be stale */
+  _sql_cache_flush(entry);
+  entry->last_write = time(NULL);
+
+  /* reads must see any writes still queued on this connection */
+  _sql_wb_flush(entry);
+
+  cmr = _sql_tds_open(cmd, entry);
+  _sql_trace_mark("open");
+  if (cmr != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+    return cmr;
+  }
+
+  /* procedures always run on a connection of our own */
+  if (!conn->dbproc && _sql_tds_connect(entry) < 0) {
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "unable to connect to database");
+  }
+
+  sql_log(DEBUG_INFO, "procedure \"%s\" (%s)", cmd->argv[1],
+    cmd->argv[2] ? (char *) cmd->argv[2] : "");
+
+  /* build and send the RPC.  if it doesn't work, close the connection
+   * and return the error.
+   */
+  if (_sql_tds_arm(conn) < 0 ||
+      dbrpcinit(conn->dbproc, cmd->argv[1], 0) == FAIL ||
+      (cmd->argv[2] &&
+       _sql_rpc_params(cmd->tmp_pool, conn->dbproc, cmd->argv[2]) < 0) ||
+      dbrpcsend(conn->dbproc) == FAIL ||
+      dbsqlok(conn->dbproc) == FAIL) {
+    dmr = _build_error( cmd, conn );
+    dbcancel(conn->dbproc);
+
+    _sql_tds_close(entry, FALSE);
+
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
-    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "badly formed request");  }
+    return dmr;
+  }
 
-  /* TDS has procedures, just need to write code to do it */
+  _sql_trace_mark("exec");
 
-  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+  /* the first result set with columns is returned just like cmd_select
+   * returns its rows; any others are discarded.  The return status and
+   * output parameters are only available once every result is read.
+   */
+  while ((ret = dbresults(conn->dbproc)) != NO_MORE_RESULTS) {
+    if (ret == FAIL) {
+      dmr = _build_error( cmd, conn );
+      dbcancel(conn->dbproc);
+      break;
+    }
+
+    if (dmr == NULL && dbnumcols(conn->dbproc) > 0) {
+      dmr = _build_data( cmd, conn );
+    } else {
+      dbcanquery(conn->dbproc);
+    }
+  }
+
+  if (dmr == NULL) {
+    dmr = _build_retdata( cmd, conn );
+  }
 
-  return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "backend does not support procedures -- YET!");
+  /* close the connection, return the data. */
+  _sql_tds_close(entry, FALSE);
+
+  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_procedure");
+  return dmr;
 }
 
 /*
@@ -1026,15 +6751,18 @@ MODRET cmd_procedure(cmd_rec *cmd)
  *  None.  The query should be passed directly to the backend database.
  *
  * Notes:
- *  None.
+ *  Every result of the query is read.  The first result set with columns
+ *  is the one returned.
  */
 MODRET cmd_query(cmd_rec *cmd){
   conn_entry_t *entry = NULL;
   db_conn_t *conn = NULL;
   modret_t *cmr = NULL;
   modret_t *dmr = NULL;
+  sql_data_t *sd = NULL;
   char *query = NULL;
-  cmd_rec *close_cmd;
+  int readonly = FALSE;
+  conn_entry_t *target = NULL;
 
   sql_log(DEBUG_FUNC, "%s", ">>> tds cmd_query");
 
@@ -1054,55 +6782,174 @@ MODRET cmd_query(cmd_rec *cmd){
 
   conn = (db_conn_t *) entry->data;
 
-  cmr = cmd_open(cmd);
-  if (MODRET_ERROR(cmr)) {
+  query = pstrcat(cmd->tmp_pool, cmd->argv[1], NULL);
+
+  /* log the query string */
+  sql_log( DEBUG_INFO, "query \"%s\"", query);
+
+  /* only reads can be memoized, anything else invalidates what we have */
+  readonly = _sql_is_readonly(query);
+  if (!readonly) {
+    _sql_cache_flush(entry);
+    entry->last_write = time(NULL);
+
+  } else if ((sd = _sql_cache_get(cmd, entry, query)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query (cached)");
+    return mod_create_data(cmd, (void *) sd);
+  }
+
+  /* reads must see any writes still queued on this connection */
+  _sql_wb_flush(entry);
+
+  cmr = _sql_tds_open(cmd, entry);
+  _sql_trace_mark("open");
+  if (cmr != NULL) {
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query");
     return cmr;
   }
 
-  query = pstrcat(cmd->tmp_pool, cmd->argv[1], NULL);
+  /* in broker mode the statement is run by a broker worker, which only
+   * hands back the first result set.
+   */
+  if ((dmr = _sql_broker_route(cmd, entry, TDS_BROKER_OP_QUERY, query)) != NULL) {
+    if (readonly && !MODRET_ERROR(dmr) && dmr->data)
+      _sql_cache_put(entry, query, (sql_data_t *) dmr->data);
 
-  /* log the query string */
-  sql_log( DEBUG_INFO, "query \"%s\"", query);
+    _sql_tds_close(entry, FALSE);
+
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query (broker)");
+    return dmr;
+  }
+
+  /* logging writes may go out without waiting for the reply */
+  if (!readonly && (dmr = _sql_tds_send(cmd, entry, query)) != NULL) {
+    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query (deferred)");
+    return dmr;
+  }
 
   /* perform the query.  if it doesn't work close the connection, then
    * return the error from the query processing.
    */
-  dbcmd(conn->dbproc, query);
-  dbsqlexec(conn->dbproc);
-  if(dbresults(conn->dbproc) != SUCCEED){
+  /* reads go to a read server when there is one */
+  target = readonly ? _sql_read_entry(entry) : entry;
+  conn = (db_conn_t *) target->data;
+
+  if (_sql_tds_exec(target, query, readonly) != SUCCEED ||
+      _sql_fetch_results(cmd->tmp_pool, conn, &sd) < 0) {
     dmr = _build_error( cmd, conn );
+    if (conn->dbproc && !dbdead(conn->dbproc))
+      dbcancel(conn->dbproc);
 
-    close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-    cmd_close(close_cmd);
-    SQL_FREE_CMD( close_cmd );
+    _sql_tds_close(entry, FALSE);
 
     sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query");
     return dmr;
   }
 
-  /* get data if necessary. if it doesn't work, log the error, close the
-   * connection then return the error from the data processing.
-   */
-
-  if ( dbnumcols( conn->dbproc ) ) {
-    dmr = _build_data( cmd, conn );
-    if (MODRET_ERROR(dmr)) {
-      sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query");
-    }
+  /* mod_sql gets the first result set with columns */
+  if (sd) {
+    dmr = mod_create_data(cmd, (void *) sd);
+    if (readonly)
+      _sql_cache_put(entry, query, sd);
   } else {
     dmr = PR_HANDLED(cmd);
   }
 
   /* close the connection, return the data. */
-  close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-  cmd_close(close_cmd);
-  SQL_FREE_CMD( close_cmd );
+  _sql_tds_close(entry, FALSE);
 
   sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_query");
   return dmr;
 }
 
+/*
+ * _sql_count_quotes: counts the single and double quotes in the len
+ *  bytes at str.  With SSE2 or AVX2 a block is examined at a time, and
+ *  only the tail byte by byte; nothing past str + len is read.
+ *
+ * Returns: the number of quotes.
+ */
+static size_t _sql_count_quotes(const char *str, size_t len){
+  const char *src = str, *end = str + len;
+  size_t nquotes = 0;
+#ifdef TDS_VEC_LEN
+  const tds_vec_t squote = TDS_VEC_SET1('\''), dquote = TDS_VEC_SET1('"');
+  tds_vec_t v;
+
+  for (; end - src >= TDS_VEC_LEN; src += TDS_VEC_LEN) {
+    v = TDS_VEC_LOADU(src);
+    nquotes += __builtin_popcount(TDS_VEC_MASK(TDS_VEC_OR(
+      TDS_VEC_EQ(v, squote), TDS_VEC_EQ(v, dquote))));
+  }
+#endif
+
+  for (; src < end; src++) {
+    if (*src == '\'' || *src == '"')
+      nquotes++;
+  }
+
+  return nquotes;
+}
+
+/*
+ * _sql_escape_quotes: does what dbsafestr(..., DBBOTH) does -- doubles
+ *  every single and double quote -- without needing a DBPROCESS.  The
+ *  result is allocated at its exact size; strings without quotes, the
+ *  usual case, are simply copied.
+ */
+static char *_sql_escape_quotes(pool *p, const char *str){
+  const char *src = NULL;
+  char *escaped = NULL, *dst = NULL;
+  size_t len = 0, nquotes = 0;
+
+  len = strlen(str);
+  nquotes = _sql_count_quotes(str, len);
+
+  escaped = dst = (char *) palloc(p, len + nquotes + 1);
+  if (nquotes == 0) {
+    memcpy(escaped, str, len + 1);
+    return escaped;
+  }
+
+  src = str;
+#ifdef TDS_VEC_LEN
+  {
+    const tds_vec_t squote = TDS_VEC_SET1('\''), dquote = TDS_VEC_SET1('"');
+    unsigned int quotes, x;
+    tds_vec_t v;
+
+    /* blocks without quotes are copied whole, the rest byte by byte */
+    while (len - (size_t) (src - str) >= TDS_VEC_LEN) {
+      v = TDS_VEC_LOADU(src);
+      quotes = TDS_VEC_MASK(TDS_VEC_OR(TDS_VEC_EQ(v, squote),
+        TDS_VEC_EQ(v, dquote)));
+
+      if (quotes == 0) {
+        TDS_VEC_STOREU(dst, v);
+        dst += TDS_VEC_LEN;
+
+      } else {
+        for (x = 0; x < TDS_VEC_LEN; x++) {
+          if (quotes & (1U << x))
+            *dst++ = src[x];
+          *dst++ = src[x];
+        }
+      }
+
+      src += TDS_VEC_LEN;
+    }
+  }
+#endif
+  for (; *src; src++) {
+    if (*src == '\'' || *src == '"')
+      *dst++ = *src;
+    *dst++ = *src;
+  }
+  *dst = '\0';
+
+  return escaped;
+}
+
 /*
  * cmd_escapestring: certain strings sent to a database should be properly
  *  escaped -- for instance, quotes need to be escaped to insure that 
@@ -1119,9 +6966,6 @@ MODRET cmd_query(cmd_rec *cmd){
 MODRET cmd_escapestring(cmd_rec * cmd){
 
   conn_entry_t *entry = NULL;
-  db_conn_t *conn = NULL;
-  cmd_rec *close_cmd;
-  modret_t *cmr = NULL;
   char *unescaped = NULL;
   char *escaped = NULL;
 
@@ -1141,29 +6985,18 @@ MODRET cmd_escapestring(cmd_rec * cmd){
    return PR_ERROR_MSG(cmd, MOD_SQL_TDS_VERSION, "unknown named connectiont");
   }
 
-  conn = (db_conn_t *) entry->data;
-
-  /* Make sure the connection is opened */ 
-  cmr = cmd_open(cmd);
-  if (MODRET_ERROR(cmr)) {
-    sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_escapestring");
-    return cmr;
-  }
-
-  /**
-   * Pass the unescaped to dbsafestr() to make it safe 
+  /* quoting doesn't depend on the connection, so there's no need to open
+   * it (and possibly log in) just for this.
    */
   unescaped = cmd->argv[1];
-  escaped = (char *) pcalloc(cmd->tmp_pool, sizeof(char) * (strlen(unescaped) * 2) + 1);
-  dbsafestr(conn->dbproc,unescaped,-1,escaped,-1,DBBOTH);
+  escaped = _sql_escape_quotes(cmd->tmp_pool, unescaped);
 
   sql_log(DEBUG_FUNC, "before: '%s' after '%s'", unescaped,escaped);
-  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_escapestring");
 
-  /* close the connection, return the data. */
-  close_cmd = _sql_make_cmd( cmd->tmp_pool, 1, entry->name );
-  cmd_close(close_cmd);
-  SQL_FREE_CMD( close_cmd );
+  if (entry->param)
+    _sql_param_note(entry, escaped);
+
+  sql_log(DEBUG_FUNC, "%s", "<<< tds cmd_escapestring");
   return mod_create_data(cmd, (void *) escaped);
 }
 
@@ -1247,6 +7080,7 @@ MODRET cmd_cleanup(cmd_rec *cmd) {
 	destroy_pool(conn_pool);
 	conn_pool = NULL;
 	conn_cache = NULL;
+	conn_index = NULL;
 	return mod_create_data(cmd, NULL);
 }
 
@@ -1267,10 +7101,34 @@ MODRET cmd_prepare(cmd_rec *cmd) {
   if (conn_cache == NULL) {
     conn_cache = make_array((pool *) cmd->argv[0], DEF_CONN_POOL_SIZE,
         sizeof(conn_entry_t *));
+    conn_index = pr_table_alloc((pool *) cmd->argv[0], 0);
   }
   return mod_create_data(cmd, NULL);
 }
 
+/*
+ * Traced entry points for the statement handlers; see _sql_trace_cmd.
+ */
+MODRET cmd_traced_select(cmd_rec *cmd){
+  return _sql_trace_cmd(cmd, "select", cmd_select);
+}
+
+MODRET cmd_traced_insert(cmd_rec *cmd){
+  return _sql_trace_cmd(cmd, "insert", cmd_insert);
+}
+
+MODRET cmd_traced_update(cmd_rec *cmd){
+  return _sql_trace_cmd(cmd, "update", cmd_update);
+}
+
+MODRET cmd_traced_procedure(cmd_rec *cmd){
+  return _sql_trace_cmd(cmd, "procedure", cmd_procedure);
+}
+
+MODRET cmd_traced_query(cmd_rec *cmd){
+  return _sql_trace_cmd(cmd, "query", cmd_query);
+}
+
 /*
  * sql_tds_cmdtable: mod_sql requires each backend module to define a cmdtable
  *  with this exact name. ALL these functions must be defined; mod_sql checks
@@ -1282,11 +7140,11 @@ cmdtable sql_tds_cmdtable[] = {
   { CMD, "sql_close",            G_NONE, cmd_close,            FALSE, FALSE },
   { CMD, "sql_exit",             G_NONE, cmd_exit,             FALSE, FALSE },
   { CMD, "sql_defineconnection", G_NONE, cmd_defineconnection, FALSE, FALSE },
-  { CMD, "sql_select",           G_NONE, cmd_select,           FALSE, FALSE },
-  { CMD, "sql_insert",           G_NONE, cmd_insert,           FALSE, FALSE },
-  { CMD, "sql_update",           G_NONE, cmd_update,           FALSE, FALSE },
-  { CMD, "sql_procedure",        G_NONE, cmd_procedure,        FALSE, FALSE },
-  { CMD, "sql_query",            G_NONE, cmd_query,            FALSE, FALSE },
+  { CMD, "sql_select",           G_NONE, cmd_traced_select,    FALSE, FALSE },
+  { CMD, "sql_insert",           G_NONE, cmd_traced_insert,    FALSE, FALSE },
+  { CMD, "sql_update",           G_NONE, cmd_traced_update,    FALSE, FALSE },
+  { CMD, "sql_procedure",        G_NONE, cmd_traced_procedure, FALSE, FALSE },
+  { CMD, "sql_query",            G_NONE, cmd_traced_query,     FALSE, FALSE },
   { CMD, "sql_escapestring",     G_NONE, cmd_escapestring,     FALSE, FALSE },
   { CMD, "sql_checkauth",        G_NONE, cmd_checkauth,        FALSE, FALSE },
   { CMD, "sql_identify",         G_NONE, cmd_identify,         FALSE, FALSE },
@@ -1296,6 +7154,478 @@ cmdtable sql_tds_cmdtable[] = {
   { 0, NULL }
 };
 
+/* Command handlers
+ */
+
+/*
+ * sql_tds_pre_auth: starts the SQLTDSAuthTimeout clock for a USER or PASS
+ *  command; every lookup mod_sql makes for it has to finish in time.
+ *  Before PASS, any early login still in progress is waited for.
+ */
+MODRET sql_tds_pre_auth(cmd_rec *cmd) {
+  unsigned int x;
+
+  if (tds_auth_timeout > 0)
+    tds_auth_deadline = time(NULL) + tds_auth_timeout;
+
+  /* PASS may chroot and drop privileges, and later commands may fork;
+   * none of that is safe while an early login's thread is still running
+   */
+  if (conn_cache && strcmp(cmd->argv[0], C_PASS) == 0) {
+    for (x = 0; x < conn_cache->nelts; x++)
+      _sql_tds_login_join(((conn_entry_t **) conn_cache->elts)[x]);
+  }
+
+  return PR_DECLINED(cmd);
+}
+
+MODRET sql_tds_post_auth(cmd_rec *cmd) {
+  tds_auth_deadline = 0;
+  return PR_DECLINED(cmd);
+}
+
+static cmdtable sql_tds_cmdtab[] = {
+  { PRE_CMD,		C_USER,	G_NONE,	sql_tds_pre_auth,	FALSE,	FALSE },
+  { PRE_CMD,		C_PASS,	G_NONE,	sql_tds_pre_auth,	FALSE,	FALSE },
+  { POST_CMD,		C_USER,	G_NONE,	sql_tds_post_auth,	FALSE,	FALSE },
+  { POST_CMD_ERR,	C_USER,	G_NONE,	sql_tds_post_auth,	FALSE,	FALSE },
+  { POST_CMD,		C_PASS,	G_NONE,	sql_tds_post_auth,	FALSE,	FALSE },
+  { POST_CMD_ERR,	C_PASS,	G_NONE,	sql_tds_post_auth,	FALSE,	FALSE },
+
+  { 0, NULL }
+};
+
+/* Configuration handlers
+ */
+
+/* usage: SQLTDSPingInterval seconds */
+MODRET set_sqltdspinginterval(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int secs = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  secs = atoi(cmd->argv[1]);
+  if (secs < 0)
+    CONF_ERROR(cmd, "seconds must be zero or greater");
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSBroker socket-path [workers] */
+MODRET set_sqltdsbroker(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int nworkers = TDS_BROKER_DEF_WORKERS;
+
+  if (cmd->argc < 2 || cmd->argc > 3)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (*((char *) cmd->argv[1]) != '/')
+    CONF_ERROR(cmd, "socket path must be an absolute path");
+
+  if (cmd->argc == 3) {
+    nworkers = atoi(cmd->argv[2]);
+    if (nworkers < 1 || nworkers > TDS_BROKER_MAX_WORKERS)
+      CONF_ERROR(cmd, "workers must be between 1 and 64");
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = nworkers;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSQueryCache seconds [max-entries] */
+MODRET set_sqltdsquerycache(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int secs = 0, max = 32;
+
+  if (cmd->argc < 2 || cmd->argc > 3)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  secs = atoi(cmd->argv[1]);
+  if (secs < 0)
+    CONF_ERROR(cmd, "seconds must be zero or greater");
+
+  if (cmd->argc == 3) {
+    max = atoi(cmd->argv[2]);
+    if (max < 1)
+      CONF_ERROR(cmd, "max-entries must be greater than zero");
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = secs;
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = (unsigned int) max;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSSharedCache entries seconds [entry-size] */
+MODRET set_sqltdssharedcache(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int nslots = 0, secs = 0, slotsz = TDS_SHM_DEF_SLOTSZ;
+
+  if (cmd->argc < 3 || cmd->argc > 4)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  nslots = atoi(cmd->argv[1]);
+  if (nslots < 1 || nslots > TDS_SHM_MAX_SLOTS)
+    CONF_ERROR(cmd, "entries must be between 1 and 1048576");
+
+  secs = atoi(cmd->argv[2]);
+  if (secs < 1)
+    CONF_ERROR(cmd, "seconds must be greater than zero");
+
+  if (cmd->argc == 4) {
+    slotsz = atoi(cmd->argv[3]);
+    if (slotsz < 256 || slotsz > 65536)
+      CONF_ERROR(cmd, "entry-size must be between 256 and 65536");
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[0]) = (unsigned int) nslots;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = secs;
+  c->argv[2] = pcalloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[2]) = (size_t) slotsz;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSNegativeCache seconds */
+MODRET set_sqltdsnegativecache(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int secs = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  secs = atoi(cmd->argv[1]);
+  if (secs < 1)
+    CONF_ERROR(cmd, "seconds must be greater than zero");
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSUserFilter conn-name bytes false-positive-rate [seconds] */
+MODRET set_sqltdsuserfilter(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  long bytes = 0;
+  double rate = 0;
+  int secs = 300;
+
+  if (cmd->argc < 4 || cmd->argc > 5)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  bytes = atol(cmd->argv[2]);
+  if (bytes < 1024 || bytes > 256L * 1024 * 1024)
+    CONF_ERROR(cmd, "bytes must be between 1024 and 268435456");
+
+  rate = atof(cmd->argv[3]);
+  if (rate <= 0 || rate >= 0.5)
+    CONF_ERROR(cmd, "false-positive-rate must be between 0 and 0.5");
+
+  if (cmd->argc == 5) {
+    secs = atoi(cmd->argv[4]);
+    if (secs < 1)
+      CONF_ERROR(cmd, "seconds must be greater than zero");
+  }
+
+  c = add_config_param(cmd->argv[0], 4, NULL, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[1]) = (size_t) bytes;
+  c->argv[2] = pcalloc(c->pool, sizeof(double));
+  *((double *) c->argv[2]) = rate;
+  c->argv[3] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[3]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSWriteBehind conn-name tables count [bytes [seconds]] */
+MODRET set_sqltdswritebehind(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int count = 0, bytes = 0, secs = 1;
+
+  if (cmd->argc < 4 || cmd->argc > 6)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  count = atoi(cmd->argv[3]);
+  if (count < 1)
+    CONF_ERROR(cmd, "count must be greater than zero");
+
+  if (cmd->argc >= 5) {
+    bytes = atoi(cmd->argv[4]);
+    if (bytes < 0)
+      CONF_ERROR(cmd, "bytes must be zero or greater");
+  }
+
+  if (cmd->argc == 6) {
+    secs = atoi(cmd->argv[5]);
+    if (secs < 0)
+      CONF_ERROR(cmd, "seconds must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 5, NULL, NULL, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = (unsigned int) count;
+  c->argv[2] = pcalloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[2]) = (size_t) bytes;
+  c->argv[3] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[3]) = secs;
+  c->argv[4] = pstrdup(c->pool, cmd->argv[2]);
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSBulkCopy conn-name table [rows [seconds]] */
+MODRET set_sqltdsbulkcopy(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int rows = 1000, secs = 5;
+
+  if (cmd->argc < 3 || cmd->argc > 5)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc >= 4) {
+    rows = atoi(cmd->argv[3]);
+    if (rows < 1)
+      CONF_ERROR(cmd, "rows must be greater than zero");
+  }
+
+  if (cmd->argc == 5) {
+    secs = atoi(cmd->argv[4]);
+    if (secs < 0)
+      CONF_ERROR(cmd, "seconds must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 4, NULL, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pstrdup(c->pool, cmd->argv[2]);
+  c->argv[2] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[2]) = (unsigned int) rows;
+  c->argv[3] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[3]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSDeferResults conn-name [seconds] */
+MODRET set_sqltdsdeferresults(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int secs = 1;
+
+  if (cmd->argc < 2 || cmd->argc > 3)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc == 3) {
+    secs = atoi(cmd->argv[2]);
+    if (secs < 0)
+      CONF_ERROR(cmd, "seconds must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSParameterize conn-name */
+MODRET set_sqltdsparameterize(cmd_rec *cmd) {
+  config_rec *c = NULL;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSTimeouts conn-name query-seconds [login-seconds] */
+MODRET set_sqltdstimeouts(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int query = 0, login = 0;
+
+  if (cmd->argc < 3 || cmd->argc > 4)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  query = atoi(cmd->argv[2]);
+  if (query < 0)
+    CONF_ERROR(cmd, "query-seconds must be zero or greater");
+
+  if (cmd->argc == 4) {
+    login = atoi(cmd->argv[3]);
+    if (login < 0)
+      CONF_ERROR(cmd, "login-seconds must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = query;
+  c->argv[2] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[2]) = login;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSResultLimit conn-name rows [bytes] */
+MODRET set_sqltdsresultlimit(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int rows = 0, bytes = 0;
+
+  if (cmd->argc < 3 || cmd->argc > 4)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  rows = atoi(cmd->argv[2]);
+  if (rows < 0)
+    CONF_ERROR(cmd, "rows must be zero or greater");
+
+  if (cmd->argc == 4) {
+    bytes = atoi(cmd->argv[3]);
+    if (bytes < 0)
+      CONF_ERROR(cmd, "bytes must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[1]) = (unsigned long) rows;
+  c->argv[2] = pcalloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[2]) = (size_t) bytes;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSLoginPrefetch conn-name user-table group-table group-where */
+MODRET set_sqltdsloginprefetch(cmd_rec *cmd) {
+  config_rec *c = NULL;
+
+  CHECK_ARGS(cmd, 4);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 4, NULL, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pstrdup(c->pool, cmd->argv[2]);
+  c->argv[2] = pstrdup(c->pool, cmd->argv[3]);
+  c->argv[3] = pstrdup(c->pool, cmd->argv[4]);
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSPageSize conn-name rows key */
+MODRET set_sqltdspagesize(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int rows = 0;
+
+  CHECK_ARGS(cmd, 3);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  rows = atoi(cmd->argv[2]);
+  if (rows < 1)
+    CONF_ERROR(cmd, "rows must be greater than zero");
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[1]) = (unsigned long) rows;
+  c->argv[2] = pstrdup(c->pool, cmd->argv[3]);
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSAuthTimeout seconds */
+MODRET set_sqltdsauthtimeout(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int secs = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  secs = atoi(cmd->argv[1]);
+  if (secs < 0)
+    CONF_ERROR(cmd, "seconds must be zero or greater");
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = secs;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SQLTDSReadServers conn-name server[,server...] [pin-seconds] */
+MODRET set_sqltdsreadservers(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  int pin = 0;
+
+  if (cmd->argc < 3 || cmd->argc > 4)
+    CONF_ERROR(cmd, "wrong number of parameters");
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc == 4) {
+    pin = atoi(cmd->argv[3]);
+    if (pin < 0)
+      CONF_ERROR(cmd, "pin-seconds must be zero or greater");
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+  c->argv[1] = pstrdup(c->pool, cmd->argv[2]);
+  c->argv[2] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[2]) = pin;
+
+  return PR_HANDLED(cmd);
+}
+
+static conftable sql_tds_conftab[] = {
+  { "SQLTDSAuthTimeout",	set_sqltdsauthtimeout,		NULL },
+  { "SQLTDSBroker",		set_sqltdsbroker,		NULL },
+  { "SQLTDSBulkCopy",		set_sqltdsbulkcopy,		NULL },
+  { "SQLTDSDeferResults",	set_sqltdsdeferresults,		NULL },
+  { "SQLTDSLoginPrefetch",	set_sqltdsloginprefetch,	NULL },
+  { "SQLTDSNegativeCache",	set_sqltdsnegativecache,	NULL },
+  { "SQLTDSPageSize",		set_sqltdspagesize,		NULL },
+  { "SQLTDSParameterize",	set_sqltdsparameterize,		NULL },
+  { "SQLTDSPingInterval",	set_sqltdspinginterval,		NULL },
+  { "SQLTDSQueryCache",		set_sqltdsquerycache,		NULL },
+  { "SQLTDSReadServers",	set_sqltdsreadservers,		NULL },
+  { "SQLTDSResultLimit",	set_sqltdsresultlimit,		NULL },
+  { "SQLTDSSharedCache",	set_sqltdssharedcache,		NULL },
+  { "SQLTDSTimeouts",		set_sqltdstimeouts,		NULL },
+  { "SQLTDSUserFilter",		set_sqltdsuserfilter,		NULL },
+  { "SQLTDSWriteBehind",	set_sqltdswritebehind,		NULL },
+
+  { NULL, NULL, NULL }
+};
+
 static void sql_tds_mod_load_ev(const void *event_data, void *user_data) {
 
   if (strcmp("mod_sql_tds.c", (const char *) event_data) == 0) {
@@ -1323,6 +7653,32 @@ static void sql_tds_mod_unload_ev(const void *event_data, void *user_data) {
   }
 }
 
+static void sql_tds_postparse_ev(const void *event_data, void *user_data) {
+  _sql_health_create();
+  _sql_shm_create();
+  _sql_filter_create();
+  _sql_filter_start();
+  _sql_broker_start();
+}
+
+static void sql_tds_restart_ev(const void *event_data, void *user_data) {
+  _sql_filter_stop();
+  _sql_broker_stop();
+  _sql_child_unhook();
+  _sql_shm_destroy();
+  _sql_filter_destroy();
+  _sql_health_destroy();
+}
+
+static void sql_tds_shutdown_ev(const void *event_data, void *user_data) {
+  _sql_filter_stop();
+  _sql_broker_stop();
+  _sql_child_unhook();
+  _sql_shm_destroy();
+  _sql_filter_destroy();
+  _sql_health_destroy();
+}
+
 
 /* Initialization routines
  */
@@ -1335,6 +7691,14 @@ static int sql_tds_init(void) {
   pr_event_register(&sql_tds_module, "core.module-unload",
     sql_tds_mod_unload_ev, NULL);
 
+  /* The broker pool and shared cache live as long as the master does. */
+  pr_event_register(&sql_tds_module, "core.postparse",
+    sql_tds_postparse_ev, NULL);
+  pr_event_register(&sql_tds_module, "core.restart",
+    sql_tds_restart_ev, NULL);
+  pr_event_register(&sql_tds_module, "core.shutdown",
+    sql_tds_shutdown_ev, NULL);
+
   return 0;
 }
 
@@ -1344,10 +7708,37 @@ static int sql_tds_init(void) {
  *  the exit handler.
  */
 static int sql_tds_sess_init(void){
+  /* the broker belongs to the master */
+  if (tds_broker_listenfd >= 0) {
+    close(tds_broker_listenfd);
+    tds_broker_listenfd = -1;
+  }
+  tds_broker_nworkers = 0;
+  if (tds_broker_timerno > 0) {
+    pr_timer_remove(tds_broker_timerno, &sql_tds_module);
+    tds_broker_timerno = -1;
+  }
+
+  /* so is the user filter's rebuild */
+  tds_filter_pid = 0;
+  if (tds_filter_timerno > 0) {
+    pr_timer_remove(tds_filter_timerno, &sql_tds_module);
+    tds_filter_timerno = -1;
+  }
+  _sql_child_unhook();
+
+  _sql_tds_read_config();
+
+  /* connect to the broker now, while the socket is still reachable */
+  if (tds_broker_path) {
+    (void) _sql_broker_connect();
+  }
+
   conn_pool = make_sub_pool(session.pool);
   if( conn_cache == NULL ) {
     conn_cache = make_array(make_sub_pool(session.pool), DEF_CONN_POOL_SIZE,
         sizeof(conn_entry_t *));
+    conn_index = pr_table_alloc(conn_cache->pool, 0);
   }
   return 0;
 }
@@ -1363,9 +7754,9 @@ module sql_tds_module = {
   0x20,                         /* API Version 2.0 */
   "sql_tds",
   /* Module Config Directive */
-  NULL,
+  sql_tds_conftab,
   /* Module Command Handlers */
-  NULL,
+  sql_tds_cmdtab,
   /* Module Authentication Handlers */
   NULL,
   /* Module Init */